@@ -30,6 +30,40 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <utility>
 #include <tuple>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <coroutine>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define NYARKO_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#else
+#define NYARKO_HAVE_IO_URING 0
+#endif
+
+// Build: g++ -std=c++20 -O2 -pthread nyarko_main.cpp
+// Library build (no main): g++ -std=c++20 -O2 -pthread -DNYARKO_LIBRARY -c nyarko_main.cpp
 
 using namespace std;
 
@@ -263,6 +297,20 @@ bool handle_input_error()
 }
 
 
+// Extension that selects the intermediate format (.nyk) instead of BMP
+const string NYK_EXTENSION = ".nyk";
+
+
+/**
+    Checks whether a filename ends with the given extension.
+*/
+bool has_extension(const string& filename, const string& extension)
+{
+    return filename.length() >= extension.length() &&
+           filename.compare(filename.length() - extension.length(), extension.length(), extension) == 0;
+}
+
+
 /**
     Retrieves the filename from the user, validates the input, 
     ensures the filename has a .bmp extension, and allows exiting the program.
@@ -291,8 +339,9 @@ string get_filename(const string& prompt)
             return "q";
         }
 
-        // Ensure filename ends with .bmp
-        if (!filename.empty() && (filename.length() < 4 || filename.substr(filename.length() - 4) != ".bmp"))
+        // Ensure filename ends with .bmp (or the .nyk intermediate format)
+        if (!filename.empty() && (filename.length() < 4 || filename.substr(filename.length() - 4) != ".bmp") &&
+            !has_extension(filename, NYK_EXTENSION))
         {
             filename += ".bmp";
         }
@@ -320,6 +369,28 @@ bool ensure_unique_output_filename(const string& input_filename, const string& o
 }
 
 
+// Highest option number shown in the menu
+const int LAST_MENU_OPTION = 19;
+
+
+/**
+    Prints the effect options of the menu, two per line.
+*/
+void display_effect_menu()
+{
+    cout << setw(32) << left << "(1) Vignette"                   << "(6) Enlarge" << endl;
+    cout << setw(32) << left << "(2) Clarendon"                  << "(7) High contrast" << endl;
+    cout << setw(32) << left << "(3) Grayscale"                  << "(8) Lighten" << endl;
+    cout << setw(32) << left << "(4) Rotate 90 degrees"          << "(9) Darken" << endl;
+    cout << setw(32) << left << "(5) Rotate by multiples of 90"  << "(10) Black, white, red, green, blue" << endl;
+    cout << setw(32) << left << "(11) Box blur"                  << "(13) Sharpen (unsharp mask)" << endl;
+    cout << setw(32) << left << "(12) Gaussian blur"             << "(14) Custom 3x3/5x5 kernel" << endl;
+    cout << setw(32) << left << "(15) Color grade (3D LUT)"      << "(17) Mirror horizontally" << endl;
+    cout << setw(32) << left << "(16) Flip vertically"           << "(18) Transpose" << endl;
+    cout << setw(32) << left << "(19) Crop" << endl;
+}
+
+
 /**
     Displays an image editing menu and prompts the user to select an option.
     
@@ -332,11 +403,7 @@ int prompt_and_get_menu_choice(const string& filename)
     cout << "\nPlease enter option number or 'q' to quit: " << endl;
     cout << endl;
 
-    cout << setw(32) << left << "(1) Vignette"                   << "(6) Enlarge" << endl;
-    cout << setw(32) << left << "(2) Clarendon"                  << "(7) High contrast" << endl;
-    cout << setw(32) << left << "(3) Grayscale"                  << "(8) Lighten" << endl;
-    cout << setw(32) << left << "(4) Rotate 90 degrees"          << "(9) Darken" << endl;
-    cout << setw(32) << left << "(5) Rotate by multiples of 90"  << "(10) Black, white, red, green, blue" << endl;
+    display_effect_menu();
 
     cout << "\n0) Change image (current: " << filename << ")" << endl;
 
@@ -362,7 +429,7 @@ int prompt_and_get_menu_choice(const string& filename)
 
         // Convert string choice to int and check its range
         stringstream str_to_int_converter(choice_str);
-        if (str_to_int_converter >> choice && (choice >= 0 && choice <= 10)) 
+        if (str_to_int_converter >> choice && (choice >= 0 && choice <= LAST_MENU_OPTION)) 
         {
             return choice;
         } 
@@ -374,6 +441,31 @@ int prompt_and_get_menu_choice(const string& filename)
 }
 
 
+// Names of the effects, indexed by menu option
+const string EFFECT_NAMES[] = {
+    "",
+    "Vignette effect",
+    "Clarendon effect",
+    "Greyscale effect",
+    "Rotate 90 degrees effect",
+    "Rotate by multiples of 90 effect",
+    "Enlarge effect",
+    "High contrast effect",
+    "Lightening effect",
+    "Darkening effect",
+    "Black, white, red, green, blue only effect",
+    "Box blur effect",
+    "Gaussian blur effect",
+    "Sharpen effect",
+    "Custom kernel effect",
+    "Color grade effect",
+    "Vertical flip effect",
+    "Horizontal mirror effect",
+    "Transpose effect",
+    "Crop effect"
+};
+
+
 /**
     Outputs a success message describing the image editing effect applied based on user's menu choice.
     
@@ -382,21 +474,7 @@ int prompt_and_get_menu_choice(const string& filename)
 */
 void display_success_message(int choice) 
 {
-    string editing_effect[] = {
-        "",
-        "Vignette effect",
-        "Clarendon effect",
-        "Greyscale effect",
-        "Rotate 90 degrees effect",
-        "Rotate by multiples of 90 effect",
-        "Enlarge effect",
-        "High contrast effect",
-        "Lightening effect",
-        "Darkening effect",
-        "Black, white, red, green, blue only effect"
-    };
-
-    cout << editing_effect[choice] << " successfully applied!\nCheck directory for your edited photo.\n";
+    cout << EFFECT_NAMES[choice] << " successfully applied!\nCheck directory for your edited photo.\n";
 }
 
 
@@ -495,480 +573,10438 @@ double calculate_vignette_scaling_factor(int row, int col, int num_rows, int num
 
 
 //***************************************************************************************************//
-//                              EDITING PROCESS FUNCTIONS                                           //
+//                                    TASK SCHEDULER                                                //
+//
+// One pool of worker threads runs all parallel work in the program. Each worker has its
+// own deque of tasks: it pushes and pops at the back of its own deque, and when that is
+// empty it steals from the front of the others, so whoever is idle picks up the oldest
+// (usually largest) piece of unfinished work. Threads outside the pool push onto a shared
+// queue instead. A thread waiting for a group of tasks keeps running tasks until the
+// group is done, so waiting inside a task never ties up a worker.
 
-// PROCESS 1
-/**
-    Applies the vignette effect to an image by enhancing its center 
-    and fading the edges to darken its corners.
-    This effect is achieved by adjusting each pixel's RGB values 
-    based on its distance from the center.
+// Smallest amount of work, in pixels, worth handing to another thread
+const size_t MIN_TASK_COST = 16384;
 
-    @param image: The original image as a 2D vector of Pixel structs.
-    @returns A modified image with the vignette effect applied.
+// Pieces each parallel_for() is split into per thread, so stealing can even out the load
+const int TASKS_PER_THREAD = 4;
+
+
+/**
+    Count of unfinished tasks that a thread can wait on with TaskScheduler::wait().
 */
-vector<vector<Pixel>> process1(const vector<vector<Pixel>>& image)
+struct TaskGroup
 {
-    // Get image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Initialize a new image with same size
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Process each pixel in the original image
-    for (int row = 0; row < num_rows; row++)
+    atomic<int> remaining;
+
+    explicit TaskGroup(int count) : remaining(count) {}
+};
+
+
+class TaskScheduler
+{
+public:
+    /**
+        @param num_workers: Number of worker threads; the threads that wait on task
+                            groups work too, so this is one less than the core count.
+    */
+    explicit TaskScheduler(int num_workers) : queues(num_workers + 1)
     {
-        for (int col = 0; col < num_columns; col++)
+        for (int i = 0; i < num_workers; i++)
         {
-            // Extract RGB values for current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int red_value = get<0>(rgb_values);
-            int green_value = get<1>(rgb_values);
-            int blue_value = get<2>(rgb_values);
-            
-            // Calculate new RGB values based on scaling factor
-            double scaling_factor = calculate_vignette_scaling_factor(row, col, num_rows, num_columns);
-            int new_red = max(0, min(255, static_cast<int>(red_value * scaling_factor)));
-            int new_green = max(0, min(255, static_cast<int>(green_value * scaling_factor)));
-            int new_blue = max(0, min(255, static_cast<int>(blue_value * scaling_factor)));
-            
-            // Store the processed pixel in the new image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
+            workers.emplace_back(&TaskScheduler::run_worker, this, i);
         }
     }
-    return new_image;
-}
- 
-    
-// PROCESS 2
-/**
-    The Clarendon effect boosts the contrast in an image.
-    Darker pixels become even darker, and lighter pixels become lighter, producing a vivid look.
-    This effect is realized by adjusting the RGB values of each pixel depending on its original intensity.
 
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @param scaling_factor: Multiplier to adjust the contrast intensity.
-    @returns A modified image with the Clarendon effect.
-*/
-vector<vector<Pixel>> process2(const vector<vector<Pixel>>& image, double scaling_factor)
-{    
-    // Fetch the image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Prepare a new image of the same dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Traverse through each pixel of the original image
-    for (int row = 0; row < num_rows; row++)
+    ~TaskScheduler()
     {
-        for (int col = 0; col < num_columns; col++)
         {
-            // Extract the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int red_value = get<0>(rgb_values);
-            int green_value = get<1>(rgb_values);
-            int blue_value = get<2>(rgb_values);
-            
-            // Determine the grayscale intensity of the pixel (average of RGB)
-            int average_value = round(grey_value(red_value, green_value, blue_value));
-            
-            int new_red, new_green, new_blue; // To hold new RGB values
-            
-            // Adjust RGB values based on the pixel's intensity
-            if (average_value >= 170)  // Lighter pixels
-            {
-                new_red = min(255, static_cast<int>(255 - (255 - red_value) * scaling_factor));
-                new_green = min(255, static_cast<int>(255 - (255 - green_value) * scaling_factor));
-                new_blue = min(255, static_cast<int>(255 - (255 - blue_value) * scaling_factor));
-            }
-            else if (average_value < 90)  // Darker pixels
-            {
-                new_red = max(0, static_cast<int>(red_value * scaling_factor));
-                new_green = max(0, static_cast<int>(green_value * scaling_factor));
-                new_blue = max(0, static_cast<int>(blue_value * scaling_factor));
-            }
-            else  // Medium intensity pixels remain unchanged
+            lock_guard<mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    /**
+        Number of threads that run tasks, counting the one waiting for them.
+    */
+    int num_threads() const
+    {
+        return static_cast<int>(workers.size()) + 1;
+    }
+
+    /**
+        Queues a task: on the calling worker's own deque, or on the shared queue when
+        called from any other thread.
+    */
+    void spawn(function<void()> task)
+    {
+        TaskQueue& queue = queues[own_queue()];
+        {
+            lock_guard<mutex> lock(queue.queue_mutex);
+            queue.tasks.push_back(move(task));
+        }
+        queued++;
+        if (sleepers > 0)
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            work_ready.notify_one();
+        }
+    }
+
+    /**
+        Marks one task of a group as finished, waking the thread waiting on the group
+        if it was the last one. The group may be destroyed as soon as this returns.
+    */
+    void finish(TaskGroup& group)
+    {
+        if (--group.remaining == 0)
+        {
+            lock_guard<mutex> lock(sleep_mutex);
+            work_ready.notify_all();
+        }
+    }
+
+    /**
+        Runs queued tasks until every task of the group has finished.
+    */
+    void wait(TaskGroup& group)
+    {
+        while (group.remaining > 0)
+        {
+            if (!run_one())
             {
-                new_red = red_value;
-                new_green = green_value;
-                new_blue = blue_value;
+                sleep_until([&]() { return group.remaining == 0; });
             }
-            
-            // Insert the modified pixel into the new image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
         }
     }
 
-    return new_image;  // Return the image with applied Clarendon effect
-}    
+private:
+    struct TaskQueue
+    {
+        mutex queue_mutex;
+        deque<function<void()>> tasks;
+    };
 
-    
-// PROCESS 3
-/**
-    Applies the Greyscale effect to an image by converting each pixel's RGB values 
-    into their average. This turns the image into shades of grey while maintaining 
-    the original intensity of each pixel.
+    vector<TaskQueue> queues;  // One per worker, then the shared queue
+    vector<thread> workers;
+    atomic<int> queued{0};     // Tasks in all queues
+    atomic<int> sleepers{0};   // Threads waiting for work_ready
+    mutex sleep_mutex;
+    condition_variable work_ready;
+    bool stopping = false;
 
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @returns An image transformed into greyscale.
-*/
-vector<vector<Pixel>> process3(const vector<vector<Pixel>>& image)
-{
-    // Fetch the image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Prepare a new image of the same dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Traverse through each pixel of the original image
-    for (int row = 0; row < num_rows; row++)
+    static int& worker_index()
     {
-        for (int col = 0; col < num_columns; col++)
+        thread_local int index = -1;
+        return index;
+    }
+
+    int own_queue() const
+    {
+        return (worker_index() >= 0) ? worker_index() : static_cast<int>(queues.size()) - 1;
+    }
+
+    /**
+        Takes a task from the back of the given queue, or the front when stealing.
+    */
+    bool take(int queue_index, bool from_back, function<void()>& task)
+    {
+        TaskQueue& queue = queues[queue_index];
+        lock_guard<mutex> lock(queue.queue_mutex);
+        if (queue.tasks.empty())
         {
-            // Extract the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int red_value = get<0>(rgb_values);
-            int green_value = get<1>(rgb_values);
-            int blue_value = get<2>(rgb_values);
-            
-            // Determine the grayscale value (average of RGB)
-            int average_value = round(grey_value(red_value, green_value, blue_value));
-            
-            // Convert pixel to greyscale by setting its RGB values to the average value
-            int new_red = average_value;
-            int new_green = average_value;
-            int new_blue = average_value;
-            
-            // Insert the greyscale pixel into the new image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
+            return false;
+        }
+        if (from_back)
+        {
+            task = move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = move(queue.tasks.front());
+            queue.tasks.pop_front();
         }
+        queued--;
+        return true;
     }
 
-    return new_image;  // Return the image in greyscale
-}    
+    /**
+        Runs one task: the newest of this thread's own, otherwise the oldest of the
+        shared queue's, otherwise one stolen from another worker.
 
-    
-// PROCESS 4
-/**
-    Applies the Rotate-by-90 effect to an image by repositioning each pixel such that 
-    the image is rotated clockwise by 90 degrees. The RGB values of each pixel remain the same.
+        @returns true if a task was run, false if every queue was empty.
+    */
+    bool run_one()
+    {
+        if (queued == 0)
+        {
+            return false;
+        }
+        function<void()> task;
+        int own = own_queue();
+        int shared = static_cast<int>(queues.size()) - 1;
+        bool found = take(own, true, task) || take(shared, false, task);
+        for (int i = 0; !found && i < shared; i++)
+        {
+            int victim = (own + 1 + i) % shared;  // Steal, starting with the next worker
+            found = (victim != own) && take(victim, false, task);
+        }
+        if (found)
+        {
+            task();
+        }
+        return found;
+    }
 
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @returns An image that has been rotated 90 degrees clockwise.
-*/
-vector<vector<Pixel>> process4(const vector<vector<Pixel>>& image)
-{
-    // Fetch the image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Initialize a new image with swapped dimensions due to the 90-degree rotation
-    vector<vector<Pixel>> new_image = initialize_new_image(num_columns, num_rows);
-    
-    // Traverse through each pixel of the original image
-    for (int row = 0; row < num_rows; row++)
+    /**
+        Sleeps until there is work queued, the scheduler is stopping or done() is true.
+    */
+    void sleep_until(const function<bool()>& done)
     {
-        for (int col = 0; col < num_columns; col++)
+        unique_lock<mutex> lock(sleep_mutex);
+        sleepers++;
+        work_ready.wait(lock, [&]() { return queued > 0 || stopping || done(); });
+        sleepers--;
+    }
+
+    void run_worker(int index)
+    {
+        worker_index() = index;
+        while (true)
         {
-            // Extract the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int red_value = get<0>(rgb_values);
-            int green_value = get<1>(rgb_values);
-            int blue_value = get<2>(rgb_values);        
-            
-            // Place the pixel in its new position in the rotated image
-            // Here, columns become rows, and rows are inverted to become columns
-            store_pixel(new_image, col, (num_rows - 1) - row, red_value, green_value, blue_value);
+            if (!run_one())
+            {
+                sleep_until([]() { return false; });
+                if (stopping && queued == 0)
+                {
+                    return;
+                }
+            }
         }
     }
+};
 
-    return new_image;  // Return the rotated image
-}
 
-    
-// PROCESS 5
 /**
-    Rotates an image by multiples of 90 degrees based on the user's input.
-    
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @param number: An integer value corresponding to the number of 90-degree rotations desired.
-    @returns A modified image that has been rotated by the specified multiple of 90 degrees.
+    The program's task scheduler, started on first use with one worker per
+    hardware thread besides the caller.
 */
-vector<vector<Pixel>> process5(const vector<vector<Pixel>>& image, int number)
+TaskScheduler& task_scheduler()
 {
-    switch(number % 4)  // As we are rotating in 90 degree increments, taking modulo 4 will give us the effective rotations
-    {
-        case 0:
-            // No rotation needed
-            return image;
-        case 1:
-            // 90-degree rotation
-            return process4(image);
-        case 2:
-            // 180-degree rotation (two 90-degree rotations)
-            return process4(process4(image));
-        case 3:
-            // 270-degree rotation (three 90-degree rotations)
-            return process4(process4(process4(image)));
-    }
-    // This part shouldn't execute
-    cout << "Unexpected rotation value. Returning original image." << endl;
-    return image;
+    static TaskScheduler scheduler(max(1, static_cast<int>(thread::hardware_concurrency())) - 1);
+    return scheduler;
 }
 
-    
-// PROCESS 6
+
 /**
-    Enlarges an image based on specified x and y scale factors. Pixels in the enlarged image 
-    are mapped back to their respective positions in the original image.
+    Runs a number of independent tasks on the task scheduler. Consecutive tasks are
+    grouped into pieces of at least MIN_TASK_COST pixels, so a small image runs as a
+    single piece on the calling thread while a large one is split into row or tile
+    pieces that idle workers steal. The calling thread runs pieces too until all are done.
 
-    @param image: The original image, represented as a 2D vector of Pixel structs.
-    @param xscale: Scale factor for the width.
-    @param yscale: Scale factor for the height.
-    @returns An image enlarged by the given x and y scale factors.
+    @param num_tasks: Number of tasks to run, numbered 0 to num_tasks - 1.
+    @param task: Function called once with the number of each task.
+    @param cost_per_task: Approximate number of pixels each task processes.
 */
-vector<vector<Pixel>> process6(const vector<vector<Pixel>>& image, int xscale, int yscale)
+void parallel_for(int num_tasks, const function<void(int)>& task, size_t cost_per_task = MIN_TASK_COST)
 {
-    // Obtain the original image's dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    
-    // Calculate new dimensions for the enlarged image
-    int new_rows = yscale * dimensions.first;
-    int new_cols = xscale * dimensions.second;
-
-    // Set up the enlarged image with the new dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(new_rows, new_cols);
-    
-    // Iterate through each position in the enlarged image
-    for (int row = 0; row < new_rows; row++)
+    TaskScheduler& scheduler = task_scheduler();
+    int num_threads = scheduler.num_threads();
+    int min_piece = static_cast<int>(min<size_t>(num_tasks, (MIN_TASK_COST + cost_per_task - 1) / max<size_t>(1, cost_per_task)));
+    int piece_size = max({1, min_piece, (num_tasks + num_threads * TASKS_PER_THREAD - 1) / (num_threads * TASKS_PER_THREAD)});
+    int num_pieces = (num_tasks + piece_size - 1) / piece_size;
+    if (num_threads <= 1 || num_pieces <= 1)
     {
-        for (int col = 0; col < new_cols; col++)
+        for (int i = 0; i < num_tasks; i++)
         {
-            // Retrieve the corresponding pixel's RGB values from the original image
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row / yscale, col / xscale);
-            
-            // Fill the enlarged image's pixel with the fetched RGB values
-            store_pixel(new_image, row, col, get<0>(rgb_values), get<1>(rgb_values), get<2>(rgb_values));
+            task(i);
         }
+        return;
+    }
+
+    TaskGroup group(num_pieces);
+    for (int piece = 0; piece < num_pieces; piece++)
+    {
+        scheduler.spawn([&, piece]()
+        {
+            int end = min(num_tasks, (piece + 1) * piece_size);
+            for (int i = piece * piece_size; i < end; i++)
+            {
+                task(i);
+            }
+            scheduler.finish(group);
+        });
     }
+    scheduler.wait(group);
+}
+
+
+//***************************************************************************************************//
+//                                      BMP DECODER                                                 //
+
+// Alpha (opacity) values of an image, one per pixel, stored beside the Pixel rows.
+// Left empty for opaque images.
+using AlphaPlane = vector<vector<unsigned char>>;
+
+
+/**
+    Creates a fully opaque alpha plane with given dimensions.
 
-    return new_image;  // Return the enlarged image
+    @param num_rows: Number of rows.
+    @param num_columns: Number of columns.
+    @returns The alpha plane with every value set to 255.
+*/
+AlphaPlane initialize_alpha_plane(int num_rows, int num_columns)
+{
+    return AlphaPlane(num_rows, vector<unsigned char>(num_columns, 255));
 }
 
 
-// PROCESS 7
 /**
-    Converts an image to high-contrast black and white using a threshold based on pixel brightness. 
-    Pixels with a brightness above the threshold are turned white; those below are turned black.
+    Checks whether every value of an alpha plane is zero.
 
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @returns An image that has been modified for high-contrast black and white effect.
+    @param alpha: The alpha plane.
+    @returns true if all values are zero.
 */
-vector<vector<Pixel>> process7(const vector<vector<Pixel>>& image)
+bool is_alpha_plane_zero(const AlphaPlane& alpha)
 {
-    // Determine the dimensions of the original image
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Prepare the modified image with the same dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Traverse the original image to apply the effect
-    for (int row = 0; row < num_rows; row++)
+    for (const vector<unsigned char>& row : alpha)
     {
-        for (int col = 0; col < num_columns; col++)
+        for (unsigned char value : row)
         {
-            // Fetch the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int average_value = round(grey_value(get<0>(rgb_values), get<1>(rgb_values), get<2>(rgb_values)));
-            
-            // Determine new RGB values based on the brightness threshold
-            int new_red, new_green, new_blue;
-            if (average_value >= 128)  // Half of 255 to decide the threshold
+            if (value != 0)
             {
-                new_red = new_green = new_blue = 255;  // Assign white
+                return false;
             }
-            else
-            {
-                new_red = new_green = new_blue = 0;  // Assign black
-            }
-
-            // Update the pixel in the modified image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
         }
     }
-
-    return new_image;  // Return the processed image
+    return true;
 }
 
-    
+// DIB header compression methods understood by the decoder
+const int BMP_BI_RGB = 0;
+const int BMP_BI_BITFIELDS = 3;
+const int BMP_BI_ALPHABITFIELDS = 6;
+
+
+/**
+    Layout of a BMP file's pixel array, taken from its headers.
+*/
+struct BmpInfo
+{
+    int width = 0;
+    int height = 0;               // Always positive; see top_down
+    bool top_down = false;        // Negative height in the file: first stored row is the top row
+    int bits_per_pixel = 0;
+    int compression = BMP_BI_RGB;
+    size_t pixel_offset = 0;      // Start of the pixel array
+    size_t row_stride = 0;        // Bytes per stored row, including padding
+    unsigned int masks[4] = {0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000};  // Red, green, blue, alpha
+    vector<Pixel> palette;        // Colors of palettized (8 bpp) images
+};
+
+
+/**
+    Gets an unsigned little-endian integer from a byte buffer.
+    Buffer counterpart of get_int().
+
+    @param data: The buffer.
+    @param offset: The offset at which to read the integer.
+    @param bytes: The number of bytes to read.
+    @returns The integer starting at the given offset.
+*/
+unsigned int get_uint(const unsigned char* data, size_t offset, int bytes)
+{
+    unsigned int result = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        result |= static_cast<unsigned int>(data[offset + i]) << (8 * i);
+    }
+    return result;
+}
+
+
+/**
+    Reads the BMP and DIB headers (and palette or bit masks, if any) from a buffer
+    holding the start of a BMP file, checking that the pixel array fits in the file.
+
+    @param data: Buffer holding the file.
+    @param size: Size of the buffer.
+    @param file_size: Size of the whole file (the buffer may hold only its headers).
+    @param info: Receives the pixel array layout.
+    @returns true if the file is a BMP the decoder supports, false otherwise.
+*/
+bool parse_bmp_header(const unsigned char* data, size_t size, size_t file_size, BmpInfo& info)
+{
+    const size_t BMP_HEADER_SIZE = 14;
+    if (size < BMP_HEADER_SIZE + 40 || data[0] != 'B' || data[1] != 'M')
+    {
+        return false;
+    }
+
+    size_t dib_header_size = get_uint(data, 14, 4);
+    info.pixel_offset = get_uint(data, 10, 4);
+    info.width = static_cast<int>(get_uint(data, 18, 4));
+    int height = static_cast<int>(get_uint(data, 22, 4));
+    info.bits_per_pixel = get_uint(data, 28, 2);
+    info.compression = get_uint(data, 30, 4);
+
+    if (dib_header_size < 40 || info.width <= 0 || height == 0 || height == numeric_limits<int>::min())
+    {
+        return false;
+    }
+
+    // The DIB header must fit in the bytes given, and the pixel array must start after it
+    if (dib_header_size > size - BMP_HEADER_SIZE || info.pixel_offset < BMP_HEADER_SIZE + dib_header_size)
+    {
+        return false;
+    }
+    info.top_down = height < 0;
+    info.height = abs(height);
+
+    // Bit masks follow the 40 byte header (and sit inside the larger V4/V5 headers)
+    if (info.compression == BMP_BI_BITFIELDS || info.compression == BMP_BI_ALPHABITFIELDS)
+    {
+        int num_masks = (info.compression == BMP_BI_ALPHABITFIELDS || dib_header_size >= 56) ? 4 : 3;
+        if (size < BMP_HEADER_SIZE + 40 + 4 * num_masks || (info.bits_per_pixel != 16 && info.bits_per_pixel != 32))
+        {
+            return false;
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            info.masks[i] = (i < num_masks) ? get_uint(data, BMP_HEADER_SIZE + 40 + 4 * i, 4) : 0;
+        }
+    }
+    else if (info.compression == BMP_BI_RGB)
+    {
+        if (info.bits_per_pixel == 16)
+        {
+            info.masks[0] = 0x7C00;
+            info.masks[1] = 0x03E0;
+            info.masks[2] = 0x001F;
+            info.masks[3] = 0;
+        }
+        else if (info.bits_per_pixel != 8 && info.bits_per_pixel != 24 && info.bits_per_pixel != 32)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;  // Run-length encoded and embedded JPEG/PNG images are not supported
+    }
+
+    // The palette follows the DIB header; 4 bytes (blue, green, red, unused) per color
+    if (info.bits_per_pixel == 8)
+    {
+        size_t num_colors = get_uint(data, 46, 4);
+        if (num_colors == 0 || num_colors > 256)
+        {
+            num_colors = 256;
+        }
+        size_t palette_start = BMP_HEADER_SIZE + dib_header_size;
+        num_colors = min(num_colors, (min(size, info.pixel_offset) - palette_start) / 4);
+
+        // Indexes past the end of a short palette decode as black
+        info.palette.assign(256, Pixel{0, 0, 0});
+        for (size_t i = 0; i < num_colors; i++)
+        {
+            const unsigned char* entry = data + palette_start + 4 * i;
+            info.palette[i] = Pixel{entry[2], entry[1], entry[0]};
+        }
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    info.row_stride = (static_cast<size_t>(info.width) * info.bits_per_pixel + 31) / 32 * 4;
+    return info.pixel_offset + info.row_stride * info.height <= file_size;
+}
+
+
+/**
+    Decodes one row of 8 bpp palette indexes by looking every index up in the palette.
+*/
+void decode_row_palette(const unsigned char* src, vector<Pixel>& row, const vector<Pixel>& palette)
+{
+    const Pixel* lut = palette.data();
+    for (size_t col = 0; col < row.size(); col++)
+    {
+        row[col] = lut[src[col]];
+    }
+}
+
+
+/**
+    Decodes one row of 24 bpp blue, green, red triples.
+*/
+void decode_row_bgr(const unsigned char* src, vector<Pixel>& row)
+{
+    for (size_t col = 0; col < row.size(); col++, src += 3)
+    {
+        row[col] = Pixel{src[2], src[1], src[0]};
+    }
+}
+
+
+/**
+    Decodes one row of 32 bpp blue, green, red, alpha quads (the standard channel order).
+    With SSE2, four pixels at a time are widened from bytes to ints and shuffled into
+    red, green, blue order. Each 16 byte store spills one int into the next pixel,
+    which the following store overwrites, so the last pixel is always done by the
+    scalar loop.
+*/
+void decode_row_bgra(const unsigned char* src, vector<Pixel>& row)
+{
+    size_t num_columns = row.size();
+    size_t col = 0;
+#if defined(__SSE2__)
+    static_assert(sizeof(Pixel) == 3 * sizeof(int), "Pixel must be three packed ints");
+    const __m128i zero = _mm_setzero_si128();
+    int* dst = &row[0].red;
+    for (; col + 4 < num_columns; col += 4)
+    {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4 * col));
+        __m128i low = _mm_unpacklo_epi8(bytes, zero);
+        __m128i high = _mm_unpackhi_epi8(bytes, zero);
+        __m128i pixels[4] = {_mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                             _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+        for (int i = 0; i < 4; i++)
+        {
+            // (blue, green, red, alpha) -> (red, green, blue, alpha)
+            __m128i rgb = _mm_shuffle_epi32(pixels[i], _MM_SHUFFLE(3, 0, 1, 2));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * (col + i)), rgb);
+        }
+    }
+#endif
+    for (; col < num_columns; col++)
+    {
+        const unsigned char* p = src + 4 * col;
+        row[col] = Pixel{p[2], p[1], p[0]};
+    }
+}
+
+
+/**
+    Extracts one channel from a packed pixel using its bit mask, scaled to 0-255.
+
+    @param value: The packed pixel.
+    @param mask: The channel's bit mask.
+    @returns The channel value, or 0 if the mask is empty.
+*/
+int extract_masked_channel(unsigned int value, unsigned int mask)
+{
+    if (mask == 0)
+    {
+        return 0;
+    }
+    int shift = 0;
+    while (((mask >> shift) & 1) == 0)
+    {
+        shift++;
+    }
+    unsigned int max_value = mask >> shift;
+    return static_cast<int>(static_cast<unsigned long long>((value & mask) >> shift) * 255 / max_value);
+}
+
+
+/**
+    Decodes one row of 16 or 32 bpp pixels with arbitrary bit masks.
+*/
+void decode_row_masked(const unsigned char* src, vector<Pixel>& row, const BmpInfo& info)
+{
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    for (size_t col = 0; col < row.size(); col++, src += bytes_per_pixel)
+    {
+        unsigned int value = get_uint(src, 0, bytes_per_pixel);
+        row[col] = Pixel{extract_masked_channel(value, info.masks[0]),
+                         extract_masked_channel(value, info.masks[1]),
+                         extract_masked_channel(value, info.masks[2])};
+    }
+}
+
+
+/**
+    Copies the alpha channel of one row of 32 bpp pixels (or 16 bpp with an alpha mask).
+*/
+void decode_row_alpha(const unsigned char* src, vector<unsigned char>& alpha_row, const BmpInfo& info)
+{
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    if (info.bits_per_pixel == 32 && info.masks[3] == 0xFF000000)
+    {
+        for (size_t col = 0; col < alpha_row.size(); col++)
+        {
+            alpha_row[col] = src[4 * col + 3];
+        }
+        return;
+    }
+    for (size_t col = 0; col < alpha_row.size(); col++, src += bytes_per_pixel)
+    {
+        alpha_row[col] = extract_masked_channel(get_uint(src, 0, bytes_per_pixel), info.masks[3]);
+    }
+}
+
+
+/**
+    Decodes one stored row of a BMP pixel array with the fast path for its pixel format.
+
+    @param src: Start of the stored row, or of the first column to decode.
+    @param info: Layout of the file.
+    @param row: Receives the pixels; its size is the number of pixels decoded.
+    @param alpha_row: If given, receives the alpha channel of the same pixels.
+*/
+void decode_bmp_row(const unsigned char* src, const BmpInfo& info, vector<Pixel>& row, vector<unsigned char>* alpha_row)
+{
+    bool standard_masks = info.masks[0] == 0x00FF0000 && info.masks[1] == 0x0000FF00 && info.masks[2] == 0x000000FF;
+    if (info.bits_per_pixel == 8)
+    {
+        decode_row_palette(src, row, info.palette);
+    }
+    else if (info.bits_per_pixel == 24)
+    {
+        decode_row_bgr(src, row);
+    }
+    else if (info.bits_per_pixel == 32 && standard_masks)
+    {
+        decode_row_bgra(src, row);
+    }
+    else
+    {
+        decode_row_masked(src, row, info);
+    }
+
+    if (alpha_row != nullptr)
+    {
+        decode_row_alpha(src, *alpha_row, info);
+    }
+}
+
+
+/**
+    Whether a BMP file can carry alpha: only 32 bpp files and files with an alpha mask can.
+*/
+bool bmp_has_alpha(const BmpInfo& info)
+{
+    return info.bits_per_pixel != 8 && info.bits_per_pixel != 24 && info.masks[3] != 0;
+}
+
+
+/**
+    Whether a BMP file's alpha may be unused. Plain 32 bpp files often leave the fourth
+    byte at zero, meaning "unused" rather than transparent, so an alpha channel that is
+    zero throughout is dropped for them.
+*/
+bool bmp_alpha_may_be_unused(const BmpInfo& info)
+{
+    return bmp_has_alpha(info) && info.compression == BMP_BI_RGB;
+}
+
+
+/**
+    Drops the alpha plane read from a BMP file if the file leaves it unused.
+
+    @param info: Header of the file.
+    @param alpha: The alpha plane read from it, or nullptr.
+*/
+void drop_unused_bmp_alpha(const BmpInfo& info, AlphaPlane* alpha)
+{
+    if (alpha != nullptr && bmp_alpha_may_be_unused(info) && is_alpha_plane_zero(*alpha))
+    {
+        alpha->clear();
+    }
+}
+
+
+/**
+    Decodes a BMP file held in memory into an existing image, resizing it to fit.
+    Rows that are already the right size are reused, so decoding frames of the same
+    size one after another allocates nothing. Supports everything decode_bmp() does.
+
+    @param data: Buffer holding the whole file.
+    @param size: Size of the buffer.
+    @param image: Receives the image.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns true if the buffer held a supported BMP, false otherwise (image is then unchanged).
+*/
+bool decode_bmp_into(const unsigned char* data, size_t size, vector<vector<Pixel>>& image, AlphaPlane* alpha = nullptr)
+{
+    BmpInfo info;
+    if (!parse_bmp_header(data, size, size, info))
+    {
+        return false;
+    }
+
+    image.resize(info.height);
+    bool has_alpha = alpha != nullptr && bmp_has_alpha(info);
+    if (alpha != nullptr)
+    {
+        alpha->resize(has_alpha ? info.height : 0);
+    }
+
+    parallel_for(info.height, [&](int row)
+    {
+        image[row].resize(info.width);
+        if (has_alpha)
+        {
+            (*alpha)[row].resize(info.width);
+        }
+
+        // Bottom-up files store the last row first; top-down rows are already in order
+        int stored_row = info.top_down ? row : info.height - 1 - row;
+        const unsigned char* src = data + info.pixel_offset + info.row_stride * stored_row;
+        decode_bmp_row(src, info, image[row], has_alpha ? &(*alpha)[row] : nullptr);
+    }, info.width);
+
+    drop_unused_bmp_alpha(info, alpha);
+    return true;
+}
+
+
+/**
+    Decodes a BMP file held in memory. Supports 8 bpp palettized, 24 bpp and 32 bpp
+    images (BI_RGB or BI_BITFIELDS), stored bottom-up or top-down. Rows are decoded
+    in parallel, each with the fast path for its pixel format.
+
+    @param data: Buffer holding the whole file.
+    @param size: Size of the buffer.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns The image as a 2D vector of Pixels, or an empty vector if the file is not a supported BMP.
+*/
+vector<vector<Pixel>> decode_bmp(const unsigned char* data, size_t size, AlphaPlane* alpha = nullptr)
+{
+    vector<vector<Pixel>> image;
+    if (alpha != nullptr)
+    {
+        alpha->clear();
+    }
+    decode_bmp_into(data, size, image, alpha);
+    return image;
+}
+
+
+/**
+    Reads a whole file into memory with a single read.
+
+    @param filename: Name of the file.
+    @param bytes: Receives the contents of the file.
+    @returns true if the file was read, false otherwise.
+*/
+bool read_file_bytes(const string& filename, vector<unsigned char>& bytes)
+{
+    ifstream stream(filename, ios::in | ios::binary | ios::ate);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    streamsize size = stream.tellg();
+    if (size <= 0)
+    {
+        return false;
+    }
+    bytes.resize(size);
+    stream.seekg(0);
+    return static_cast<bool>(stream.read(reinterpret_cast<char*>(bytes.data()), size));
+}
+
+
+/**
+    Reads the BMP image specified. Unlike read_image(), this handles 8, 24 and 32 bpp
+    files, bit masks and top-down images, keeps the alpha channel, and reads the file in one go.
+
+    @param filename: BMP image filename.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns The image as a vector of vector of Pixels, or an empty vector if it could not be read.
+*/
+vector<vector<Pixel>> read_bmp(const string& filename, AlphaPlane* alpha = nullptr)
+{
+    vector<unsigned char> bytes;
+    if (!read_file_bytes(filename, bytes))
+    {
+        return {};
+    }
+    return decode_bmp(bytes.data(), bytes.size(), alpha);
+}
+
+
+//***************************************************************************************************//
+//                                      BMP ENCODER                                                 //
+
+/**
+    Builds the BMP and DIB headers encode_bmp() writes for an image. Opaque images get
+    exactly the headers write_image() writes (24 bpp BI_RGB). Images with an alpha plane
+    get 32 bpp blue, green, red, alpha with a BITMAPV4 header giving the bit masks.
+
+    @param width_pixels: Width of the image.
+    @param height_pixels: Height of the image.
+    @param has_alpha: Whether the image has an alpha plane.
+    @param row_bytes: Receives the size of a stored row, including padding.
+    @returns The header bytes; the pixel array follows them.
+*/
+vector<unsigned char> encode_bmp_header(int width_pixels, int height_pixels, bool has_alpha, size_t& row_bytes)
+{
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = has_alpha ? 108 : 40;
+    const int bytes_per_pixel = has_alpha ? 4 : 3;
+
+    // Scan lines must occupy multiples of four bytes
+    row_bytes = (static_cast<size_t>(width_pixels) * bytes_per_pixel + 3) / 4 * 4;
+    size_t array_bytes = row_bytes * height_pixels;
+    size_t header_bytes = BMP_HEADER_SIZE + DIB_HEADER_SIZE;
+    vector<unsigned char> bytes(header_bytes, 0);
+    unsigned char* bmp_header = bytes.data();
+    unsigned char* dib_header = bytes.data() + BMP_HEADER_SIZE;
+
+    // BMP Header
+    set_bytes(bmp_header,  0, 1, 'B');              // ID field
+    set_bytes(bmp_header,  1, 1, 'M');              // ID field
+    set_bytes(bmp_header,  2, 4, header_bytes + array_bytes); // Size of BMP file
+    set_bytes(bmp_header, 10, 4, header_bytes);     // Pixel array offset
+
+    // DIB Header
+    set_bytes(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    set_bytes(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    set_bytes(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    set_bytes(dib_header, 12, 2, 1);                // Number of color planes
+    set_bytes(dib_header, 14, 2, bytes_per_pixel * 8); // Number of bits per pixel
+    set_bytes(dib_header, 16, 4, has_alpha ? BMP_BI_BITFIELDS : BMP_BI_RGB); // Compression method
+    set_bytes(dib_header, 20, 4, array_bytes);      // Size of raw bitmap data (including padding)
+    set_bytes(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    set_bytes(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    if (has_alpha)
+    {
+        set_bytes(dib_header, 40, 4, 0x00FF0000);   // Red mask
+        set_bytes(dib_header, 44, 4, 0x0000FF00);   // Green mask
+        set_bytes(dib_header, 48, 4, 0x000000FF);   // Blue mask
+        set_bytes(dib_header, 52, 4, 0xFF000000);   // Alpha mask
+        set_bytes(dib_header, 56, 4, 0x73524742);   // Color space ('sRGB')
+    }
+    return bytes;
+}
+
+
+/**
+    Encodes one row of pixels as stored BMP bytes: blue, green, red, and alpha if an
+    alpha row is given. Padding bytes at the end of the stored row are not touched.
+
+    @param row: The pixels.
+    @param alpha_row: The row's alpha values, or null for an opaque image.
+    @param dst: Start of the stored row.
+*/
+void encode_bmp_row(const vector<Pixel>& row, const vector<unsigned char>* alpha_row, unsigned char* dst)
+{
+    size_t num_columns = row.size();
+    if (alpha_row != nullptr)
+    {
+        for (size_t w = 0; w < num_columns; w++, dst += 4)
+        {
+            dst[0] = row[w].blue;
+            dst[1] = row[w].green;
+            dst[2] = row[w].red;
+            dst[3] = (*alpha_row)[w];
+        }
+        return;
+    }
+    for (size_t w = 0; w < num_columns; w++, dst += 3)
+    {
+        dst[0] = row[w].blue;
+        dst[1] = row[w].green;
+        dst[2] = row[w].red;
+    }
+}
+
+
+/**
+    Encodes an image as a BMP file into an existing buffer, resizing it to fit, so
+    encoding frames of the same size one after another allocates nothing. The
+    headers are those encode_bmp_header() gives; 32 bpp pixels keep every row
+    aligned, so images with alpha need no padding.
+
+    @param width_pixels: Width of the image.
+    @param height_pixels: Height of the image.
+    @param has_alpha: Whether to store an alpha channel (32 bpp).
+    @param encode_row: Called as encode_row(row, dst) to encode each image row the way encode_bmp_row() does.
+    @param bytes: Receives the bytes of the BMP file.
+*/
+template <typename RowEncoder>
+void encode_bmp_rows_into(int width_pixels, int height_pixels, bool has_alpha, const RowEncoder& encode_row,
+                          vector<unsigned char>& bytes)
+{
+    size_t row_bytes;
+    vector<unsigned char> header = encode_bmp_header(width_pixels, height_pixels, has_alpha, row_bytes);
+    size_t header_bytes = header.size();
+    size_t pixel_bytes = static_cast<size_t>(width_pixels) * (has_alpha ? 4 : 3);
+    bytes.resize(header_bytes + row_bytes * height_pixels);
+    copy(header.begin(), header.end(), bytes.begin());
+
+    // Pixel Array (Left to right, bottom to top), rows encoded in parallel
+    parallel_for(height_pixels, [&](int h)
+    {
+        unsigned char* dst = bytes.data() + header_bytes + row_bytes * (height_pixels - 1 - h);
+        encode_row(h, dst);
+        fill(dst + pixel_bytes, dst + row_bytes, 0);  // The buffer may hold an earlier image
+    }, width_pixels);
+}
+
+
+/**
+    Encodes an image as a BMP file into an existing buffer (see encode_bmp_rows_into()).
+
+    @param image: The image to encode.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @param bytes: Receives the bytes of the BMP file.
+*/
+void encode_bmp_into(const vector<vector<Pixel>>& image, const AlphaPlane& alpha, vector<unsigned char>& bytes)
+{
+    pair<int, int> dimensions = get_image_dimensions(image);
+    bool has_alpha = !alpha.empty();
+    encode_bmp_rows_into(dimensions.second, dimensions.first, has_alpha, [&](int h, unsigned char* dst)
+    {
+        encode_bmp_row(image[h], has_alpha ? &alpha[h] : nullptr, dst);
+    }, bytes);
+}
+
+
+/**
+    Encodes an image as a BMP file in memory (see encode_bmp_into()).
+
+    @param image: The image to encode.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns The bytes of the BMP file.
+*/
+vector<unsigned char> encode_bmp(const vector<vector<Pixel>>& image, const AlphaPlane& alpha)
+{
+    vector<unsigned char> bytes;
+    encode_bmp_into(image, alpha, bytes);
+    return bytes;
+}
+
+
+/**
+    Writes a buffer to a file with a single write.
+
+    @param filename: Name of the file.
+    @param bytes: The contents to write.
+    @returns true if the file was written, false otherwise.
+*/
+bool write_file_bytes(const string& filename, const vector<unsigned char>& bytes)
+{
+    ofstream stream(filename, ios::out | ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    stream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return static_cast<bool>(stream);
+}
+
+
+/**
+    Writes an image to a BMP file, as 32 bpp with alpha if an alpha plane is given
+    and as 24 bpp otherwise.
+
+    @param filename: The BMP file name to save the image to.
+    @param image: The image to save.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns True if successful and false otherwise.
+*/
+bool write_bmp(const string& filename, const vector<vector<Pixel>>& image, const AlphaPlane& alpha = AlphaPlane())
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    return write_file_bytes(filename, encode_bmp(image, alpha));
+}
+
+
+//***************************************************************************************************//
+//                                 PARALLEL BMP FILE I/O                                            //
+//
+// A BMP pixel array has a fixed row stride, so the file offset of any row is known from
+// the headers alone. Large files are therefore split into ranges of rows, and each range
+// is read and decoded, or encoded and written, by its own task with positional I/O
+// (pread/pwrite) on a shared file descriptor. Files being written are preallocated to
+// their final size first. Small files gain nothing from this and use a single read or write.
+
+// Files at least this large use the parallel reader and writer
+const size_t PARALLEL_IO_MIN_BYTES = 8 << 20;
+
+// Bytes of pixel array each read or write task handles
+const size_t PARALLEL_IO_CHUNK_BYTES = 2 << 20;
+
+
+/**
+    Reads exactly size bytes at an offset, retrying short and interrupted reads.
+
+    @returns true if all the bytes were read.
+*/
+bool pread_fully(int fd, unsigned char* buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pread(fd, buffer, size, offset);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+
+/**
+    Writes exactly size bytes at an offset, retrying short and interrupted writes.
+
+    @returns true if all the bytes were written.
+*/
+bool pwrite_fully(int fd, const unsigned char* buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t count = pwrite(fd, buffer, size, offset);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+        offset += count;
+    }
+    return true;
+}
+
+
+/**
+    Number of rows a parallel I/O task handles, so that each moves about PARALLEL_IO_CHUNK_BYTES.
+*/
+int rows_per_io_task(size_t row_bytes)
+{
+    return static_cast<int>(max<size_t>(1, PARALLEL_IO_CHUNK_BYTES / max<size_t>(1, row_bytes)));
+}
+
+
+/**
+    Reads the headers of an open BMP file, with everything up to the pixel array for
+    the palette or bit masks.
+
+    @param fd: The open file.
+    @param info: Receives the layout of the file.
+    @returns true if the headers are valid, false otherwise.
+*/
+bool read_bmp_file_info(int fd, BmpInfo& info)
+{
+    struct stat file_status;
+    vector<unsigned char> header(54);
+    if (fstat(fd, &file_status) != 0 || static_cast<size_t>(file_status.st_size) < header.size() ||
+        !pread_fully(fd, header.data(), header.size(), 0))
+    {
+        return false;
+    }
+    size_t file_size = file_status.st_size;
+    header.resize(max<size_t>(54, min<size_t>(file_size, get_uint(header.data(), 10, 4))));
+    return pread_fully(fd, header.data(), header.size(), 0) &&
+           parse_bmp_header(header.data(), header.size(), file_size, info);
+}
+
+
+/**
+    Reads and decodes rows [first, last) of an open BMP file with a single pread; the
+    rows are stored contiguously in either row order.
+
+    @param fd: The open file.
+    @param info: Layout of the file.
+    @param first: First image row to read.
+    @param last: Row after the last one to read.
+    @param rows: Receives the pixels of the rows, each already sized to the image width.
+    @param alpha_rows: If given, receives the alpha values of the rows, sized the same way.
+    @returns true if the rows were read.
+*/
+bool read_bmp_rows(int fd, const BmpInfo& info, int first, int last, vector<Pixel>* rows, vector<unsigned char>* alpha_rows)
+{
+    int first_stored = info.top_down ? first : info.height - last;
+    vector<unsigned char> stored(info.row_stride * (last - first));
+    if (!pread_fully(fd, stored.data(), stored.size(), info.pixel_offset + info.row_stride * first_stored))
+    {
+        return false;
+    }
+    for (int row = first; row < last; row++)
+    {
+        int stored_row = info.top_down ? row - first : last - 1 - row;
+        decode_bmp_row(stored.data() + info.row_stride * stored_row, info, rows[row - first],
+                       alpha_rows != nullptr ? &alpha_rows[row - first] : nullptr);
+    }
+    return true;
+}
+
+
+/**
+    Reads a BMP file with one pread per range of rows, the ranges read and decoded in
+    parallel. Handles every format decode_bmp() does.
+
+    @param filename: BMP image filename.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns The image, or an empty vector if the file is not a BMP that could be read.
+*/
+vector<vector<Pixel>> read_bmp_parallel(const string& filename, AlphaPlane* alpha = nullptr)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return {};
+    }
+    BmpInfo info;
+    if (!read_bmp_file_info(fd, info))
+    {
+        close(fd);
+        return {};
+    }
+
+    vector<vector<Pixel>> image = initialize_new_image(info.height, info.width);
+    bool has_alpha = alpha != nullptr && bmp_has_alpha(info);
+    if (alpha != nullptr)
+    {
+        *alpha = has_alpha ? initialize_alpha_plane(info.height, info.width) : AlphaPlane();
+    }
+
+    // Rows [first, last) of the image are stored contiguously in either row order
+    int range_rows = rows_per_io_task(info.row_stride);
+    int num_ranges = (info.height + range_rows - 1) / range_rows;
+    atomic<bool> failed{false};
+    parallel_for(num_ranges, [&](int range)
+    {
+        int first = range * range_rows;
+        int last = min(info.height, first + range_rows);
+        if (!read_bmp_rows(fd, info, first, last, &image[first], has_alpha ? &(*alpha)[first] : nullptr))
+        {
+            failed = true;
+        }
+    }, PARALLEL_IO_CHUNK_BYTES);
+    close(fd);
+    if (failed)
+    {
+        return {};
+    }
+
+    drop_unused_bmp_alpha(info, alpha);
+    return image;
+}
+
+
+/**
+    Reads every step-th row and column of a BMP file, starting with the first, for a
+    preview. Each kept row is fetched with its own pread and the rows in between are
+    never read; the kept columns are gathered and decoded with the row's usual fast path.
+
+    @param filename: BMP image filename.
+    @param step: Distance between the rows and columns kept.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns The image, ceil(height / step) x ceil(width / step), or an empty vector if
+             the file is not a BMP that could be read.
+*/
+vector<vector<Pixel>> read_bmp_subsampled(const string& filename, int step, AlphaPlane* alpha = nullptr)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return {};
+    }
+    BmpInfo info;
+    if (step < 1 || !read_bmp_file_info(fd, info))
+    {
+        close(fd);
+        return {};
+    }
+
+    int num_rows = (info.height + step - 1) / step;
+    int num_columns = (info.width + step - 1) / step;
+    size_t pixel_bytes = info.bits_per_pixel / 8;
+    vector<vector<Pixel>> image = initialize_new_image(num_rows, num_columns);
+    bool has_alpha = alpha != nullptr && bmp_has_alpha(info);
+    if (alpha != nullptr)
+    {
+        *alpha = has_alpha ? initialize_alpha_plane(num_rows, num_columns) : AlphaPlane();
+    }
+
+    atomic<bool> failed{false};
+    parallel_for(num_rows, [&](int row)
+    {
+        int source_row = row * step;
+        int stored_row = info.top_down ? source_row : info.height - 1 - source_row;
+        vector<unsigned char> stored(info.row_stride);
+        if (!pread_fully(fd, stored.data(), stored.size(), info.pixel_offset + info.row_stride * stored_row))
+        {
+            failed = true;
+            return;
+        }
+        // Every step-th pixel is moved to the front, in place, so the row decodes as a narrower one
+        for (int col = 1; col < num_columns; col++)
+        {
+            memmove(stored.data() + col * pixel_bytes, stored.data() + col * step * pixel_bytes, pixel_bytes);
+        }
+        decode_bmp_row(stored.data(), info, image[row], has_alpha ? &(*alpha)[row] : nullptr);
+    }, info.row_stride);
+    close(fd);
+    if (failed)
+    {
+        return {};
+    }
+
+    drop_unused_bmp_alpha(info, alpha);
+    return image;
+}
+
+
+/**
+    Writes an image to a BMP file the way write_bmp() does, with ranges of rows encoded
+    and written by parallel tasks into a file preallocated to its final size.
+
+    @param filename: The BMP file name to save the image to.
+    @param width_pixels: Width of the image.
+    @param height_pixels: Height of the image.
+    @param has_alpha: Whether to store an alpha channel (32 bpp).
+    @param encode_row: Called as encode_row(row, dst) to encode each image row the way encode_bmp_row() does.
+    @returns True if successful and false otherwise.
+*/
+template <typename RowEncoder>
+bool write_bmp_rows_parallel(const string& filename, int width_pixels, int height_pixels, bool has_alpha,
+                             const RowEncoder& encode_row)
+{
+    size_t row_bytes;
+    vector<unsigned char> header = encode_bmp_header(width_pixels, height_pixels, has_alpha, row_bytes);
+    size_t file_size = header.size() + row_bytes * height_pixels;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // Reserve the blocks up front; file systems without fallocate just get the size set
+    if (posix_fallocate(fd, 0, file_size) != 0 && ftruncate(fd, file_size) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    int range_rows = rows_per_io_task(row_bytes);
+    int num_ranges = (height_pixels + range_rows - 1) / range_rows;
+    atomic<bool> failed{!pwrite_fully(fd, header.data(), header.size(), 0)};
+    parallel_for(num_ranges, [&](int range)
+    {
+        // Image rows [first, last) are stored bottom-up as one block
+        int first = range * range_rows;
+        int last = min(height_pixels, first + range_rows);
+        vector<unsigned char> rows(row_bytes * (last - first), 0);
+        for (int row = first; row < last; row++)
+        {
+            encode_row(row, rows.data() + row_bytes * (last - 1 - row));
+        }
+        if (!failed && !pwrite_fully(fd, rows.data(), rows.size(), header.size() + row_bytes * (height_pixels - last)))
+        {
+            failed = true;
+        }
+    }, PARALLEL_IO_CHUNK_BYTES);
+    return close(fd) == 0 && !failed;
+}
+
+
+/**
+    Writes an image to a BMP file in parallel (see write_bmp_rows_parallel()).
+
+    @param filename: The BMP file name to save the image to.
+    @param image: The image to save.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns True if successful and false otherwise.
+*/
+bool write_bmp_parallel(const string& filename, const vector<vector<Pixel>>& image, const AlphaPlane& alpha = AlphaPlane())
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    pair<int, int> dimensions = get_image_dimensions(image);
+    bool has_alpha = !alpha.empty();
+    return write_bmp_rows_parallel(filename, dimensions.second, dimensions.first, has_alpha, [&](int row, unsigned char* dst)
+    {
+        encode_bmp_row(image[row], has_alpha ? &alpha[row] : nullptr, dst);
+    });
+}
+
+
+//***************************************************************************************************//
+//                              INTERMEDIATE FORMAT (.nyk)                                          //
+//
+// Lossless compressed format for passing images between steps of a workflow.
+//
+//   Header (20 bytes):  "NYK1", width (4), height (4), tile size (2), channels (1), reserved (1), tile count (4)
+//   Tile table:         for each tile, offset from file start (8) and stored size (4)
+//   Tiles:              for each tile, a codec byte followed by its data
+//
+// Tiles are square (edge tiles are clipped) and numbered left to right, top to bottom.
+// Inside a tile each channel (red, green, blue, then alpha if present) is stored as a
+// plane of prediction residuals, which is then packed with whichever codec gives the
+// smallest result. Every tile stands on its own, so tiles decode in parallel and any
+// one of them can be read without the rest.
+
+const unsigned char NYK_MAGIC[4] = {'N', 'Y', 'K', '1'};
+
+const int NYK_HEADER_SIZE = 20;
+const int NYK_TABLE_ENTRY_SIZE = 12;
+const int NYK_TILE_SIZE = 64;
+
+// Codec byte at the start of each tile
+const unsigned char NYK_CODEC_STORED = 0;   // Residuals as they are
+const unsigned char NYK_CODEC_LZ = 1;       // LZ77 matches and literals
+const unsigned char NYK_CODEC_RICE = 2;     // Adaptive Rice codes
+
+// Most bytes one byte of tile data can decode to (an LZ match length byte adds 255)
+const size_t NYK_MAX_EXPANSION = 255;
+
+
+/**
+    Layout of a .nyk file, taken from its header.
+*/
+struct NykInfo
+{
+    int width = 0;
+    int height = 0;
+    int tile_size = 0;
+    int channels = 0;       // 3, or 4 with alpha
+    int tiles_across = 0;
+    int tiles_down = 0;
+};
+
+
+/**
+    Predicts a sample from its left, upper and upper-left neighbours using the
+    median edge detector: it follows an edge when one is present and the
+    gradient plane otherwise.
+*/
+inline int nyk_predict(int left, int up, int up_left)
+{
+    if (up_left >= max(left, up))
+    {
+        return min(left, up);
+    }
+    if (up_left <= min(left, up))
+    {
+        return max(left, up);
+    }
+    return left + up - up_left;
+}
+
+
+/**
+    Replaces every sample of a tile plane with its prediction residual (modulo 256).
+    Samples outside the tile count as zero, so each tile can be predicted on its own.
+
+    @param plane: The tile plane, row-major; replaced by the residuals.
+    @param width: Width of the tile.
+    @param height: Height of the tile.
+*/
+void nyk_forward_predict(unsigned char* plane, int width, int height)
+{
+    // Go backwards so every prediction still sees the original neighbours
+    for (int row = height - 1; row >= 0; row--)
+    {
+        for (int col = width - 1; col >= 0; col--)
+        {
+            int left = col > 0 ? plane[row * width + col - 1] : 0;
+            int up = row > 0 ? plane[(row - 1) * width + col] : 0;
+            int up_left = (row > 0 && col > 0) ? plane[(row - 1) * width + col - 1] : 0;
+            plane[row * width + col] = static_cast<unsigned char>(plane[row * width + col] - nyk_predict(left, up, up_left));
+        }
+    }
+}
+
+
+/**
+    Undoes nyk_forward_predict(), turning residuals back into samples.
+*/
+void nyk_inverse_predict(unsigned char* plane, int width, int height)
+{
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int left = col > 0 ? plane[row * width + col - 1] : 0;
+            int up = row > 0 ? plane[(row - 1) * width + col] : 0;
+            int up_left = (row > 0 && col > 0) ? plane[(row - 1) * width + col - 1] : 0;
+            plane[row * width + col] = static_cast<unsigned char>(plane[row * width + col] + nyk_predict(left, up, up_left));
+        }
+    }
+}
+
+
+/**
+    Appends a length to an LZ stream: values of 15 or more continue in extra bytes
+    of 255 each, ended by a byte below 255.
+*/
+void lz_write_length(vector<unsigned char>& out, size_t length)
+{
+    if (length < 15)
+    {
+        return;
+    }
+    length -= 15;
+    while (length >= 255)
+    {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(static_cast<unsigned char>(length));
+}
+
+
+/**
+    Compresses a buffer with a small LZ77 codec. The output is a series of sequences,
+    each a token byte (literal count in the high 4 bits, match length - 4 in the low
+    4 bits), the literal bytes, and a 2 byte match offset. The final sequence holds
+    only literals.
+
+    @param src: The data to compress.
+    @param size: Size of the data.
+    @param out: Receives the compressed data.
+*/
+void lz_compress(const unsigned char* src, size_t size, vector<unsigned char>& out)
+{
+    const int HASH_BITS = 12;
+    const int MIN_MATCH = 4;
+    vector<int> table(1 << HASH_BITS, -1);
+    out.clear();
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= size)
+    {
+        unsigned int sequence = get_uint(src, pos, 4);
+        unsigned int hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+        int candidate = table[hash];
+        table[hash] = static_cast<int>(pos);
+
+        if (candidate < 0 || pos - candidate > 65535 || get_uint(src, candidate, 4) != sequence)
+        {
+            pos++;
+            continue;
+        }
+
+        // Extend the match as far as it goes
+        size_t match_length = MIN_MATCH;
+        while (pos + match_length < size && src[candidate + match_length] == src[pos + match_length])
+        {
+            match_length++;
+        }
+
+        size_t literal_count = pos - anchor;
+        size_t match_code = match_length - MIN_MATCH;
+        out.push_back(static_cast<unsigned char>((min<size_t>(literal_count, 15) << 4) | min<size_t>(match_code, 15)));
+        lz_write_length(out, literal_count);
+        out.insert(out.end(), src + anchor, src + pos);
+        size_t offset = pos - candidate;
+        out.push_back(static_cast<unsigned char>(offset));
+        out.push_back(static_cast<unsigned char>(offset >> 8));
+        lz_write_length(out, match_code);
+
+        pos += match_length;
+        anchor = pos;
+    }
+
+    // Remaining bytes go out as literals
+    size_t literal_count = size - anchor;
+    out.push_back(static_cast<unsigned char>(min<size_t>(literal_count, 15) << 4));
+    lz_write_length(out, literal_count);
+    out.insert(out.end(), src + anchor, src + size);
+}
+
+
+/**
+    Reads a length written by lz_write_length().
+
+    @returns false if the stream ends early.
+*/
+bool lz_read_length(const unsigned char* src, size_t size, size_t& pos, size_t& length)
+{
+    if (length < 15)
+    {
+        return true;
+    }
+    unsigned char extra;
+    do
+    {
+        if (pos >= size)
+        {
+            return false;
+        }
+        extra = src[pos++];
+        length += extra;
+    } while (extra == 255);
+    return true;
+}
+
+
+/**
+    Decompresses data written by lz_compress().
+
+    @param src: The compressed data.
+    @param size: Size of the compressed data.
+    @param dst: Buffer receiving the decompressed data.
+    @param dst_size: Exact size of the decompressed data.
+    @returns true if the data decoded to exactly dst_size bytes, false if it is corrupt.
+*/
+bool lz_decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t dst_size)
+{
+    size_t pos = 0;
+    size_t out = 0;
+    while (pos < size)
+    {
+        unsigned char token = src[pos++];
+        size_t literal_count = token >> 4;
+        if (!lz_read_length(src, size, pos, literal_count) || pos + literal_count > size || out + literal_count > dst_size)
+        {
+            return false;
+        }
+        copy(src + pos, src + pos + literal_count, dst + out);
+        pos += literal_count;
+        out += literal_count;
+
+        // The last sequence has no match
+        if (pos == size)
+        {
+            break;
+        }
+
+        if (pos + 2 > size)
+        {
+            return false;
+        }
+        size_t offset = src[pos] | (src[pos + 1] << 8);
+        pos += 2;
+        size_t match_length = token & 15;
+        if (!lz_read_length(src, size, pos, match_length))
+        {
+            return false;
+        }
+        match_length += 4;
+        if (offset == 0 || offset > out || out + match_length > dst_size)
+        {
+            return false;
+        }
+
+        // Byte by byte, since a match may overlap the bytes it is producing
+        for (size_t i = 0; i < match_length; i++, out++)
+        {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out == dst_size;
+}
+
+
+/**
+    Writes bits into a byte buffer, least significant bit first.
+*/
+struct BitWriter
+{
+    vector<unsigned char>& out;
+    unsigned long long buffer = 0;
+    int count = 0;
+
+    explicit BitWriter(vector<unsigned char>& target) : out(target) {}
+
+    void write(unsigned int bits, int num_bits)
+    {
+        buffer |= static_cast<unsigned long long>(bits) << count;
+        count += num_bits;
+        while (count >= 8)
+        {
+            out.push_back(static_cast<unsigned char>(buffer));
+            buffer >>= 8;
+            count -= 8;
+        }
+    }
+
+    void flush()
+    {
+        if (count > 0)
+        {
+            out.push_back(static_cast<unsigned char>(buffer));
+        }
+        buffer = 0;
+        count = 0;
+    }
+};
+
+
+/**
+    Reads bits written by BitWriter. Reading past the end yields zero bits and sets overrun.
+*/
+struct BitReader
+{
+    const unsigned char* data;
+    size_t size;
+    size_t pos = 0;
+    unsigned long long buffer = 0;
+    int count = 0;
+    bool overrun = false;
+
+    BitReader(const unsigned char* src, size_t src_size) : data(src), size(src_size) {}
+
+    unsigned int read(int num_bits)
+    {
+        while (count < num_bits)
+        {
+            unsigned long long next = 0;
+            if (pos < size)
+            {
+                next = data[pos++];
+            }
+            else
+            {
+                overrun = true;
+            }
+            buffer |= next << count;
+            count += 8;
+        }
+        unsigned int bits = static_cast<unsigned int>(buffer & ((1ull << num_bits) - 1));
+        buffer >>= num_bits;
+        count -= num_bits;
+        return bits;
+    }
+};
+
+
+/**
+    Adaptive Rice parameter state for one plane: k is chosen so that 2^k tracks
+    the running mean of the mapped residuals, as in LOCO-I.
+*/
+struct RiceState
+{
+    int total = 4;
+    int count = 1;
+
+    int parameter() const
+    {
+        int k = 0;
+        while ((count << k) < total && k < 7)
+        {
+            k++;
+        }
+        return k;
+    }
+
+    void update(int value)
+    {
+        total += value;
+        count++;
+        if (count == 64)
+        {
+            total >>= 1;
+            count >>= 1;
+        }
+    }
+};
+
+// Unary prefixes this long are followed by the value as a plain byte
+const int RICE_ESCAPE = 24;
+
+
+/**
+    Compresses prediction residuals with adaptive Rice codes. Each residual is mapped
+    to 0, -1, 1, -2, ... -> 0, 1, 2, 3, ... and written as a unary quotient and k remainder bits.
+
+    @param src: The residuals, one plane after another.
+    @param size: Number of residuals.
+    @param plane_size: Number of residuals per plane; the Rice state restarts for each plane.
+    @param out: Receives the compressed data.
+*/
+void rice_compress(const unsigned char* src, size_t size, size_t plane_size, vector<unsigned char>& out)
+{
+    out.clear();
+    BitWriter writer(out);
+    RiceState state;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (i % plane_size == 0)
+        {
+            state = RiceState();
+        }
+        int residual = static_cast<signed char>(src[i]);
+        int value = residual >= 0 ? 2 * residual : -2 * residual - 1;
+        int k = state.parameter();
+        int quotient = value >> k;
+        if (quotient < RICE_ESCAPE)
+        {
+            writer.write((1u << quotient) - 1, quotient + 1);  // quotient ones, then a zero
+            writer.write(value & ((1 << k) - 1), k);
+        }
+        else
+        {
+            writer.write((1u << RICE_ESCAPE) - 1, RICE_ESCAPE);
+            writer.write(value, 8);
+        }
+        state.update(value);
+    }
+    writer.flush();
+}
+
+
+/**
+    Decompresses data written by rice_compress().
+
+    @returns true if the data decoded to exactly dst_size residuals, false if it is corrupt.
+*/
+bool rice_decompress(const unsigned char* src, size_t size, size_t plane_size, unsigned char* dst, size_t dst_size)
+{
+    BitReader reader(src, size);
+    RiceState state;
+    for (size_t i = 0; i < dst_size; i++)
+    {
+        if (i % plane_size == 0)
+        {
+            state = RiceState();
+        }
+        int k = state.parameter();
+        int quotient = 0;
+        while (quotient < RICE_ESCAPE && reader.read(1) == 1)
+        {
+            quotient++;
+        }
+        int value;
+        if (quotient < RICE_ESCAPE)
+        {
+            value = (quotient << k) | static_cast<int>(reader.read(k));
+        }
+        else
+        {
+            value = reader.read(8);
+        }
+        if (reader.overrun || value > 255)
+        {
+            return false;
+        }
+        int residual = (value & 1) ? -(value + 1) / 2 : value / 2;
+        dst[i] = static_cast<unsigned char>(residual);
+        state.update(value);
+    }
+    return true;
+}
+
+
+/**
+    Works out a .nyk file's tile grid from its size.
+*/
+void nyk_set_grid(NykInfo& info)
+{
+    info.tiles_across = static_cast<int>((static_cast<long long>(info.width) + info.tile_size - 1) / info.tile_size);
+    info.tiles_down = static_cast<int>((static_cast<long long>(info.height) + info.tile_size - 1) / info.tile_size);
+}
+
+
+/**
+    Encodes one tile: gathers its channel planes, predicts them, and packs the residuals
+    with the codec that gives the smallest result.
+
+    @param image: The full image.
+    @param alpha: The alpha plane (empty for an opaque image).
+    @param info: Layout of the file being written.
+    @param tile: Number of the tile.
+    @param out: Receives the codec byte and tile data.
+*/
+void nyk_encode_tile(const vector<vector<Pixel>>& image, const AlphaPlane& alpha, const NykInfo& info,
+                     int tile, vector<unsigned char>& out)
+{
+    int row_begin = (tile / info.tiles_across) * info.tile_size;
+    int col_begin = (tile % info.tiles_across) * info.tile_size;
+    int tile_height = min(info.tile_size, info.height - row_begin);
+    int tile_width = min(info.tile_size, info.width - col_begin);
+    size_t plane_size = static_cast<size_t>(tile_width) * tile_height;
+
+    vector<unsigned char> planes(plane_size * info.channels);
+    for (int row = 0; row < tile_height; row++)
+    {
+        const vector<Pixel>& source_row = image[row_begin + row];
+        for (int col = 0; col < tile_width; col++)
+        {
+            const Pixel& pixel = source_row[col_begin + col];
+            size_t index = static_cast<size_t>(row) * tile_width + col;
+            planes[index] = pixel.red;
+            planes[plane_size + index] = pixel.green;
+            planes[2 * plane_size + index] = pixel.blue;
+            if (info.channels == 4)
+            {
+                planes[3 * plane_size + index] = alpha[row_begin + row][col_begin + col];
+            }
+        }
+    }
+    for (int c = 0; c < info.channels; c++)
+    {
+        nyk_forward_predict(planes.data() + c * plane_size, tile_width, tile_height);
+    }
+
+    vector<unsigned char> lz_data, rice_data;
+    lz_compress(planes.data(), planes.size(), lz_data);
+    rice_compress(planes.data(), planes.size(), plane_size, rice_data);
+
+    out.clear();
+    if (rice_data.size() <= lz_data.size() && rice_data.size() < planes.size())
+    {
+        out.push_back(NYK_CODEC_RICE);
+        out.insert(out.end(), rice_data.begin(), rice_data.end());
+    }
+    else if (lz_data.size() < planes.size())
+    {
+        out.push_back(NYK_CODEC_LZ);
+        out.insert(out.end(), lz_data.begin(), lz_data.end());
+    }
+    else
+    {
+        out.push_back(NYK_CODEC_STORED);
+        out.insert(out.end(), planes.begin(), planes.end());
+    }
+}
+
+
+/**
+    Encodes an image in the .nyk intermediate format, compressing tiles in parallel.
+
+    @param image: The image to encode.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns The bytes of the .nyk file.
+*/
+vector<unsigned char> encode_nyk(const vector<vector<Pixel>>& image, const AlphaPlane& alpha)
+{
+    NykInfo info;
+    info.height = image.size();
+    info.width = image[0].size();
+    info.tile_size = NYK_TILE_SIZE;
+    info.channels = alpha.empty() ? 3 : 4;
+    nyk_set_grid(info);
+    int num_tiles = info.tiles_across * info.tiles_down;
+
+    vector<vector<unsigned char>> tiles(num_tiles);
+    parallel_for(num_tiles, [&](int tile)
+    {
+        nyk_encode_tile(image, alpha, info, tile, tiles[tile]);
+    }, NYK_TILE_SIZE * NYK_TILE_SIZE);
+
+    size_t table_end = NYK_HEADER_SIZE + static_cast<size_t>(NYK_TABLE_ENTRY_SIZE) * num_tiles;
+    size_t total_size = table_end;
+    for (const vector<unsigned char>& tile : tiles)
+    {
+        total_size += tile.size();
+    }
+
+    vector<unsigned char> bytes(total_size, 0);
+    copy(NYK_MAGIC, NYK_MAGIC + 4, bytes.begin());
+    set_bytes(bytes.data(), 4, 4, info.width);
+    set_bytes(bytes.data(), 8, 4, info.height);
+    set_bytes(bytes.data(), 12, 2, info.tile_size);
+    set_bytes(bytes.data(), 14, 1, info.channels);
+    set_bytes(bytes.data(), 16, 4, num_tiles);
+
+    size_t offset = table_end;
+    for (int tile = 0; tile < num_tiles; tile++)
+    {
+        unsigned char* entry = bytes.data() + NYK_HEADER_SIZE + static_cast<size_t>(NYK_TABLE_ENTRY_SIZE) * tile;
+        set_bytes(entry, 0, 4, static_cast<int>(offset & 0xFFFFFFFF));
+        set_bytes(entry, 4, 4, static_cast<int>(static_cast<unsigned long long>(offset) >> 32));
+        set_bytes(entry, 8, 4, tiles[tile].size());
+        copy(tiles[tile].begin(), tiles[tile].end(), bytes.begin() + offset);
+        offset += tiles[tile].size();
+    }
+    return bytes;
+}
+
+
+/**
+    Checks whether a buffer starts with the .nyk magic number.
+*/
+bool is_nyk_data(const unsigned char* data, size_t size)
+{
+    return size >= 4 && equal(NYK_MAGIC, NYK_MAGIC + 4, data);
+}
+
+
+/**
+    Reads the header of a .nyk file.
+
+    @param data: Buffer holding at least the file header.
+    @param size: Size of the buffer.
+    @param info: Receives the layout of the file.
+    @returns true if the header is valid, false otherwise.
+*/
+bool parse_nyk_header(const unsigned char* data, size_t size, NykInfo& info)
+{
+    if (size < static_cast<size_t>(NYK_HEADER_SIZE) || !is_nyk_data(data, size))
+    {
+        return false;
+    }
+    info.width = get_uint(data, 4, 4);
+    info.height = get_uint(data, 8, 4);
+    info.tile_size = get_uint(data, 12, 2);
+    info.channels = data[14];
+    if (info.width <= 0 || info.height <= 0 || info.tile_size <= 0 || (info.channels != 3 && info.channels != 4))
+    {
+        return false;
+    }
+    nyk_set_grid(info);
+    size_t num_tiles = static_cast<size_t>(info.tiles_across) * info.tiles_down;
+    return num_tiles <= static_cast<size_t>(numeric_limits<int>::max()) && get_uint(data, 16, 4) == num_tiles;
+}
+
+
+/**
+    Checks the tile table of a .nyk file before any memory is set aside for its image.
+    Each tile's data must lie inside the file after the table, the tiles together may
+    not hold more bytes than the file does, and no tile may need more bytes than its
+    data could decode to. The image a file asks for is then bounded by its size.
+
+    @param data: Buffer holding the whole file.
+    @param size: Size of the buffer.
+    @param info: Layout of the file, from parse_nyk_header().
+    @returns true if the table is consistent, false otherwise.
+*/
+bool nyk_check_tile_table(const unsigned char* data, size_t size, const NykInfo& info)
+{
+    size_t num_tiles = static_cast<size_t>(info.tiles_across) * info.tiles_down;
+    size_t table_end = NYK_HEADER_SIZE + static_cast<size_t>(NYK_TABLE_ENTRY_SIZE) * num_tiles;
+    if (size < table_end)
+    {
+        return false;
+    }
+
+    size_t data_bytes = 0;
+    for (size_t tile = 0; tile < num_tiles; tile++)
+    {
+        const unsigned char* entry = data + NYK_HEADER_SIZE + static_cast<size_t>(NYK_TABLE_ENTRY_SIZE) * tile;
+        size_t offset = get_uint(entry, 0, 4) | (static_cast<size_t>(get_uint(entry, 4, 4)) << 32);
+        size_t stored_size = get_uint(entry, 8, 4);
+        if (stored_size < 1 || offset < table_end || offset > size || stored_size > size - offset)
+        {
+            return false;
+        }
+        data_bytes += stored_size;
+        if (data_bytes > size - table_end)
+        {
+            return false;
+        }
+
+        long long row_begin = static_cast<long long>(tile / info.tiles_across) * info.tile_size;
+        long long col_begin = static_cast<long long>(tile % info.tiles_across) * info.tile_size;
+        size_t tile_bytes = static_cast<size_t>(min<long long>(info.tile_size, info.height - row_begin)) *
+                            min<long long>(info.tile_size, info.width - col_begin) * info.channels;
+        if (tile_bytes > (stored_size - 1) * NYK_MAX_EXPANSION)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+    Decodes one tile of a .nyk file into its place in the image.
+
+    @param data: Buffer holding the whole file.
+    @param size: Size of the buffer.
+    @param info: Layout of the file.
+    @param tile: Number of the tile.
+    @param image: Image of the file's full size receiving the tile's pixels.
+    @param alpha: Alpha plane of the file's full size, or nullptr to skip the alpha channel.
+    @returns true if the tile decoded, false if it is corrupt.
+*/
+bool nyk_decode_tile(const unsigned char* data, size_t size, const NykInfo& info, int tile,
+                     vector<vector<Pixel>>& image, AlphaPlane* alpha)
+{
+    const unsigned char* entry = data + NYK_HEADER_SIZE + static_cast<size_t>(NYK_TABLE_ENTRY_SIZE) * tile;
+    size_t offset = get_uint(entry, 0, 4) | (static_cast<size_t>(get_uint(entry, 4, 4)) << 32);
+    size_t stored_size = get_uint(entry, 8, 4);
+    if (stored_size < 1 || offset > size || stored_size > size - offset)
+    {
+        return false;
+    }
+
+    int row_begin = (tile / info.tiles_across) * info.tile_size;
+    int col_begin = (tile % info.tiles_across) * info.tile_size;
+    int tile_height = min(info.tile_size, info.height - row_begin);
+    int tile_width = min(info.tile_size, info.width - col_begin);
+    size_t plane_size = static_cast<size_t>(tile_width) * tile_height;
+    vector<unsigned char> planes(plane_size * info.channels);
+
+    const unsigned char* payload = data + offset + 1;
+    size_t payload_size = stored_size - 1;
+    bool ok = false;
+    switch (data[offset])
+    {
+        case NYK_CODEC_STORED:
+            ok = payload_size == planes.size();
+            if (ok)
+            {
+                copy(payload, payload + payload_size, planes.begin());
+            }
+            break;
+        case NYK_CODEC_LZ:
+            ok = lz_decompress(payload, payload_size, planes.data(), planes.size());
+            break;
+        case NYK_CODEC_RICE:
+            ok = rice_decompress(payload, payload_size, plane_size, planes.data(), planes.size());
+            break;
+    }
+    if (!ok)
+    {
+        return false;
+    }
+
+    for (int c = 0; c < info.channels; c++)
+    {
+        nyk_inverse_predict(planes.data() + c * plane_size, tile_width, tile_height);
+    }
+    for (int row = 0; row < tile_height; row++)
+    {
+        vector<Pixel>& target_row = image[row_begin + row];
+        for (int col = 0; col < tile_width; col++)
+        {
+            size_t index = static_cast<size_t>(row) * tile_width + col;
+            target_row[col_begin + col] = Pixel{planes[index], planes[plane_size + index], planes[2 * plane_size + index]};
+            if (alpha != nullptr && info.channels == 4)
+            {
+                (*alpha)[row_begin + row][col_begin + col] = planes[3 * plane_size + index];
+            }
+        }
+    }
+    return true;
+}
+
+
+/**
+    Decodes a .nyk file held in memory, decompressing its tiles in parallel.
+
+    @param data: Buffer holding the whole file.
+    @param size: Size of the buffer.
+    @param alpha: If given, receives the alpha channel, or is left empty when the file has none.
+    @returns The image, or an empty vector if the file is not a valid .nyk file.
+*/
+vector<vector<Pixel>> decode_nyk(const unsigned char* data, size_t size, AlphaPlane* alpha = nullptr)
+{
+    NykInfo info;
+    if (!parse_nyk_header(data, size, info) || !nyk_check_tile_table(data, size, info))
+    {
+        return {};
+    }
+    int num_tiles = info.tiles_across * info.tiles_down;  // Fits, as parse_nyk_header() checked
+
+    vector<vector<Pixel>> image = initialize_new_image(info.height, info.width);
+    if (alpha != nullptr)
+    {
+        *alpha = (info.channels == 4) ? initialize_alpha_plane(info.height, info.width) : AlphaPlane();
+    }
+
+    atomic<bool> ok(true);
+    parallel_for(num_tiles, [&](int tile)
+    {
+        if (!nyk_decode_tile(data, size, info, tile, image, alpha))
+        {
+            ok = false;
+        }
+    }, NYK_TILE_SIZE * NYK_TILE_SIZE);
+    if (!ok)
+    {
+        if (alpha != nullptr)
+        {
+            alpha->clear();
+        }
+        return {};
+    }
+    return image;
+}
+
+
+//***************************************************************************************************//
+//                                      IMAGE FILES                                                 //
+
+/**
+    Decodes an image file held in memory, either BMP or .nyk (recognized by its contents).
+
+    @param bytes: The contents of the file.
+    @param alpha: If given, receives the alpha channel, or is left empty when the image has none.
+    @returns The image, or an empty vector if it could not be decoded.
+*/
+vector<vector<Pixel>> decode_image_bytes(const vector<unsigned char>& bytes, AlphaPlane* alpha = nullptr)
+{
+    if (is_nyk_data(bytes.data(), bytes.size()))
+    {
+        return decode_nyk(bytes.data(), bytes.size(), alpha);
+    }
+    return decode_bmp(bytes.data(), bytes.size(), alpha);
+}
+
+
+/**
+    Encodes an image in the format chosen by a filename: .nyk if it has that extension, BMP otherwise.
+
+    @param filename: Name of the image file the bytes are meant for.
+    @param image: The image to encode.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns The bytes of the file.
+*/
+vector<unsigned char> encode_image_file(const string& filename, const vector<vector<Pixel>>& image, const AlphaPlane& alpha)
+{
+    if (has_extension(filename, NYK_EXTENSION))
+    {
+        return encode_nyk(image, alpha);
+    }
+    return encode_bmp(image, alpha);
+}
+
+
+/**
+    Reads an image file, either BMP or .nyk (recognized by its contents).
+
+    @param filename: Name of the image file.
+    @param alpha: If given, receives the alpha channel, or is left empty when the image has none.
+    @returns The image, or an empty vector if it could not be read.
+*/
+vector<vector<Pixel>> read_image_file(const string& filename, AlphaPlane* alpha = nullptr)
+{
+    // Large BMPs are read in parallel; anything else (or a large file that is not a BMP) in one go
+    error_code error;
+    uintmax_t file_size = filesystem::file_size(filename, error);
+    if (!error && file_size >= PARALLEL_IO_MIN_BYTES)
+    {
+        vector<vector<Pixel>> image = read_bmp_parallel(filename, alpha);
+        if (!image.empty())
+        {
+            return image;
+        }
+    }
+
+    vector<unsigned char> bytes;
+    if (!read_file_bytes(filename, bytes))
+    {
+        return {};
+    }
+    return decode_image_bytes(bytes, alpha);
+}
+
+
+/**
+    Writes an image file: .nyk if the filename has that extension, BMP otherwise.
+
+    @param filename: Name of the image file.
+    @param image: The image to save.
+    @param alpha: The alpha plane, or an empty plane for an opaque image.
+    @returns True if successful and false otherwise.
+*/
+bool write_image_file(const string& filename, const vector<vector<Pixel>>& image, const AlphaPlane& alpha = AlphaPlane())
+{
+    if (image.empty())
+    {
+        return false;
+    }
+    size_t pixel_bytes = image.size() * image[0].size() * (alpha.empty() ? 3 : 4);
+    if (!has_extension(filename, NYK_EXTENSION) && pixel_bytes >= PARALLEL_IO_MIN_BYTES)
+    {
+        return write_bmp_parallel(filename, image, alpha);
+    }
+    return write_file_bytes(filename, encode_image_file(filename, image, alpha));
+}
+
+
+//***************************************************************************************************//
+//                                     IMAGE HANDLES                                                //
+
+/**
+    Reference-counted image: the pixels and the alpha plane are each shared between
+    copies of a handle, so copying a handle never copies an image. A handle that needs
+    to change its pixels gets a private copy first (copy on write), unless it is the
+    only one using them. A handle must not be written to by one thread while another
+    thread copies it.
+*/
+class ImageHandle
+{
+public:
+    ImageHandle() = default;
+
+    /**
+        @param pixels: The image, moved into the handle.
+        @param alpha: Its alpha plane (empty if opaque), moved into the handle.
+    */
+    explicit ImageHandle(vector<vector<Pixel>> pixels, AlphaPlane alpha = AlphaPlane())
+        : pixel_data(make_shared<vector<vector<Pixel>>>(move(pixels))),
+          alpha_data(make_shared<AlphaPlane>(move(alpha)))
+    {
+    }
+
+    bool empty() const
+    {
+        return !pixel_data || pixel_data->empty();
+    }
+
+    const vector<vector<Pixel>>& pixels() const
+    {
+        return pixel_data ? *pixel_data : empty_pixels();
+    }
+
+    const AlphaPlane& alpha() const
+    {
+        return alpha_data ? *alpha_data : empty_alpha();
+    }
+
+    /**
+        Whether this handle is the only user of its pixels, so writing them copies nothing.
+    */
+    bool owns_pixels() const
+    {
+        return pixel_data.use_count() == 1;
+    }
+
+    /**
+        The pixels for writing, copied first if another handle shares them.
+    */
+    vector<vector<Pixel>>& mutable_pixels()
+    {
+        if (!pixel_data)
+        {
+            pixel_data = make_shared<vector<vector<Pixel>>>();
+        }
+        else if (!owns_pixels())
+        {
+            pixel_data = make_shared<vector<vector<Pixel>>>(*pixel_data);
+        }
+        return *pixel_data;
+    }
+
+    /**
+        Takes the pixels out of the handle, leaving it empty. They are moved when no
+        other handle shares them and copied otherwise, so a caller can reuse the memory.
+    */
+    vector<vector<Pixel>> release_pixels()
+    {
+        vector<vector<Pixel>> pixels;
+        if (owns_pixels())
+        {
+            pixels = move(*pixel_data);
+        }
+        else
+        {
+            pixels = this->pixels();
+        }
+        pixel_data.reset();
+        return pixels;
+    }
+
+    /**
+        Takes the alpha plane out of the handle as release_pixels() takes the pixels.
+    */
+    AlphaPlane release_alpha()
+    {
+        AlphaPlane alpha;
+        if (alpha_data.use_count() == 1)
+        {
+            alpha = move(*alpha_data);
+        }
+        else
+        {
+            alpha = this->alpha();
+        }
+        alpha_data.reset();
+        return alpha;
+    }
+
+    /**
+        A handle with new pixels that keeps sharing this handle's alpha plane.
+    */
+    ImageHandle with_pixels(vector<vector<Pixel>> pixels) const
+    {
+        ImageHandle result = *this;
+        result.pixel_data = make_shared<vector<vector<Pixel>>>(move(pixels));
+        return result;
+    }
+
+private:
+    shared_ptr<vector<vector<Pixel>>> pixel_data;
+    shared_ptr<AlphaPlane> alpha_data;
+
+    static const vector<vector<Pixel>>& empty_pixels()
+    {
+        static const vector<vector<Pixel>> none;
+        return none;
+    }
+
+    static const AlphaPlane& empty_alpha()
+    {
+        static const AlphaPlane none;
+        return none;
+    }
+};
+
+
+/**
+    Name and modification time of the file an image handle was read from.
+*/
+struct ImageSource
+{
+    string filename;
+    filesystem::file_time_type modified;
+};
+
+
+/**
+    Reads an image file into a handle, unless the handle already holds that file and
+    the file has not been modified since it was read.
+
+    @param filename: Name of the image file.
+    @param image: The handle to fill; kept as it is when it already holds the file.
+    @param source: Where image was read from; updated when the file is read.
+    @returns true if image holds the file's pixels, false if it could not be read.
+*/
+bool load_image_handle(const string& filename, ImageHandle& image, ImageSource& source)
+{
+    error_code error;
+    filesystem::file_time_type modified = filesystem::last_write_time(filename, error);
+    if (!error && !image.empty() && filename == source.filename && modified == source.modified)
+    {
+        return true;
+    }
+
+    AlphaPlane alpha;
+    vector<vector<Pixel>> pixels = read_image_file(filename, &alpha);
+    image = ImageHandle(move(pixels), move(alpha));
+    source = ImageSource{filename, modified};
+    return !image.empty();
+}
+
+
+//***************************************************************************************************//
+//                                      IMAGE VIEWS                                                 //
+//
+// A view shows an image through a change of position: each view pixel (row, col) is
+// the source pixel (origin_row + row * row_step[0] + col * column_step[0],
+// origin_column + row * row_step[1] + col * column_step[1]), with every step 0, 1 or
+// -1. Flips, transposes, rotations and crops only change these numbers, so they cost
+// nothing until the view is read. Rows are read straight out of the source, which
+// lets the BMP writer and the effect graph's color passes take a view as it is; only
+// effects that need the whole image at once turn a view into a new image.
+
+/**
+    A rectangular region of an image.
+*/
+struct Region
+{
+    int row = 0;          // Top row
+    int col = 0;          // Left column
+    int num_rows = 0;     // Height
+    int num_columns = 0;  // Width
+};
+
+
+/**
+    Where the pixels of a view come from in its source image.
+*/
+struct ViewTransform
+{
+    int num_rows = 0;             // Size of the view
+    int num_columns = 0;
+    int origin_row = 0;           // Source pixel at the view's top left corner
+    int origin_column = 0;
+    int row_step[2] = {1, 0};     // Source row and column change per view row
+    int column_step[2] = {0, 1};  // Source row and column change per view column
+
+    ViewTransform() = default;
+
+    ViewTransform(int rows, int columns)
+        : num_rows(rows), num_columns(columns)
+    {
+    }
+
+    /**
+        Whether the view shows a source of the given size exactly as it is.
+    */
+    bool is_whole(int source_rows, int source_columns) const
+    {
+        return num_rows == source_rows && num_columns == source_columns && origin_row == 0 && origin_column == 0 &&
+               row_step[0] == 1 && row_step[1] == 0 && column_step[0] == 0 && column_step[1] == 1;
+    }
+
+    /**
+        Turns the view upside down.
+    */
+    void flip_rows()
+    {
+        origin_row += (num_rows - 1) * row_step[0];
+        origin_column += (num_rows - 1) * row_step[1];
+        row_step[0] = -row_step[0];
+        row_step[1] = -row_step[1];
+    }
+
+    /**
+        Mirrors the view left to right.
+    */
+    void flip_columns()
+    {
+        origin_row += (num_columns - 1) * column_step[0];
+        origin_column += (num_columns - 1) * column_step[1];
+        column_step[0] = -column_step[0];
+        column_step[1] = -column_step[1];
+    }
+
+    /**
+        Swaps the view's rows and columns.
+    */
+    void transpose()
+    {
+        swap(num_rows, num_columns);
+        swap(row_step[0], column_step[0]);
+        swap(row_step[1], column_step[1]);
+    }
+
+    /**
+        Rotates the view clockwise by turns x 90 degrees, the way process5() rotates an image.
+    */
+    void rotate(int turns)
+    {
+        switch (turns % 4)
+        {
+            case 1: transpose(); flip_columns(); break;
+            case 2: flip_rows(); flip_columns(); break;
+            case 3: transpose(); flip_rows(); break;
+        }
+    }
+
+    /**
+        Narrows the view to a region of it, clipped to the view.
+
+        @returns false, leaving the view as it is, if nothing of the region is inside the view.
+    */
+    bool crop(const Region& region)
+    {
+        int rows = min(region.num_rows, num_rows - region.row);
+        int columns = min(region.num_columns, num_columns - region.col);
+        if (region.row < 0 || region.col < 0 || rows <= 0 || columns <= 0)
+        {
+            return false;
+        }
+        origin_row += region.row * row_step[0] + region.col * column_step[0];
+        origin_column += region.row * row_step[1] + region.col * column_step[1];
+        num_rows = rows;
+        num_columns = columns;
+        return true;
+    }
+};
+
+
+/**
+    Copies one row of a view of a 2D vector (pixels or alpha values) into a buffer.
+    Rows that run along a source row are copied forwards or backwards in one go;
+    rows that run down a source column take one value from each source row.
+
+    @param source: The image the view shows.
+    @param view: The view.
+    @param row: The view row.
+    @param dst: Receives view.num_columns values.
+*/
+template <typename T>
+void copy_view_row(const vector<vector<T>>& source, const ViewTransform& view, int row, T* dst)
+{
+    int src_row = view.origin_row + row * view.row_step[0];
+    int src_col = view.origin_column + row * view.row_step[1];
+    int num_columns = view.num_columns;
+    if (view.column_step[0] == 0)
+    {
+        const T* src = source[src_row].data() + src_col;
+        if (view.column_step[1] > 0)
+        {
+            copy(src, src + num_columns, dst);
+        }
+        else
+        {
+            reverse_copy(src - (num_columns - 1), src + 1, dst);
+        }
+        return;
+    }
+    for (int col = 0; col < num_columns; col++, src_row += view.column_step[0])
+    {
+        dst[col] = source[src_row][src_col];
+    }
+}
+
+
+/**
+    Copies a view of a 2D vector (pixels or alpha values) into a new 2D vector, rows in parallel.
+
+    @param source: The image the view shows.
+    @param view: The view.
+    @returns The view's values, view.num_rows x view.num_columns.
+*/
+template <typename T>
+vector<vector<T>> materialize_view(const vector<vector<T>>& source, const ViewTransform& view)
+{
+    vector<vector<T>> result(view.num_rows, vector<T>(view.num_columns));
+    parallel_for(view.num_rows, [&](int row)
+    {
+        copy_view_row(source, view, row, result[row].data());
+    }, view.num_columns);
+    return result;
+}
+
+
+/**
+    An image handle seen through a view transform. The alpha plane, if any, is seen
+    through the same transform.
+*/
+struct ImageView
+{
+    ImageHandle image;
+    ViewTransform transform;
+
+    ImageView() = default;
+
+    explicit ImageView(ImageHandle source)
+        : image(move(source))
+    {
+        pair<int, int> dimensions = get_image_dimensions(image.pixels());
+        transform = ViewTransform(dimensions.first, dimensions.second);
+    }
+
+    bool empty() const
+    {
+        return image.empty() || transform.num_rows <= 0 || transform.num_columns <= 0;
+    }
+
+    bool has_alpha() const
+    {
+        return !image.alpha().empty();
+    }
+
+    /**
+        Whether the view shows its whole image unchanged.
+    */
+    bool is_whole() const
+    {
+        pair<int, int> dimensions = get_image_dimensions(image.pixels());
+        return transform.is_whole(dimensions.first, dimensions.second);
+    }
+};
+
+
+/**
+    Whether an effect only moves pixels around in a way a view transform can express:
+    rotations, flips, the transpose and crops.
+*/
+bool is_view_effect(int choice)
+{
+    switch (choice)
+    {
+        case 4: case 5: case 16: case 17: case 18: case 19:
+            return true;
+    }
+    return false;
+}
+
+
+/**
+    Takes the image out of a view: the image itself when the view shows all of it
+    unchanged, otherwise a new image holding just what the view shows. Each row of a
+    new image is passed through row_pass, when one is given, while it is still in cache.
+
+    @param view: The view, left empty.
+    @param row_pass: Called as row_pass(pixels, count) on each new row, or null.
+    @returns The image.
+*/
+ImageHandle release_view(ImageView& view, const function<void(Pixel*, int)>& row_pass = nullptr)
+{
+    ImageHandle image = move(view.image);
+    ViewTransform transform = view.transform;
+    view = ImageView();
+    pair<int, int> dimensions = get_image_dimensions(image.pixels());
+    if (image.empty() || transform.is_whole(dimensions.first, dimensions.second))
+    {
+        if (row_pass && !image.empty())
+        {
+            vector<vector<Pixel>>& pixels = image.mutable_pixels();
+            parallel_for(transform.num_rows, [&](int row)
+            {
+                row_pass(pixels[row].data(), transform.num_columns);
+            }, transform.num_columns);
+        }
+        return image;
+    }
+
+    const vector<vector<Pixel>>& source = image.pixels();
+    vector<vector<Pixel>> pixels = initialize_new_image(transform.num_rows, transform.num_columns);
+    parallel_for(transform.num_rows, [&](int row)
+    {
+        copy_view_row(source, transform, row, pixels[row].data());
+        if (row_pass)
+        {
+            row_pass(pixels[row].data(), transform.num_columns);
+        }
+    }, transform.num_columns);
+    AlphaPlane alpha = image.alpha().empty() ? AlphaPlane() : materialize_view(image.alpha(), transform);
+    return ImageHandle(move(pixels), move(alpha));
+}
+
+
+/**
+    Returns a function that encodes rows of a view as stored BMP bytes, reading each
+    row straight from the view's source.
+*/
+function<void(int, unsigned char*)> view_row_encoder(const ImageView& view)
+{
+    return [&view](int row, unsigned char* dst)
+    {
+        thread_local vector<Pixel> pixels;
+        thread_local vector<unsigned char> alpha;
+        pixels.resize(view.transform.num_columns);
+        copy_view_row(view.image.pixels(), view.transform, row, pixels.data());
+        if (view.has_alpha())
+        {
+            alpha.resize(view.transform.num_columns);
+            copy_view_row(view.image.alpha(), view.transform, row, alpha.data());
+        }
+        encode_bmp_row(pixels, view.has_alpha() ? &alpha : nullptr, dst);
+    };
+}
+
+
+/**
+    Encodes a view as a BMP file into an existing buffer without making an image of it
+    first (see encode_bmp_into()).
+
+    @param view: The view to encode.
+    @param bytes: Receives the bytes of the BMP file.
+*/
+void encode_bmp_view_into(const ImageView& view, vector<unsigned char>& bytes)
+{
+    if (view.is_whole())
+    {
+        encode_bmp_into(view.image.pixels(), view.image.alpha(), bytes);
+        return;
+    }
+    encode_bmp_rows_into(view.transform.num_columns, view.transform.num_rows, view.has_alpha(),
+                         view_row_encoder(view), bytes);
+}
+
+
+/**
+    Encodes a view in the format chosen by a filename (see encode_image_file()). BMPs
+    are encoded straight from the view; a .nyk file needs the view as an image first.
+
+    @param filename: Name of the image file the bytes are meant for.
+    @param view: The view to encode.
+    @returns The bytes of the file.
+*/
+vector<unsigned char> encode_image_view(const string& filename, ImageView view)
+{
+    if (has_extension(filename, NYK_EXTENSION))
+    {
+        ImageHandle image = release_view(view);
+        return encode_nyk(image.pixels(), image.alpha());
+    }
+    vector<unsigned char> bytes;
+    encode_bmp_view_into(view, bytes);
+    return bytes;
+}
+
+
+/**
+    Writes a view to an image file (see write_image_file()) without making an image of it first.
+
+    @param filename: Name of the image file.
+    @param view: The view to save.
+    @returns True if successful and false otherwise.
+*/
+bool write_image_view(const string& filename, const ImageView& view)
+{
+    if (view.empty())
+    {
+        return false;
+    }
+    if (view.is_whole())
+    {
+        return write_image_file(filename, view.image.pixels(), view.image.alpha());
+    }
+    size_t pixel_bytes = static_cast<size_t>(view.transform.num_rows) * view.transform.num_columns * (view.has_alpha() ? 4 : 3);
+    if (!has_extension(filename, NYK_EXTENSION) && pixel_bytes >= PARALLEL_IO_MIN_BYTES)
+    {
+        return write_bmp_rows_parallel(filename, view.transform.num_columns, view.transform.num_rows, view.has_alpha(),
+                                       view_row_encoder(view));
+    }
+    return write_file_bytes(filename, encode_image_view(filename, view));
+}
+
+
+//***************************************************************************************************//
+//                                    ASYNC FILE I/O                                                //
+//
+// Reads whole files ahead of time and writes finished files behind the compute, so the
+// batch pipeline's disks stay busy while images are being filtered. On Linux the
+// requests go through io_uring (set up with raw system calls); if the kernel does not
+// offer it (too old, or blocked by a sandbox) a small pool of threads runs them with
+// blocking pread()/pwrite() instead.
+
+// Largest single read or write handed to the kernel (the length field is 32 bits)
+const size_t ASYNC_IO_CHUNK = 1 << 30;
+
+// Default number of file reads and writes the batch pipeline keeps in progress
+const int DEFAULT_QUEUE_DEPTH = 4;
+
+// Default number of files the batch pipeline processes at once
+const int DEFAULT_MAX_IN_FLIGHT = 64;
+
+
+// Called when a file operation ends, with whether it succeeded and its buffer
+using IoCallback = function<void(bool, vector<unsigned char>&)>;
+
+
+/**
+    One whole-file read or write in flight.
+*/
+struct IoOperation
+{
+    int fd = -1;
+    bool is_write = false;
+    vector<unsigned char> data;             // Buffer being read into or written out
+    size_t done = 0;                        // Bytes transferred so far
+    IoCallback on_complete;
+};
+
+
+#if NYARKO_HAVE_IO_URING
+/**
+    Minimal io_uring submission/completion ring. Submissions are serialized by a mutex;
+    a single reaper thread owns the completion side.
+*/
+class IoUring
+{
+public:
+    ~IoUring()
+    {
+        if (sqes != nullptr)
+        {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ptr != nullptr && cq_ptr != sq_ptr)
+        {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != nullptr)
+        {
+            munmap(sq_ptr, sq_size);
+        }
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+        }
+    }
+
+    /**
+        Creates the ring. Fails if the kernel lacks io_uring or its read/write operations.
+    */
+    bool setup(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))  // Read/write ops arrived with this feature
+        {
+            return false;
+        }
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_size = cq_size = max(sq_size, cq_size);
+        }
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+        {
+            sq_ptr = nullptr;
+            return false;
+        }
+        cq_ptr = single_mmap ? sq_ptr : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            cq_ptr = nullptr;
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqes_ptr);
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    /**
+        Queues one operation and hands it to the kernel.
+
+        @param opcode: IORING_OP_READ, IORING_OP_WRITE or IORING_OP_NOP.
+        @param user_data: Returned unchanged with the completion.
+        @returns false if the kernel refused the submission; the entry is then taken
+                 back off the ring, so the kernel can never see it later.
+    */
+    bool submit(int opcode, int fd, void* buffer, unsigned length, unsigned long long offset, unsigned long long user_data)
+    {
+        lock_guard<mutex> lock(submit_mutex);
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<unsigned long long>(buffer);
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        // The kernel only takes entries inside this call, and calls that submit hold submit_mutex
+        while (true)
+        {
+            long submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+            if (submitted == 1 || __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) != tail)
+            {
+                return true;
+            }
+            if (submitted < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+    }
+
+    /**
+        Blocks until a completion is available and takes it off the ring.
+    */
+    bool wait(unsigned long long& user_data, int& result)
+    {
+        while (true)
+        {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            {
+                io_uring_cqe* cqe = &cqes[head & cq_mask];
+                user_data = cqe->user_data;
+                result = cqe->res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+            {
+                return false;
+            }
+        }
+    }
+
+private:
+    int ring_fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    size_t sqes_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    mutex submit_mutex;
+};
+#endif
+
+
+/**
+    Asynchronous whole-file reads and writes with a bounded number of files in flight.
+*/
+class AsyncFileIo
+{
+public:
+    /**
+        @param queue_depth: Maximum number of files being read or written at once;
+                            further requests wait their turn without blocking the caller.
+    */
+    explicit AsyncFileIo(int queue_depth) : depth(max(1, queue_depth))
+    {
+#if NYARKO_HAVE_IO_URING
+        ring.reset(new IoUring());
+        if (ring->setup(static_cast<unsigned>(depth)))
+        {
+            reaper = thread(&AsyncFileIo::reap_completions, this);
+            return;
+        }
+        ring.reset();
+#endif
+        for (int i = 0; i < depth; i++)
+        {
+            workers.emplace_back(&AsyncFileIo::run_worker, this);
+        }
+    }
+
+    ~AsyncFileIo()
+    {
+        {
+            unique_lock<mutex> lock(state_mutex);
+            all_done.wait(lock, [&]() { return in_flight == 0 && waiting.empty(); });
+            stopping = true;
+        }
+        work_ready.notify_all();
+#if NYARKO_HAVE_IO_URING
+        if (ring)
+        {
+            ring->submit(IORING_OP_NOP, -1, nullptr, 0, 0, 0);  // user_data 0 wakes and stops the reaper
+            reaper.join();
+        }
+#endif
+        for (thread& worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    /**
+        Name of the backend in use, for status messages.
+    */
+    string backend() const
+    {
+#if NYARKO_HAVE_IO_URING
+        if (ring)
+        {
+            return "io_uring";
+        }
+#endif
+        return "thread pool";
+    }
+
+    /**
+        Starts reading a whole file.
+
+        @param filename: Name of the file.
+        @param on_complete: Called from an I/O thread once the read ends, with whether it
+                            succeeded and the file's contents (which it may move from).
+    */
+    void read_file(const string& filename, IoCallback on_complete)
+    {
+        IoOperation* operation = new IoOperation();
+        operation->on_complete = move(on_complete);
+
+        struct stat info;
+        operation->fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (operation->fd < 0 || fstat(operation->fd, &info) != 0 || info.st_size <= 0)
+        {
+            complete(operation, false);
+            return;
+        }
+        operation->data.resize(info.st_size);
+        start(operation);
+    }
+
+    /**
+        Starts reading a whole file.
+
+        @param filename: Name of the file.
+        @returns Future holding the file's contents, or an empty vector if it could not be read.
+    */
+    future<vector<unsigned char>> read_file(const string& filename)
+    {
+        shared_ptr<promise<vector<unsigned char>>> result = make_shared<promise<vector<unsigned char>>>();
+        read_file(filename, [result](bool ok, vector<unsigned char>& data)
+        {
+            result->set_value(ok ? move(data) : vector<unsigned char>());
+        });
+        return result->get_future();
+    }
+
+    /**
+        Starts writing a whole file, replacing it if it exists.
+
+        @param filename: Name of the file.
+        @param bytes: The contents to write; the buffer is kept until the write finishes.
+        @param on_complete: Called from an I/O thread once the write ends, with whether it succeeded.
+    */
+    void write_file(const string& filename, vector<unsigned char> bytes, IoCallback on_complete)
+    {
+        IoOperation* operation = new IoOperation();
+        operation->on_complete = move(on_complete);
+        operation->is_write = true;
+        operation->data = move(bytes);
+        operation->fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (operation->fd < 0)
+        {
+            complete(operation, false);
+            return;
+        }
+        start(operation);
+    }
+
+    /**
+        Starts writing a whole file, replacing it if it exists.
+
+        @param filename: Name of the file.
+        @param bytes: The contents to write; the buffer is kept until the write finishes.
+        @returns Future that is true once the file has been written, false on failure.
+    */
+    future<bool> write_file(const string& filename, vector<unsigned char> bytes)
+    {
+        shared_ptr<promise<bool>> result = make_shared<promise<bool>>();
+        write_file(filename, move(bytes), [result](bool ok, vector<unsigned char>&)
+        {
+            result->set_value(ok);
+        });
+        return result->get_future();
+    }
+
+private:
+    int depth;
+    mutex state_mutex;
+    condition_variable all_done;
+    condition_variable work_ready;
+    int in_flight = 0;
+    bool stopping = false;
+    deque<IoOperation*> waiting;  // Operations waiting for a free slot
+    deque<IoOperation*> pending;  // Thread pool backend: operations ready for a worker
+    vector<thread> workers;
+#if NYARKO_HAVE_IO_URING
+    unique_ptr<IoUring> ring;
+    thread reaper;
+#endif
+
+    /**
+        Hands the operation to the backend if a slot is free, or queues it until one is.
+    */
+    void start(IoOperation* operation)
+    {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (in_flight >= depth)
+            {
+                waiting.push_back(operation);
+                return;
+            }
+            in_flight++;
+        }
+        launch(operation);
+    }
+
+    /**
+        Sends an operation that holds a slot to the backend.
+    */
+    void launch(IoOperation* operation)
+    {
+#if NYARKO_HAVE_IO_URING
+        if (ring)
+        {
+            if (operation->data.empty() || !submit_next(operation))
+            {
+                finish(operation, operation->data.empty());
+            }
+            return;
+        }
+#endif
+        {
+            lock_guard<mutex> lock(state_mutex);
+            pending.push_back(operation);
+        }
+        work_ready.notify_one();
+    }
+
+    /**
+        Closes the file and runs the operation's callback.
+    */
+    void complete(IoOperation* operation, bool ok)
+    {
+        if (operation->fd >= 0)
+        {
+            ok = (close(operation->fd) == 0) && ok;
+        }
+        operation->on_complete(ok, operation->data);
+        delete operation;
+    }
+
+    /**
+        Completes an operation that held a slot and passes the slot on.
+    */
+    void finish(IoOperation* operation, bool ok)
+    {
+        complete(operation, ok);
+
+        IoOperation* next = nullptr;
+        {
+            lock_guard<mutex> lock(state_mutex);
+            if (!waiting.empty())
+            {
+                next = waiting.front();
+                waiting.pop_front();
+            }
+            else
+            {
+                in_flight--;
+            }
+        }
+        if (next != nullptr)
+        {
+            launch(next);
+        }
+        else
+        {
+            all_done.notify_all();
+        }
+    }
+
+#if NYARKO_HAVE_IO_URING
+    /**
+        Submits the next chunk of an operation to the ring.
+    */
+    bool submit_next(IoOperation* operation)
+    {
+        size_t length = min(ASYNC_IO_CHUNK, operation->data.size() - operation->done);
+        return ring->submit(operation->is_write ? IORING_OP_WRITE : IORING_OP_READ, operation->fd,
+                            operation->data.data() + operation->done, static_cast<unsigned>(length),
+                            operation->done, reinterpret_cast<unsigned long long>(operation));
+    }
+
+    /**
+        Reaper thread: collects completions, resubmits short transfers and finishes operations.
+    */
+    void reap_completions()
+    {
+        unsigned long long user_data;
+        int result;
+        while (ring->wait(user_data, result) && user_data != 0)
+        {
+            IoOperation* operation = reinterpret_cast<IoOperation*>(user_data);
+            if (result <= 0)
+            {
+                finish(operation, false);
+                continue;
+            }
+            operation->done += result;
+            if (operation->done == operation->data.size())
+            {
+                finish(operation, true);
+            }
+            else if (!submit_next(operation))
+            {
+                finish(operation, false);
+            }
+        }
+    }
+#endif
+
+    /**
+        Thread pool worker: runs queued operations with blocking pread()/pwrite().
+    */
+    void run_worker()
+    {
+        while (true)
+        {
+            IoOperation* operation;
+            {
+                unique_lock<mutex> lock(state_mutex);
+                work_ready.wait(lock, [&]() { return stopping || !pending.empty(); });
+                if (pending.empty())
+                {
+                    return;
+                }
+                operation = pending.front();
+                pending.pop_front();
+            }
+
+            bool ok = true;
+            while (ok && operation->done < operation->data.size())
+            {
+                size_t length = min(ASYNC_IO_CHUNK, operation->data.size() - operation->done);
+                unsigned char* buffer = operation->data.data() + operation->done;
+                ssize_t result = operation->is_write ? pwrite(operation->fd, buffer, length, operation->done)
+                                                     : pread(operation->fd, buffer, length, operation->done);
+                if (result > 0)
+                {
+                    operation->done += result;
+                }
+                else if (!(result < 0 && errno == EINTR))
+                {
+                    ok = false;
+                }
+            }
+            finish(operation, ok);
+        }
+    }
+};
+
+
+//***************************************************************************************************//
+//                                    COROUTINE TASKS                                               //
+//
+// The batch pipeline runs each file as a coroutine. A file's task suspends while its
+// input is read and its output is written, and is resumed as a task on the task
+// scheduler when the I/O completes, so any number of files can be in flight without a
+// thread per file. The effects run between the suspension points, and their own
+// parallel_for() pieces are stolen by idle workers when the image is large.
+
+/**
+    Queues a suspended coroutine to be resumed as a task on the task scheduler.
+*/
+void resume_later(coroutine_handle<> handle)
+{
+    task_scheduler().spawn([handle]() { handle.resume(); });
+}
+
+
+/**
+    Return type of a coroutine that starts running immediately, is never awaited and
+    frees itself when it finishes. Completion is signalled by the coroutine itself.
+*/
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return DetachedTask(); }
+        suspend_never initial_suspend() noexcept { return suspend_never(); }
+        suspend_never final_suspend() noexcept { return suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+
+/**
+    Counting semaphore for coroutines: acquire() suspends the caller instead of blocking
+    its thread while no units are left, and release() resumes a waiter on the task scheduler.
+*/
+class AsyncSemaphore
+{
+public:
+    explicit AsyncSemaphore(int count) : count(count) {}
+
+    auto acquire()
+    {
+        struct Awaiter
+        {
+            AsyncSemaphore& semaphore;
+            bool await_ready() { return false; }
+            bool await_suspend(coroutine_handle<> handle)
+            {
+                lock_guard<mutex> lock(semaphore.count_mutex);
+                if (semaphore.count > 0)
+                {
+                    semaphore.count--;
+                    return false;  // Carry on without suspending
+                }
+                semaphore.waiters.push_back(handle);
+                return true;
+            }
+            void await_resume() {}
+        };
+        return Awaiter{*this};
+    }
+
+    void release()
+    {
+        coroutine_handle<> next;
+        {
+            lock_guard<mutex> lock(count_mutex);
+            if (waiters.empty())
+            {
+                count++;
+                return;
+            }
+            next = waiters.front();  // The unit passes straight to the next waiter
+            waiters.pop_front();
+        }
+        resume_later(next);
+    }
+
+private:
+    mutex count_mutex;
+    int count;
+    deque<coroutine_handle<>> waiters;
+};
+
+
+/**
+    Byte budget for coroutines: acquire(bytes) suspends the caller until that many bytes
+    of the budget are free, and release(bytes) hands freed bytes to waiters in the order
+    they arrived, so a large request is not starved by a stream of small ones. A request
+    larger than the whole budget waits for all of it.
+*/
+class AsyncMemoryBudget
+{
+public:
+    explicit AsyncMemoryBudget(unsigned long long bytes) : total(max(1ULL, bytes)), available(total) {}
+
+    unsigned long long capacity() const { return total; }
+
+    auto acquire(unsigned long long bytes)
+    {
+        struct Awaiter
+        {
+            AsyncMemoryBudget& budget;
+            unsigned long long bytes;
+            bool await_ready() { return false; }
+            bool await_suspend(coroutine_handle<> handle)
+            {
+                lock_guard<mutex> lock(budget.budget_mutex);
+                if (budget.waiters.empty() && budget.available >= bytes)
+                {
+                    budget.available -= bytes;
+                    return false;  // Carry on without suspending
+                }
+                budget.waiters.emplace_back(handle, bytes);
+                return true;
+            }
+            void await_resume() {}
+        };
+        return Awaiter{*this, min(bytes, total)};
+    }
+
+    void release(unsigned long long bytes)
+    {
+        vector<coroutine_handle<>> ready;
+        {
+            lock_guard<mutex> lock(budget_mutex);
+            available += min(bytes, total);
+            while (!waiters.empty() && available >= waiters.front().second)
+            {
+                available -= waiters.front().second;
+                ready.push_back(waiters.front().first);
+                waiters.pop_front();
+            }
+        }
+        for (coroutine_handle<> handle : ready)
+        {
+            resume_later(handle);
+        }
+    }
+
+private:
+    mutex budget_mutex;
+    const unsigned long long total;
+    unsigned long long available;
+    deque<pair<coroutine_handle<>, unsigned long long>> waiters;  // Suspended callers and the bytes each asked for
+};
+
+
+/**
+    Awaitable that reads a whole file and resumes the coroutine on the task scheduler.
+    co_await yields the file's contents, or an empty vector if it could not be read.
+*/
+struct FileReadAwaiter
+{
+    AsyncFileIo& io;
+    string filename;
+    vector<unsigned char> data;
+
+    FileReadAwaiter(AsyncFileIo& io, const string& filename) : io(io), filename(filename) {}
+
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> handle)
+    {
+        io.read_file(filename, [this, handle](bool ok, vector<unsigned char>& bytes)
+        {
+            if (ok)
+            {
+                data = move(bytes);
+            }
+            resume_later(handle);
+        });
+    }
+    vector<unsigned char> await_resume() { return move(data); }
+};
+
+
+/**
+    Awaitable that writes a whole file and resumes the coroutine on the task scheduler.
+    co_await yields true if the file was written, false otherwise.
+*/
+struct FileWriteAwaiter
+{
+    AsyncFileIo& io;
+    string filename;
+    vector<unsigned char> bytes;
+    bool ok = false;
+
+    FileWriteAwaiter(AsyncFileIo& io, const string& filename, vector<unsigned char> bytes)
+        : io(io), filename(filename), bytes(move(bytes)) {}
+
+    bool await_ready() { return false; }
+    void await_suspend(coroutine_handle<> handle)
+    {
+        io.write_file(filename, move(bytes), [this, handle](bool success, vector<unsigned char>&)
+        {
+            ok = success;
+            resume_later(handle);
+        });
+    }
+    bool await_resume() { return ok; }
+};
+
+
+//***************************************************************************************************//
+//                                   COLOR CONVERSION                                               //
+//
+// Conversions from RGB to other color spaces and back, in integer math over whole rows.
+// Luma, the brightness that greyscale, high contrast and Clarendon decide on, comes with
+// three weightings: the plain average of the channels the program has always used, and
+// the BT.601 (standard definition) and BT.709 (HD) perceptual weights, which count green
+// most and blue least. With SSE2 a row's luma is worked out eight pixels at a time in
+// 16-bit lanes, giving exactly what pixel_luma() gives for one pixel, so the average
+// weighting still matches round(grey_value(...)). YCbCr and HSV use 0-255 channels like
+// the rest of the program (hue is in degrees, 0-359).
+
+/**
+    How the channels of a pixel are weighted into its luma.
+*/
+enum class LumaWeights
+{
+    Average,  // (red + green + blue) / 3
+    Bt601,    // 0.299 red + 0.587 green + 0.114 blue
+    Bt709     // 0.2126 red + 0.7152 green + 0.0722 blue
+};
+
+
+// Luma weights in 1/256ths; each set adds up to 256, so white stays 255
+struct LumaCoefficients
+{
+    int red;
+    int green;
+    int blue;
+};
+
+
+/**
+    @returns The 8-bit fixed point weights of a perceptual luma weighting.
+*/
+constexpr LumaCoefficients luma_coefficients(LumaWeights weights)
+{
+    return (weights == LumaWeights::Bt709) ? LumaCoefficients{54, 183, 19} : LumaCoefficients{77, 150, 29};
+}
+
+
+/**
+    Luma of one pixel, rounded to the nearest integer. For the average this is the same
+    as round(grey_value(...)): the sum divided by 3 never ends in exactly .5, so adding 1
+    before the integer division rounds correctly.
+*/
+template <LumaWeights Weights = LumaWeights::Average>
+inline int pixel_luma(const Pixel& p)
+{
+    if constexpr (Weights == LumaWeights::Average)
+    {
+        return (p.red + p.green + p.blue + 1) / 3;
+    }
+    else
+    {
+        constexpr LumaCoefficients c = luma_coefficients(Weights);
+        return (c.red * p.red + c.green * p.green + c.blue * p.blue + 128) >> 8;
+    }
+}
+
+
+#if defined(__SSE2__)
+/**
+    Loads four pixels (twelve ints) and splits them into one register per channel.
+*/
+inline void load_pixel_channels(const Pixel* pixels, __m128i& red, __m128i& green, __m128i& blue)
+{
+    const float* src = reinterpret_cast<const float*>(&pixels[0].red);
+    __m128 v0 = _mm_loadu_ps(src);      // r0 g0 b0 r1
+    __m128 v1 = _mm_loadu_ps(src + 4);  // g1 b1 r2 g2
+    __m128 v2 = _mm_loadu_ps(src + 8);  // b2 r3 g3 b3
+    red = _mm_castps_si128(_mm_shuffle_ps(v0, _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0)));
+    green = _mm_castps_si128(_mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(0, 0, 1, 1)),
+                                            _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0)));
+    blue = _mm_castps_si128(_mm_shuffle_ps(_mm_shuffle_ps(v0, v1, _MM_SHUFFLE(1, 1, 2, 2)),
+                                           _mm_shuffle_ps(v2, v2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
+
+
+/**
+    Works out the luma of a row of pixels. With SSE2, eight pixels at a time have their
+    channels narrowed to 16-bit lanes. The average multiplies sum + 1 by 21846 / 65536,
+    which is a little over 1/3 but floors to the same quotient for every sum up to 765;
+    the perceptual weightings fit in 16 bits because their weights add up to 256.
+
+    @param pixels: The row.
+    @param count: Number of pixels in the row.
+    @param luma: Receives one value per pixel.
+*/
+template <LumaWeights Weights = LumaWeights::Average>
+void rgb_row_to_luma(const Pixel* pixels, int count, unsigned char* luma)
+{
+    int col = 0;
+#if defined(__SSE2__)
+    static_assert(sizeof(Pixel) == 3 * sizeof(int), "Pixel must be three packed ints");
+    constexpr LumaCoefficients c = luma_coefficients(Weights);
+    const __m128i red_weight = _mm_set1_epi16(c.red);
+    const __m128i green_weight = _mm_set1_epi16(c.green);
+    const __m128i blue_weight = _mm_set1_epi16(c.blue);
+    const __m128i one_third = _mm_set1_epi16(21846);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; col + 8 <= count; col += 8)
+    {
+        __m128i red_low, green_low, blue_low, red_high, green_high, blue_high;
+        load_pixel_channels(pixels + col, red_low, green_low, blue_low);
+        load_pixel_channels(pixels + col + 4, red_high, green_high, blue_high);
+        __m128i red = _mm_packs_epi32(red_low, red_high);
+        __m128i green = _mm_packs_epi32(green_low, green_high);
+        __m128i blue = _mm_packs_epi32(blue_low, blue_high);
+
+        __m128i value;
+        if constexpr (Weights == LumaWeights::Average)
+        {
+            __m128i sum = _mm_add_epi16(_mm_add_epi16(red, green), _mm_add_epi16(blue, one));
+            value = _mm_mulhi_epu16(sum, one_third);
+        }
+        else
+        {
+            __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(red, red_weight), _mm_mullo_epi16(green, green_weight)),
+                                        _mm_add_epi16(_mm_mullo_epi16(blue, blue_weight), half));
+            value = _mm_srli_epi16(sum, 8);
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(luma + col), _mm_packus_epi16(value, value));
+    }
+#endif
+    for (; col < count; col++)
+    {
+        luma[col] = static_cast<unsigned char>(pixel_luma<Weights>(pixels[col]));
+    }
+}
+
+
+/**
+    Turns a row of luma values into grey pixels. With SSE2, four values at a time are
+    widened to ints and each is repeated into its pixel's three channels.
+
+    @param luma: One value per pixel.
+    @param count: Number of pixels in the row.
+    @param pixels: Receives the grey pixels.
+*/
+void grey_row_to_rgb(const unsigned char* luma, int count, Pixel* pixels)
+{
+    int col = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    int* dst = &pixels[0].red;
+    for (; col + 4 <= count; col += 4)
+    {
+        int packed;
+        memcpy(&packed, luma + col, sizeof(packed));
+        __m128i values = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * col), _mm_shuffle_epi32(values, _MM_SHUFFLE(1, 0, 0, 0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * col + 4), _mm_shuffle_epi32(values, _MM_SHUFFLE(2, 2, 1, 1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * col + 8), _mm_shuffle_epi32(values, _MM_SHUFFLE(3, 3, 3, 2)));
+    }
+#endif
+    for (; col < count; col++)
+    {
+        pixels[col] = Pixel{luma[col], luma[col], luma[col]};
+    }
+}
+
+
+/**
+    Sets each luma value at or above the threshold to 255 and the rest to 0.
+*/
+void threshold_luma_row(unsigned char* luma, int count, int threshold)
+{
+    int col = 0;
+#if defined(__SSE2__)
+    if (threshold > 0 && threshold <= 255)
+    {
+        const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+        for (; col + 16 <= count; col += 16)
+        {
+            __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(luma + col));
+            // max(value, threshold) == value exactly when value >= threshold; the match is all ones
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(luma + col), _mm_cmpeq_epi8(_mm_max_epu8(values, limit), values));
+        }
+    }
+#endif
+    for (; col < count; col++)
+    {
+        luma[col] = (luma[col] >= threshold) ? 255 : 0;
+    }
+}
+
+
+// Pixels whose luma is worked out at once; small enough to keep on the stack
+const int LUMA_CHUNK = 256;
+
+
+/**
+    Works out the luma of a row a chunk at a time and hands each chunk to a body,
+    which receives the chunk's first column, its length and its luma values. The luma
+    of a chunk is complete before the body runs, so the body may overwrite the chunk's
+    pixels (the row may be filtered in place).
+
+    @param pixels: The row.
+    @param count: Number of pixels in the row.
+    @param body: Called as body(first_col, chunk_count, luma) for each chunk.
+*/
+template <LumaWeights Weights, typename Body>
+void for_each_luma_chunk(const Pixel* pixels, int count, Body&& body)
+{
+    unsigned char luma[LUMA_CHUNK];
+    for (int first_col = 0; first_col < count; first_col += LUMA_CHUNK)
+    {
+        int chunk_count = min(LUMA_CHUNK, count - first_col);
+        rgb_row_to_luma<Weights>(pixels + first_col, chunk_count, luma);
+        body(first_col, chunk_count, luma);
+    }
+}
+
+
+/**
+    Calls a visitor with a luma weighting as a compile time constant, so a weighting
+    chosen at run time still reaches filters specialized for it.
+
+    @param weights: The weighting.
+    @param visitor: Called once with an integral_constant holding the weighting.
+*/
+template <typename Visitor>
+void visit_luma_weights(LumaWeights weights, Visitor&& visitor)
+{
+    switch (weights)
+    {
+        case LumaWeights::Bt601: visitor(integral_constant<LumaWeights, LumaWeights::Bt601>()); break;
+        case LumaWeights::Bt709: visitor(integral_constant<LumaWeights, LumaWeights::Bt709>()); break;
+        default:                 visitor(integral_constant<LumaWeights, LumaWeights::Average>()); break;
+    }
+}
+
+
+// Full-range YCbCr: Y, Cb and Cr are all 0-255, with 128 as "no color" for Cb and Cr
+struct ColorYCbCr
+{
+    int y;
+    int cb;
+    int cr;
+};
+
+
+/**
+    The fixed point (16 fractional bits) matrices between RGB and YCbCr for a luma
+    weighting, from its red and blue weights.
+*/
+struct YCbCrMatrix
+{
+    int y_red, y_green, y_blue;
+    int cb_red, cb_green, cb_blue;
+    int cr_red, cr_green, cr_blue;
+    int red_cr, green_cb, green_cr, blue_cb;
+
+    constexpr YCbCrMatrix(double kr, double kb)
+        : y_red(fixed(kr)), y_green(fixed(1.0 - kr - kb)), y_blue(fixed(kb)),
+          cb_red(fixed(-kr / (2.0 * (1.0 - kb)))), cb_green(fixed(-(1.0 - kr - kb) / (2.0 * (1.0 - kb)))), cb_blue(fixed(0.5)),
+          cr_red(fixed(0.5)), cr_green(fixed(-(1.0 - kr - kb) / (2.0 * (1.0 - kr)))), cr_blue(fixed(-kb / (2.0 * (1.0 - kr)))),
+          red_cr(fixed(2.0 * (1.0 - kr))),
+          green_cb(fixed(-2.0 * kb * (1.0 - kb) / (1.0 - kr - kb))),
+          green_cr(fixed(-2.0 * kr * (1.0 - kr) / (1.0 - kr - kb))),
+          blue_cb(fixed(2.0 * (1.0 - kb)))
+    {
+    }
+
+    static constexpr int fixed(double value)
+    {
+        return static_cast<int>(value * 65536.0 + (value < 0.0 ? -0.5 : 0.5));
+    }
+};
+
+
+/**
+    @returns The YCbCr matrix of a perceptual luma weighting.
+*/
+template <LumaWeights Weights>
+constexpr YCbCrMatrix ycbcr_matrix()
+{
+    static_assert(Weights != LumaWeights::Average, "YCbCr is defined for the BT.601 and BT.709 weights");
+    return (Weights == LumaWeights::Bt709) ? YCbCrMatrix(0.2126, 0.0722) : YCbCrMatrix(0.299, 0.114);
+}
+
+
+/**
+    Converts a row of pixels to full-range YCbCr.
+
+    @param pixels: The row.
+    @param count: Number of pixels in the row.
+    @param colors: Receives one YCbCr color per pixel.
+*/
+template <LumaWeights Weights = LumaWeights::Bt601>
+void rgb_row_to_ycbcr(const Pixel* pixels, int count, ColorYCbCr* colors)
+{
+    constexpr YCbCrMatrix m = ycbcr_matrix<Weights>();
+    const int round_half = 1 << 15;
+    const int chroma_offset = (128 << 16) + round_half;
+    for (int col = 0; col < count; col++)
+    {
+        const Pixel& p = pixels[col];
+        int y = (m.y_red * p.red + m.y_green * p.green + m.y_blue * p.blue + round_half) >> 16;
+        int cb = (m.cb_red * p.red + m.cb_green * p.green + m.cb_blue * p.blue + chroma_offset) >> 16;
+        int cr = (m.cr_red * p.red + m.cr_green * p.green + m.cr_blue * p.blue + chroma_offset) >> 16;
+        colors[col] = ColorYCbCr{min(255, y), max(0, min(255, cb)), max(0, min(255, cr))};
+    }
+}
+
+
+/**
+    Converts a row of full-range YCbCr colors back to pixels, clamping to 0-255.
+
+    @param colors: The row.
+    @param count: Number of colors in the row.
+    @param pixels: Receives one pixel per color.
+*/
+template <LumaWeights Weights = LumaWeights::Bt601>
+void ycbcr_row_to_rgb(const ColorYCbCr* colors, int count, Pixel* pixels)
+{
+    constexpr YCbCrMatrix m = ycbcr_matrix<Weights>();
+    const int round_half = 1 << 15;
+    for (int col = 0; col < count; col++)
+    {
+        int y = (colors[col].y << 16) + round_half;
+        int cb = colors[col].cb - 128;
+        int cr = colors[col].cr - 128;
+        int red = (y + m.red_cr * cr) >> 16;
+        int green = (y + m.green_cb * cb + m.green_cr * cr) >> 16;
+        int blue = (y + m.blue_cb * cb) >> 16;
+        pixels[col] = Pixel{max(0, min(255, red)), max(0, min(255, green)), max(0, min(255, blue))};
+    }
+}
+
+
+// Hue in degrees (0-359), saturation and value 0-255
+struct ColorHSV
+{
+    int hue;
+    int saturation;
+    int value;
+};
+
+
+/**
+    Converts a row of pixels to HSV. Grey pixels get a hue and saturation of 0.
+
+    @param pixels: The row.
+    @param count: Number of pixels in the row.
+    @param colors: Receives one HSV color per pixel.
+*/
+void rgb_row_to_hsv(const Pixel* pixels, int count, ColorHSV* colors)
+{
+    for (int col = 0; col < count; col++)
+    {
+        const Pixel& p = pixels[col];
+        int max_color = max(p.red, max(p.green, p.blue));
+        int min_color = min(p.red, min(p.green, p.blue));
+        int delta = max_color - min_color;
+        if (delta == 0)
+        {
+            colors[col] = ColorHSV{0, 0, max_color};
+            continue;
+        }
+
+        // Each sixth of the hue circle is 60 degrees, rounded to the nearest degree
+        int base;
+        int offset;
+        if (max_color == p.red)
+        {
+            base = 0;
+            offset = p.green - p.blue;
+        }
+        else if (max_color == p.green)
+        {
+            base = 120;
+            offset = p.blue - p.red;
+        }
+        else
+        {
+            base = 240;
+            offset = p.red - p.green;
+        }
+        int scaled = 60 * offset;
+        int hue = base + (scaled + (scaled < 0 ? -delta / 2 : delta / 2)) / delta;
+        hue = (hue + 360) % 360;
+        int saturation = (255 * delta + max_color / 2) / max_color;
+        colors[col] = ColorHSV{hue, saturation, max_color};
+    }
+}
+
+
+/**
+    Converts a row of HSV colors back to pixels.
+
+    @param colors: The row; hues outside 0-359 wrap around.
+    @param count: Number of colors in the row.
+    @param pixels: Receives one pixel per color.
+*/
+void hsv_row_to_rgb(const ColorHSV* colors, int count, Pixel* pixels)
+{
+    for (int col = 0; col < count; col++)
+    {
+        int value = max(0, min(255, colors[col].value));
+        int saturation = max(0, min(255, colors[col].saturation));
+        if (saturation == 0)
+        {
+            pixels[col] = Pixel{value, value, value};
+            continue;
+        }
+
+        int hue = ((colors[col].hue % 360) + 360) % 360;
+        int sector = hue / 60;
+        int fraction = (hue % 60) * 255 / 60;  // Position within the sector, 0-255
+        int low = (value * (255 - saturation) + 127) / 255;
+        int falling = (value * (255 * 255 - saturation * fraction) + 255 * 127) / (255 * 255);
+        int rising = (value * (255 * 255 - saturation * (255 - fraction)) + 255 * 127) / (255 * 255);
+        switch (sector)
+        {
+            case 0:  pixels[col] = Pixel{value, rising, low}; break;
+            case 1:  pixels[col] = Pixel{falling, value, low}; break;
+            case 2:  pixels[col] = Pixel{low, value, rising}; break;
+            case 3:  pixels[col] = Pixel{low, falling, value}; break;
+            case 4:  pixels[col] = Pixel{rising, low, value}; break;
+            default: pixels[col] = Pixel{value, low, falling}; break;
+        }
+    }
+}
+
+
+//***************************************************************************************************//
+//                                   FILTER FRAMEWORK                                               //
+//
+// Each effect is a small functor that maps one Pixel to its new value: either
+// filter(pixel) for effects that only look at the color, or filter(pixel, row, col)
+// for effects that also depend on the position. Effects that do better a row at a time
+// (those built on the luma conversions) also offer filter(src, dst, count), which the
+// drivers use when it is there. apply_filter() is the one row driver for all of them;
+// because the functor type is a template parameter, the call is inlined into a plain
+// loop over each row. Parameters fixed at compile time (thresholds,
+// rotation counts, common enlarge factors) are template arguments so the compiler can
+// fold them into the loops. Channel values are 0-255 throughout the program, which is
+// what lets several effects be precomputed into 256 entry lookup tables.
+
+/**
+    Runs a filter functor over every pixel of an image, one row per task.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param filter: The functor to apply.
+    @returns A new image of the same size holding the filtered pixels.
+*/
+template <typename Filter>
+vector<vector<Pixel>> apply_filter(const vector<vector<Pixel>>& image, const Filter& filter)
+{
+    pair<int, int> dimensions = get_image_dimensions(image);
+    int num_rows = dimensions.first;
+    int num_columns = dimensions.second;
+    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
+
+    parallel_for(num_rows, [&](int row)
+    {
+        const Pixel* src = image[row].data();
+        Pixel* dst = new_image[row].data();
+        if constexpr (is_invocable_v<const Filter&, const Pixel*, Pixel*, int>)
+        {
+            filter(src, dst, num_columns);
+        }
+        else if constexpr (is_invocable_v<const Filter&, const Pixel&, int, int>)
+        {
+            for (int col = 0; col < num_columns; col++)
+            {
+                dst[col] = filter(src[col], row, col);
+            }
+        }
+        else
+        {
+            for (int col = 0; col < num_columns; col++)
+            {
+                dst[col] = filter(src[col]);
+            }
+        }
+    }, num_columns);
+    return new_image;
+}
+
+
+/**
+    Runs a filter functor over every pixel of an image, writing the results back into it.
+
+    @param image: The image, modified in place.
+    @param filter: The functor to apply.
+*/
+template <typename Filter>
+void apply_filter_in_place(vector<vector<Pixel>>& image, const Filter& filter)
+{
+    pair<int, int> dimensions = get_image_dimensions(image);
+    int num_rows = dimensions.first;
+    int num_columns = dimensions.second;
+
+    parallel_for(num_rows, [&](int row)
+    {
+        Pixel* pixels = image[row].data();
+        if constexpr (is_invocable_v<const Filter&, const Pixel*, Pixel*, int>)
+        {
+            filter(pixels, pixels, num_columns);
+        }
+        else if constexpr (is_invocable_v<const Filter&, const Pixel&, int, int>)
+        {
+            for (int col = 0; col < num_columns; col++)
+            {
+                pixels[col] = filter(pixels[col], row, col);
+            }
+        }
+        else
+        {
+            for (int col = 0; col < num_columns; col++)
+            {
+                pixels[col] = filter(pixels[col]);
+            }
+        }
+    }, num_columns);
+}
+
+
+/**
+    Vignette (process1): scales each pixel by its distance to the image center.
+    The scaling factors come from a precomputed mask when one is given.
+*/
+struct VignetteFilter
+{
+    int num_rows;
+    int num_columns;
+    const double* mask = nullptr;  // Row-major scaling factors, or null to compute them
+
+    Pixel operator()(const Pixel& p, int row, int col) const
+    {
+        double scaling_factor = (mask != nullptr) ? mask[static_cast<size_t>(row) * num_columns + col]
+                                                  : calculate_vignette_scaling_factor(row, col, num_rows, num_columns);
+        return Pixel{max(0, min(255, static_cast<int>(p.red * scaling_factor))),
+                     max(0, min(255, static_cast<int>(p.green * scaling_factor))),
+                     max(0, min(255, static_cast<int>(p.blue * scaling_factor)))};
+    }
+};
+
+
+/**
+    Applies one 256 entry lookup table to every channel (lighten and darken).
+*/
+struct ChannelLutFilter
+{
+    int table[256];
+
+    Pixel operator()(const Pixel& p) const
+    {
+        return Pixel{table[p.red], table[p.green], table[p.blue]};
+    }
+
+    /**
+        @returns true if the table maps every value to itself.
+    */
+    bool is_identity() const
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            if (table[value] != value)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+/**
+    Clarendon (process2): lighter pixels get lighter and darker pixels darker, judged
+    by their luma. Both adjustments are precomputed per channel value.
+*/
+template <int LightThreshold = 170, int DarkThreshold = 90, LumaWeights Weights = LumaWeights::Average>
+struct ClarendonFilter
+{
+    int lighter[256];
+    int darker[256];
+
+    explicit ClarendonFilter(double scaling_factor)
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            lighter[value] = min(255, static_cast<int>(255 - (255 - value) * scaling_factor));
+            darker[value] = max(0, static_cast<int>(value * scaling_factor));
+        }
+    }
+
+    Pixel operator()(const Pixel& p) const
+    {
+        return adjust(p, pixel_luma<Weights>(p));
+    }
+
+    void operator()(const Pixel* src, Pixel* dst, int count) const
+    {
+        for_each_luma_chunk<Weights>(src, count, [&](int first_col, int chunk_count, const unsigned char* luma)
+        {
+            for (int i = 0; i < chunk_count; i++)
+            {
+                dst[first_col + i] = adjust(src[first_col + i], luma[i]);
+            }
+        });
+    }
+
+    Pixel adjust(const Pixel& p, int luma) const
+    {
+        if (luma >= LightThreshold)
+        {
+            return Pixel{lighter[p.red], lighter[p.green], lighter[p.blue]};
+        }
+        if (luma < DarkThreshold)
+        {
+            return Pixel{darker[p.red], darker[p.green], darker[p.blue]};
+        }
+        return p;
+    }
+
+    /**
+        @returns true if neither adjustment changes any value (a scaling factor of 1).
+    */
+    bool is_identity() const
+    {
+        for (int value = 0; value < 256; value++)
+        {
+            if (lighter[value] != value || darker[value] != value)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+/**
+    Greyscale (process3): every channel becomes the pixel's luma.
+*/
+template <LumaWeights Weights = LumaWeights::Average>
+struct GreyscaleFilter
+{
+    Pixel operator()(const Pixel& p) const
+    {
+        int value = pixel_luma<Weights>(p);
+        return Pixel{value, value, value};
+    }
+
+    void operator()(const Pixel* src, Pixel* dst, int count) const
+    {
+        for_each_luma_chunk<Weights>(src, count, [&](int first_col, int chunk_count, const unsigned char* luma)
+        {
+            grey_row_to_rgb(luma, chunk_count, dst + first_col);
+        });
+    }
+};
+
+
+/**
+    High contrast (process7): pixels whose luma is at or above the threshold become
+    white, the rest black.
+*/
+template <int Threshold = 128, LumaWeights Weights = LumaWeights::Average>
+struct HighContrastFilter
+{
+    Pixel operator()(const Pixel& p) const
+    {
+        int value = (pixel_luma<Weights>(p) >= Threshold) ? 255 : 0;
+        return Pixel{value, value, value};
+    }
+
+    void operator()(const Pixel* src, Pixel* dst, int count) const
+    {
+        for_each_luma_chunk<Weights>(src, count, [&](int first_col, int chunk_count, unsigned char* luma)
+        {
+            threshold_luma_row(luma, chunk_count, Threshold);
+            grey_row_to_rgb(luma, chunk_count, dst + first_col);
+        });
+    }
+};
+
+
+/**
+    Black, white, red, green, blue (process10): each pixel becomes the closest of the five colors.
+*/
+template <int WhiteSum = 550, int BlackSum = 150>
+struct PrimaryColorsFilter
+{
+    Pixel operator()(const Pixel& p) const
+    {
+        int sum = p.red + p.green + p.blue;
+        int max_color = max(p.red, max(p.green, p.blue));
+        if (sum >= WhiteSum)
+        {
+            return Pixel{255, 255, 255};
+        }
+        if (sum <= BlackSum)
+        {
+            return Pixel{0, 0, 0};
+        }
+        if (max_color == p.red)
+        {
+            return Pixel{255, 0, 0};
+        }
+        if (max_color == p.green)
+        {
+            return Pixel{0, 255, 0};
+        }
+        return Pixel{0, 0, 255};
+    }
+};
+
+
+/**
+    Builds the lookup tables for the Clarendon effect (process2).
+*/
+template <LumaWeights Weights = LumaWeights::Average>
+ClarendonFilter<170, 90, Weights> make_clarendon_filter(double scaling_factor)
+{
+    return ClarendonFilter<170, 90, Weights>(scaling_factor);
+}
+
+
+/**
+    Builds the lookup table for lightening (process8).
+*/
+ChannelLutFilter make_lighten_filter(double scaling_factor)
+{
+    ChannelLutFilter filter;
+    for (int value = 0; value < 256; value++)
+    {
+        filter.table[value] = min(255, max(0, 255 - static_cast<int>(round((255 - value) * scaling_factor))));
+    }
+    return filter;
+}
+
+
+/**
+    Builds the lookup table for darkening (process9).
+*/
+ChannelLutFilter make_darken_filter(double scaling_factor)
+{
+    ChannelLutFilter filter;
+    for (int value = 0; value < 256; value++)
+    {
+        filter.table[value] = min(255, max(0, static_cast<int>(value * scaling_factor)));
+    }
+    return filter;
+}
+
+
+/**
+    Rotates an image clockwise by Turns x 90 degrees in a single pass, reading each
+    destination pixel straight from its source position.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @returns The rotated image.
+*/
+template <int Turns>
+vector<vector<Pixel>> rotate_image(const vector<vector<Pixel>>& image)
+{
+    static_assert(Turns >= 0 && Turns < 4, "Turns must be 0-3");
+    pair<int, int> dimensions = get_image_dimensions(image);
+    int num_rows = dimensions.first;
+    int num_columns = dimensions.second;
+
+    if constexpr (Turns == 0)
+    {
+        return image;
+    }
+    else
+    {
+        // Odd numbers of turns swap the dimensions
+        int new_rows = (Turns % 2 == 1) ? num_columns : num_rows;
+        int new_cols = (Turns % 2 == 1) ? num_rows : num_columns;
+        vector<vector<Pixel>> new_image = initialize_new_image(new_rows, new_cols);
+
+        parallel_for(new_rows, [&](int row)
+        {
+            Pixel* dst = new_image[row].data();
+            for (int col = 0; col < new_cols; col++)
+            {
+                if constexpr (Turns == 1)
+                {
+                    dst[col] = image[(num_rows - 1) - col][row];
+                }
+                else if constexpr (Turns == 2)
+                {
+                    dst[col] = image[(num_rows - 1) - row][(num_columns - 1) - col];
+                }
+                else
+                {
+                    dst[col] = image[col][(num_columns - 1) - row];
+                }
+            }
+        }, new_cols);
+        return new_image;
+    }
+}
+
+
+/**
+    Enlarges an image by repeating every pixel xscale times across and every row
+    yscale times down. Each enlarged row is built once and then copied. When XScale
+    and YScale are non-zero they fix the factors at compile time; 0 means the factor
+    is taken from the matching argument at run time.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param xscale: Scale factor for the width (used when XScale is 0).
+    @param yscale: Scale factor for the height (used when YScale is 0).
+    @returns The enlarged image.
+*/
+template <int XScale, int YScale>
+vector<vector<Pixel>> enlarge_image(const vector<vector<Pixel>>& image, int xscale = XScale, int yscale = YScale)
+{
+    const int x_factor = (XScale > 0) ? XScale : xscale;
+    const int y_factor = (YScale > 0) ? YScale : yscale;
+    pair<int, int> dimensions = get_image_dimensions(image);
+    int num_rows = dimensions.first;
+    int num_columns = dimensions.second;
+    vector<vector<Pixel>> new_image = initialize_new_image(y_factor * num_rows, x_factor * num_columns);
+
+    parallel_for(y_factor > 0 ? num_rows : 0, [&](int row)
+    {
+        const Pixel* src = image[row].data();
+        vector<Pixel>& first_copy = new_image[row * y_factor];
+        Pixel* dst = first_copy.data();
+        for (int col = 0; col < num_columns; col++)
+        {
+            for (int k = 0; k < x_factor; k++)
+            {
+                *dst++ = src[col];
+            }
+        }
+        for (int k = 1; k < y_factor; k++)
+        {
+            new_image[row * y_factor + k] = first_copy;
+        }
+    }, static_cast<size_t>(x_factor) * y_factor * num_columns);
+    return new_image;
+}
+
+
+//***************************************************************************************************//
+//                                     EFFECT CACHES                                                //
+//
+// Lookup tables and vignette masks depend only on an effect's parameters and the image
+// size, so they are kept between images. A batch of same-sized thumbnails, or a daemon
+// serving many jobs, then builds each table or mask once.
+
+// Number of lookup tables of each kind kept before the cache is emptied
+const size_t LUT_CACHE_ENTRIES = 64;
+
+// Bytes of vignette masks kept; masks of larger images are not cached
+const size_t VIGNETTE_CACHE_BYTES = 64 << 20;
+
+
+/**
+    Returns the lookup table filter built by Make for a scaling factor, building it
+    only the first time. Each Make function has its own cache.
+
+    @param scaling_factor: The effect's scaling factor.
+    @returns The shared filter.
+*/
+template <typename Filter, Filter (*Make)(double)>
+shared_ptr<const Filter> cached_lut_filter(double scaling_factor)
+{
+    static mutex cache_mutex;
+    static map<double, shared_ptr<const Filter>> cache;
+
+    lock_guard<mutex> lock(cache_mutex);
+    auto found = cache.find(scaling_factor);
+    if (found != cache.end())
+    {
+        return found->second;
+    }
+    if (cache.size() >= LUT_CACHE_ENTRIES)
+    {
+        cache.clear();  // Filters in use stay alive through their shared pointers
+    }
+    shared_ptr<const Filter> filter = make_shared<const Filter>(Make(scaling_factor));
+    cache[scaling_factor] = filter;
+    return filter;
+}
+
+
+/**
+    Returns the vignette scaling factor of every pixel of a num_rows x num_columns
+    image, in row-major order, computing it only the first time for each size.
+    Least recently used masks are dropped once VIGNETTE_CACHE_BYTES is exceeded.
+
+    @param num_rows: Height of the image.
+    @param num_columns: Width of the image.
+    @returns The shared mask, or null if the image is too large to cache.
+*/
+shared_ptr<const vector<double>> vignette_mask(int num_rows, int num_columns)
+{
+    struct CachedMask
+    {
+        int num_rows;
+        int num_columns;
+        unsigned long long last_used;
+        shared_ptr<const vector<double>> mask;
+    };
+    static mutex cache_mutex;
+    static vector<CachedMask> cache;
+    static unsigned long long clock = 0;
+
+    size_t num_pixels = static_cast<size_t>(num_rows) * num_columns;
+    if (num_pixels * sizeof(double) > VIGNETTE_CACHE_BYTES)
+    {
+        return nullptr;
+    }
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        for (CachedMask& entry : cache)
+        {
+            if (entry.num_rows == num_rows && entry.num_columns == num_columns)
+            {
+                entry.last_used = ++clock;
+                return entry.mask;
+            }
+        }
+    }
+
+    // Built outside the lock; two threads may both build a new size, which is harmless
+    shared_ptr<vector<double>> mask = make_shared<vector<double>>(num_pixels);
+    parallel_for(num_rows, [&](int row)
+    {
+        double* out = mask->data() + static_cast<size_t>(row) * num_columns;
+        for (int col = 0; col < num_columns; col++)
+        {
+            out[col] = calculate_vignette_scaling_factor(row, col, num_rows, num_columns);
+        }
+    }, num_columns);
+
+    lock_guard<mutex> lock(cache_mutex);
+    size_t cached_bytes = num_pixels * sizeof(double);
+    for (const CachedMask& entry : cache)
+    {
+        cached_bytes += entry.mask->size() * sizeof(double);
+    }
+    while (cached_bytes > VIGNETTE_CACHE_BYTES)
+    {
+        auto oldest = min_element(cache.begin(), cache.end(), [](const CachedMask& a, const CachedMask& b)
+        {
+            return a.last_used < b.last_used;
+        });
+        cached_bytes -= oldest->mask->size() * sizeof(double);
+        cache.erase(oldest);
+    }
+    cache.push_back(CachedMask{num_rows, num_columns, ++clock, mask});
+    return mask;
+}
+
+
+//***************************************************************************************************//
+//                                3D COLOR LOOKUP TABLES                                            //
+//
+// A 3D lookup table maps every color to a new one through a lattice of sample colors,
+// such as the 33x33x33 lattices of .cube color grades. Colors between lattice points are
+// interpolated, tetrahedrally by default (four lattice points per color) or trilinearly
+// (eight). The lattice keeps each point as four floats, so with SSE2 one point is one
+// register and a whole interpolation is a few multiply-adds. Any chain of color effects
+// can be baked into such a lattice.
+//
+// Effects that reduce the image to at most 256 colors (greyscale, high contrast, black/
+// white/red/green/blue) are quantizers: whatever runs before them, the result is one of
+// a few colors, so a run of color effects ending in one can be baked exactly into one
+// byte per 24-bit color, a 16 MB table that turns the whole run into a single lookup.
+
+// Largest lattice accepted from a .cube file
+const int MAX_CUBE_SIZE = 256;
+
+// Lattice size used when baking effects into a .cube file
+const int DEFAULT_CUBE_SIZE = 33;
+
+// Number of 24-bit colors, the size of an exact color table
+const size_t EXACT_TABLE_COLORS = size_t(1) << 24;
+
+
+/**
+    Interpolation between the lattice points of a 3D lookup table.
+*/
+enum class LutInterpolation
+{
+    Tetrahedral,
+    Trilinear
+};
+
+
+/**
+    A 3D lookup table: the output color at each point of a size x size x size lattice
+    spread evenly over the input domain of each channel.
+*/
+struct ColorLut3D
+{
+    int size = 0;
+    float domain_min[3] = {0.0f, 0.0f, 0.0f};  // Input range of red, green and blue, as in .cube files (0-1)
+    float domain_max[3] = {1.0f, 1.0f, 1.0f};
+    vector<float> nodes;  // Red, green, blue, 0 of each point (0-255); index ((red * size) + green) * size + blue
+};
+
+
+#if defined(__SSE2__)
+// A color being interpolated: red, green, blue and an unused lane
+using LutColor = __m128;
+
+inline LutColor lut_load(const float* node)
+{
+    return _mm_loadu_ps(node);
+}
+
+inline LutColor lut_scale(LutColor color, float weight)
+{
+    return _mm_mul_ps(color, _mm_set1_ps(weight));
+}
+
+inline LutColor lut_add(LutColor a, LutColor b)
+{
+    return _mm_add_ps(a, b);
+}
+
+inline LutColor lut_lerp(LutColor a, LutColor b, float weight)
+{
+    return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), _mm_set1_ps(weight)));
+}
+
+inline Pixel lut_to_pixel(LutColor color)
+{
+    color = _mm_min_ps(_mm_max_ps(color, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    alignas(16) int values[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(values), _mm_cvtps_epi32(color));
+    return Pixel{values[0], values[1], values[2]};
+}
+#else
+// A color being interpolated: red, green, blue and an unused lane
+struct LutColor
+{
+    float lanes[4];
+};
+
+inline LutColor lut_load(const float* node)
+{
+    return LutColor{{node[0], node[1], node[2], node[3]}};
+}
+
+inline LutColor lut_scale(LutColor color, float weight)
+{
+    return LutColor{{color.lanes[0] * weight, color.lanes[1] * weight, color.lanes[2] * weight, color.lanes[3] * weight}};
+}
+
+inline LutColor lut_add(LutColor a, LutColor b)
+{
+    return LutColor{{a.lanes[0] + b.lanes[0], a.lanes[1] + b.lanes[1], a.lanes[2] + b.lanes[2], a.lanes[3] + b.lanes[3]}};
+}
+
+inline LutColor lut_lerp(LutColor a, LutColor b, float weight)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        a.lanes[i] += (b.lanes[i] - a.lanes[i]) * weight;
+    }
+    return a;
+}
+
+inline Pixel lut_to_pixel(LutColor color)
+{
+    int values[3];
+    for (int i = 0; i < 3; i++)
+    {
+        values[i] = static_cast<int>(lrintf(min(max(color.lanes[i], 0.0f), 255.0f)));
+    }
+    return Pixel{values[0], values[1], values[2]};
+}
+#endif
+
+
+/**
+    Color grade (process15): looks every pixel up in a 3D lookup table. Where each
+    channel value falls in the lattice is worked out once per value, so a lookup is
+    three table reads and the interpolation itself.
+*/
+template <LutInterpolation Mode>
+struct Lut3DFilter
+{
+    shared_ptr<const ColorLut3D> lut;
+    size_t offset[3][256];  // Offset in lut->nodes of the lower lattice point, per channel and value
+    float weight[3][256];   // Position between that point and the next one along the axis
+    size_t step[3];         // Offset from a lattice point to the next one along each axis
+
+    explicit Lut3DFilter(shared_ptr<const ColorLut3D> table)
+        : lut(move(table))
+    {
+        size_t size = lut->size;
+        step[0] = 4 * size * size;
+        step[1] = 4 * size;
+        step[2] = 4;
+        for (int channel = 0; channel < 3; channel++)
+        {
+            float range = lut->domain_max[channel] - lut->domain_min[channel];
+            for (int value = 0; value < 256; value++)
+            {
+                float position = (value / 255.0f - lut->domain_min[channel]) / range * (size - 1);
+                position = min(max(position, 0.0f), static_cast<float>(size - 1));
+                int cell = min(static_cast<int>(position), static_cast<int>(size) - 2);
+                offset[channel][value] = cell * step[channel];
+                weight[channel][value] = position - cell;
+            }
+        }
+    }
+
+    Pixel operator()(const Pixel& p) const
+    {
+        const float* base = lut->nodes.data() + offset[0][p.red] + offset[1][p.green] + offset[2][p.blue];
+        float fr = weight[0][p.red];
+        float fg = weight[1][p.green];
+        float fb = weight[2][p.blue];
+        size_t sr = step[0];
+        size_t sg = step[1];
+        size_t sb = step[2];
+
+        if constexpr (Mode == LutInterpolation::Trilinear)
+        {
+            LutColor c00 = lut_lerp(lut_load(base), lut_load(base + sr), fr);
+            LutColor c01 = lut_lerp(lut_load(base + sb), lut_load(base + sr + sb), fr);
+            LutColor c10 = lut_lerp(lut_load(base + sg), lut_load(base + sr + sg), fr);
+            LutColor c11 = lut_lerp(lut_load(base + sg + sb), lut_load(base + sr + sg + sb), fr);
+            return lut_to_pixel(lut_lerp(lut_lerp(c00, c10, fg), lut_lerp(c01, c11, fg), fb));
+        }
+        else
+        {
+            // The unit cube splits into six tetrahedra along its main diagonal; the
+            // order of the three weights picks the one holding the color
+            size_t first;
+            size_t second;
+            float w0, w1, w2, w3;
+            if (fr > fg)
+            {
+                if (fg > fb)
+                {
+                    first = sr; second = sr + sg; w0 = 1 - fr; w1 = fr - fg; w2 = fg - fb; w3 = fb;
+                }
+                else if (fr > fb)
+                {
+                    first = sr; second = sr + sb; w0 = 1 - fr; w1 = fr - fb; w2 = fb - fg; w3 = fg;
+                }
+                else
+                {
+                    first = sb; second = sr + sb; w0 = 1 - fb; w1 = fb - fr; w2 = fr - fg; w3 = fg;
+                }
+            }
+            else
+            {
+                if (fb > fg)
+                {
+                    first = sb; second = sg + sb; w0 = 1 - fb; w1 = fb - fg; w2 = fg - fr; w3 = fr;
+                }
+                else if (fb > fr)
+                {
+                    first = sg; second = sg + sb; w0 = 1 - fg; w1 = fg - fb; w2 = fb - fr; w3 = fr;
+                }
+                else
+                {
+                    first = sg; second = sr + sg; w0 = 1 - fg; w1 = fg - fr; w2 = fr - fb; w3 = fb;
+                }
+            }
+            LutColor color = lut_add(lut_add(lut_scale(lut_load(base), w0), lut_scale(lut_load(base + first), w1)),
+                                     lut_add(lut_scale(lut_load(base + second), w2), lut_scale(lut_load(base + sr + sg + sb), w3)));
+            return lut_to_pixel(color);
+        }
+    }
+};
+
+
+/**
+    Reads a 3D lookup table from a .cube file (the Adobe/Resolve text format): keywords
+    such as LUT_3D_SIZE, DOMAIN_MIN and DOMAIN_MAX, then one "red green blue" line per
+    lattice point with red changing fastest. Output values are on a 0-1 scale.
+
+    @param filename: Name of the .cube file.
+    @param lut: Receives the table.
+    @returns true if the file holds a valid 3D table, false otherwise (1D tables are not supported).
+*/
+bool load_cube_file(const string& filename, ColorLut3D& lut)
+{
+    ifstream stream(filename);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+
+    ColorLut3D result;
+    vector<float> values;
+    string line;
+    while (getline(stream, line))
+    {
+        stringstream fields(line);
+        string keyword;
+        if (!(fields >> keyword) || keyword[0] == '#')
+        {
+            continue;
+        }
+
+        // Data lines start with a number; everything else is a keyword
+        stringstream data(line);
+        float red, green, blue;
+        if (data >> red)
+        {
+            if (!(data >> green >> blue))
+            {
+                return false;
+            }
+            values.insert(values.end(), {red, green, blue});
+            continue;
+        }
+        if (keyword == "LUT_3D_SIZE")
+        {
+            if (!(fields >> result.size) || result.size < 2 || result.size > MAX_CUBE_SIZE)
+            {
+                return false;
+            }
+        }
+        else if (keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX")
+        {
+            float* domain = (keyword == "DOMAIN_MIN") ? result.domain_min : result.domain_max;
+            if (!(fields >> domain[0] >> domain[1] >> domain[2]))
+            {
+                return false;
+            }
+        }
+        else if (keyword == "LUT_3D_INPUT_RANGE")
+        {
+            float low, high;
+            if (!(fields >> low >> high))
+            {
+                return false;
+            }
+            fill(result.domain_min, result.domain_min + 3, low);
+            fill(result.domain_max, result.domain_max + 3, high);
+        }
+        else if (keyword == "LUT_1D_SIZE")
+        {
+            return false;
+        }
+    }
+
+    size_t size = result.size;
+    if (size == 0 || values.size() != 3 * size * size * size)
+    {
+        return false;
+    }
+    for (int channel = 0; channel < 3; channel++)
+    {
+        if (!(result.domain_max[channel] > result.domain_min[channel]))
+        {
+            return false;
+        }
+    }
+
+    result.nodes.assign(4 * size * size * size, 0.0f);
+    for (size_t blue = 0; blue < size; blue++)
+    {
+        for (size_t green = 0; green < size; green++)
+        {
+            for (size_t red = 0; red < size; red++)
+            {
+                const float* source = values.data() + 3 * ((blue * size + green) * size + red);
+                float* node = result.nodes.data() + 4 * ((red * size + green) * size + blue);
+                for (int channel = 0; channel < 3; channel++)
+                {
+                    node[channel] = source[channel] * 255.0f;
+                }
+            }
+        }
+    }
+    lut = move(result);
+    return true;
+}
+
+
+/**
+    Writes a 3D lookup table as a .cube file.
+
+    @param filename: Name of the .cube file.
+    @param lut: The table.
+    @param title: Title recorded in the file.
+    @returns true if the file was written, false otherwise.
+*/
+bool save_cube_file(const string& filename, const ColorLut3D& lut, const string& title)
+{
+    ofstream stream(filename);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    size_t size = lut.size;
+    stream << "TITLE \"" << title << "\"" << endl;
+    stream << "LUT_3D_SIZE " << size << endl;
+    stream << "DOMAIN_MIN " << lut.domain_min[0] << " " << lut.domain_min[1] << " " << lut.domain_min[2] << endl;
+    stream << "DOMAIN_MAX " << lut.domain_max[0] << " " << lut.domain_max[1] << " " << lut.domain_max[2] << endl;
+    stream << fixed << setprecision(6);
+    for (size_t blue = 0; blue < size; blue++)
+    {
+        for (size_t green = 0; green < size; green++)
+        {
+            for (size_t red = 0; red < size; red++)
+            {
+                const float* node = lut.nodes.data() + 4 * ((red * size + green) * size + blue);
+                stream << node[0] / 255.0f << " " << node[1] / 255.0f << " " << node[2] / 255.0f << "\n";
+            }
+        }
+    }
+    return static_cast<bool>(stream);
+}
+
+
+/**
+    Returns the 3D lookup table in a .cube file, reading the file again only when it
+    has been modified since it was last read.
+
+    @param filename: Name of the .cube file.
+    @returns The shared table, or null if the file could not be read.
+*/
+shared_ptr<const ColorLut3D> cached_color_lut(const string& filename)
+{
+    struct CachedLut
+    {
+        filesystem::file_time_type modified;
+        shared_ptr<const ColorLut3D> lut;
+    };
+    static mutex cache_mutex;
+    static map<string, CachedLut> cache;
+
+    error_code error;
+    filesystem::file_time_type modified = filesystem::last_write_time(filename, error);
+    if (error)
+    {
+        return nullptr;
+    }
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto found = cache.find(filename);
+        if (found != cache.end() && found->second.modified == modified)
+        {
+            return found->second.lut;
+        }
+    }
+
+    shared_ptr<ColorLut3D> lut = make_shared<ColorLut3D>();
+    if (!load_cube_file(filename, *lut))
+    {
+        return nullptr;
+    }
+    lock_guard<mutex> lock(cache_mutex);
+    if (cache.size() >= LUT_CACHE_ENTRIES)
+    {
+        cache.clear();
+    }
+    cache[filename] = CachedLut{modified, lut};
+    return lut;
+}
+
+
+/**
+    Exact lookup table of a color transform with at most 256 distinct results: one
+    palette entry per 24-bit color.
+*/
+struct ExactColorTable
+{
+    vector<Pixel> palette;
+    vector<unsigned char> index;  // Palette entry of each color, at (red << 16) | (green << 8) | blue
+
+    Pixel operator()(const Pixel& p) const
+    {
+        return palette[index[(p.red << 16) | (p.green << 8) | p.blue]];
+    }
+};
+
+
+/**
+    Small open-addressing set of up to 256 packed colors, each with a palette index.
+*/
+struct PaletteSlots
+{
+    static const int NUM_SLOTS = 1024;
+    unsigned int keys[NUM_SLOTS] = {};    // Packed color + 1; 0 marks an empty slot
+    unsigned char values[NUM_SLOTS] = {};
+    int count = 0;
+
+    int find(unsigned int packed) const
+    {
+        unsigned int key = packed + 1;
+        int slot = (key * 2654435761u) >> 22;
+        while (keys[slot] != 0 && keys[slot] != key)
+        {
+            slot = (slot + 1) & (NUM_SLOTS - 1);
+        }
+        return slot;
+    }
+
+    void insert(unsigned int packed, unsigned char value)
+    {
+        int slot = find(packed);
+        if (keys[slot] == 0)
+        {
+            keys[slot] = packed + 1;
+            values[slot] = value;
+            count++;
+        }
+    }
+};
+
+
+/**
+    Bakes a color transform into an exact table by running it once over all 2^24
+    colors, one slice of 65536 colors (one red value) per task. Each slice is indexed
+    into its own palette first; the slice palettes are then merged and the indices
+    renumbered, which only touches bytes.
+
+    @param transform: Called as transform(pixels, count) to change a row of pixels in place.
+    @returns The table, or null if the transform gives more than 256 colors.
+*/
+template <typename RowTransform>
+shared_ptr<const ExactColorTable> bake_exact_color_table(const RowTransform& transform)
+{
+    const int SLICE_COLORS = 1 << 16;
+    auto pack = [](const Pixel& p)
+    {
+        return static_cast<unsigned int>((p.red << 16) | (p.green << 8) | p.blue);
+    };
+
+    shared_ptr<ExactColorTable> table = make_shared<ExactColorTable>();
+    table->index.resize(EXACT_TABLE_COLORS);
+    vector<vector<unsigned int>> slice_colors(256);
+    atomic<bool> too_many{false};
+    parallel_for(256, [&](int red)
+    {
+        vector<Pixel> slice(SLICE_COLORS);
+        for (int color = 0; color < SLICE_COLORS; color++)
+        {
+            slice[color] = Pixel{red, color >> 8, color & 0xFF};
+        }
+        transform(slice.data(), SLICE_COLORS);
+
+        PaletteSlots seen;
+        unsigned char* index = table->index.data() + (static_cast<size_t>(red) << 16);
+        for (int color = 0; color < SLICE_COLORS; color++)
+        {
+            unsigned int packed = pack(slice[color]);
+            int slot = seen.find(packed);
+            if (seen.keys[slot] == 0)
+            {
+                if (seen.count == 256 || too_many)
+                {
+                    too_many = true;
+                    return;
+                }
+                seen.insert(packed, static_cast<unsigned char>(seen.count));
+                slice_colors[red].push_back(packed);
+            }
+            index[color] = seen.values[slot];
+        }
+    }, SLICE_COLORS);
+    if (too_many)
+    {
+        return nullptr;
+    }
+
+    vector<unsigned int> colors;
+    for (const vector<unsigned int>& slice : slice_colors)
+    {
+        colors.insert(colors.end(), slice.begin(), slice.end());
+    }
+    sort(colors.begin(), colors.end());
+    colors.erase(unique(colors.begin(), colors.end()), colors.end());
+    if (colors.size() > 256)
+    {
+        return nullptr;
+    }
+    for (unsigned int packed : colors)
+    {
+        table->palette.push_back(Pixel{static_cast<int>(packed >> 16), static_cast<int>((packed >> 8) & 0xFF),
+                                       static_cast<int>(packed & 0xFF)});
+    }
+
+    parallel_for(256, [&](int red)
+    {
+        unsigned char renumber[256];
+        for (size_t i = 0; i < slice_colors[red].size(); i++)
+        {
+            renumber[i] = lower_bound(colors.begin(), colors.end(), slice_colors[red][i]) - colors.begin();
+        }
+        unsigned char* index = table->index.data() + (static_cast<size_t>(red) << 16);
+        for (int color = 0; color < SLICE_COLORS; color++)
+        {
+            index[color] = renumber[index[color]];
+        }
+    }, SLICE_COLORS / 8);
+    return table;
+}
+
+
+// PROCESS 15
+/**
+    Applies a color grade from a .cube 3D lookup table to every pixel.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param lut_file: Name of the .cube file.
+    @param trilinear: Interpolate trilinearly instead of tetrahedrally.
+    @returns The graded image, or the original image if the file could not be read.
+*/
+vector<vector<Pixel>> process15(const vector<vector<Pixel>>& image, const string& lut_file, bool trilinear)
+{
+    shared_ptr<const ColorLut3D> lut = cached_color_lut(lut_file);
+    if (!lut)
+    {
+        cerr << "Unable to read 3D LUT " << lut_file << ". Returning original image." << endl;
+        return image;
+    }
+    if (trilinear)
+    {
+        return apply_filter(image, Lut3DFilter<LutInterpolation::Trilinear>(lut));
+    }
+    return apply_filter(image, Lut3DFilter<LutInterpolation::Tetrahedral>(lut));
+}
+
+
+//***************************************************************************************************//
+//                              EDITING PROCESS FUNCTIONS                                           //
+
+// PROCESS 1
+/**
+    Applies the vignette effect to an image by enhancing its center 
+    and fading the edges to darken its corners.
+    This effect is achieved by adjusting each pixel's RGB values 
+    based on its distance from the center.
+
+    @param image: The original image as a 2D vector of Pixel structs.
+    @returns A modified image with the vignette effect applied.
+*/
+vector<vector<Pixel>> process1(const vector<vector<Pixel>>& image)
+{
+    // Get image dimensions
+    pair<int, int> dimensions = get_image_dimensions(image);
+
+    // Scale each pixel's RGB values by its distance from the center
+    shared_ptr<const vector<double>> mask = vignette_mask(dimensions.first, dimensions.second);
+    return apply_filter(image, VignetteFilter{dimensions.first, dimensions.second, mask ? mask->data() : nullptr});
+}
+ 
+    
+// PROCESS 2
+/**
+    The Clarendon effect boosts the contrast in an image.
+    Darker pixels become even darker, and lighter pixels become lighter, producing a vivid look.
+    This effect is realized by adjusting the RGB values of each pixel depending on its original intensity.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param scaling_factor: Multiplier to adjust the contrast intensity.
+    @param weights: How the intensity is worked out from the channels (the average by default).
+    @returns A modified image with the Clarendon effect.
+*/
+vector<vector<Pixel>> process2(const vector<vector<Pixel>>& image, double scaling_factor,
+                               LumaWeights weights = LumaWeights::Average)
+{    
+    // Lighter pixels (luma >= 170) get lighter, darker pixels (luma < 90) get darker
+    vector<vector<Pixel>> new_image;
+    visit_luma_weights(weights, [&](auto luma)
+    {
+        constexpr LumaWeights Weights = decltype(luma)::value;
+        new_image = apply_filter(image, *cached_lut_filter<ClarendonFilter<170, 90, Weights>, make_clarendon_filter<Weights>>(scaling_factor));
+    });
+    return new_image;  // Return the image with applied Clarendon effect
+}    
+
+    
+// PROCESS 3
+/**
+    Applies the Greyscale effect to an image by converting each pixel's RGB values 
+    into their average. This turns the image into shades of grey while maintaining 
+    the original intensity of each pixel.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param weights: The average, or the BT.601 or BT.709 perceptual weights.
+    @returns An image transformed into greyscale.
+*/
+vector<vector<Pixel>> process3(const vector<vector<Pixel>>& image, LumaWeights weights = LumaWeights::Average)
+{
+    vector<vector<Pixel>> new_image;
+    visit_luma_weights(weights, [&](auto luma)
+    {
+        new_image = apply_filter(image, GreyscaleFilter<decltype(luma)::value>());
+    });
+    return new_image;  // Return the image in greyscale
+}    
+
+    
+// PROCESS 4
+/**
+    Applies the Rotate-by-90 effect to an image by repositioning each pixel such that 
+    the image is rotated clockwise by 90 degrees. The RGB values of each pixel remain the same.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @returns An image that has been rotated 90 degrees clockwise.
+*/
+vector<vector<Pixel>> process4(const vector<vector<Pixel>>& image)
+{
+    // Columns become rows, and rows are inverted to become columns
+    return rotate_image<1>(image);  // Return the rotated image
+}
+
+    
+// PROCESS 5
+/**
+    Rotates an image by multiples of 90 degrees based on the user's input.
+    
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param number: An integer value corresponding to the number of 90-degree rotations desired.
+    @returns A modified image that has been rotated by the specified multiple of 90 degrees.
+*/
+vector<vector<Pixel>> process5(const vector<vector<Pixel>>& image, int number)
+{
+    switch(number % 4)  // As we are rotating in 90 degree increments, taking modulo 4 will give us the effective rotations
+    {
+        case 0:
+            // No rotation needed
+            return image;
+        case 1:
+            // 90-degree rotation
+            return rotate_image<1>(image);
+        case 2:
+            // 180-degree rotation, done in one pass
+            return rotate_image<2>(image);
+        case 3:
+            // 270-degree rotation, done in one pass
+            return rotate_image<3>(image);
+    }
+    // This part shouldn't execute
+    cout << "Unexpected rotation value. Returning original image." << endl;
+    return image;
+}
+
+    
+// PROCESS 6
+/**
+    Enlarges an image based on specified x and y scale factors. Pixels in the enlarged image 
+    are mapped back to their respective positions in the original image.
+
+    @param image: The original image, represented as a 2D vector of Pixel structs.
+    @param xscale: Scale factor for the width.
+    @param yscale: Scale factor for the height.
+    @returns An image enlarged by the given x and y scale factors.
+*/
+vector<vector<Pixel>> process6(const vector<vector<Pixel>>& image, int xscale, int yscale)
+{
+    // Common factors get loops specialized at compile time
+    if (xscale == yscale)
+    {
+        switch (xscale)
+        {
+            case 1: return enlarge_image<1, 1>(image);
+            case 2: return enlarge_image<2, 2>(image);
+            case 3: return enlarge_image<3, 3>(image);
+            case 4: return enlarge_image<4, 4>(image);
+        }
+    }
+    return enlarge_image<0, 0>(image, xscale, yscale);  // Return the enlarged image
+}
+
+
+// PROCESS 7
+/**
+    Converts an image to high-contrast black and white using a threshold based on pixel brightness. 
+    Pixels with a brightness above the threshold are turned white; those below are turned black.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param weights: How the brightness is worked out from the channels (the average by default).
+    @returns An image that has been modified for high-contrast black and white effect.
+*/
+vector<vector<Pixel>> process7(const vector<vector<Pixel>>& image, LumaWeights weights = LumaWeights::Average)
+{
+    // Half of 255 decides the threshold between white and black
+    vector<vector<Pixel>> new_image;
+    visit_luma_weights(weights, [&](auto luma)
+    {
+        new_image = apply_filter(image, HighContrastFilter<128, decltype(luma)::value>());
+    });
+    return new_image;  // Return the processed image
+}
+
+    
 // PROCESS 8
 /**
-    Adjusts an image's brightness by increasing pixel RGB values based on a scaling factor, 
-    ensuring that no values exceed the maximum permissible limit.
+    Adjusts an image's brightness by increasing pixel RGB values based on a scaling factor, 
+    ensuring that no values exceed the maximum permissible limit.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param scaling_factor: Multiplier to adjust the brightness.
+    @returns An image that has been modified to exhibit the lightening effect.
+*/
+vector<vector<Pixel>> process8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    // Every channel value maps through the same table, confined within the permissible range
+    return apply_filter(image, *cached_lut_filter<ChannelLutFilter, make_lighten_filter>(scaling_factor));  // Return the lightened image
+}
+
+
+// PROCESS 9
+/**
+    Applies a "Darkening" effect on an image by reducing its brightness using a scaling factor. 
+    This process ensures that RGB values never fall below the minimum limit.
+
+    @param image: Original image in the form of a 2D vector of Pixel structs.
+    @param scaling_factor: Factor to reduce brightness.
+    @returns Modified image with the darkening effect.
+*/
+vector<vector<Pixel>> process9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    // Every channel value maps through the same table, confined within the permissible range
+    return apply_filter(image, *cached_lut_filter<ChannelLutFilter, make_darken_filter>(scaling_factor));  // Return the darkened image
+}
+
+
+/**
+    Convert the image to emphasize only the colors: Black, White, Red, Blue, and Green.
+
+    @param the original image, in the form of a 2D vector of Pixel structs.
+    @returns a modified image that emphasizes the Black, White, Red, Blue, and Green colors.
+*/
+vector<vector<Pixel>> process10(const vector<vector<Pixel>>& image)
+{
+    // White and black by brightness, otherwise the dominant color
+    return apply_filter(image, PrimaryColorsFilter<550, 150>());
+}
+
+
+// PROCESS 16
+/**
+    Flips an image vertically, so the top row becomes the bottom row.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @returns The flipped image.
+*/
+vector<vector<Pixel>> process16(const vector<vector<Pixel>>& image)
+{
+    ViewTransform view(image.size(), image.empty() ? 0 : image[0].size());
+    view.flip_rows();
+    return materialize_view(image, view);
+}
+
+
+// PROCESS 17
+/**
+    Mirrors an image horizontally, so the left column becomes the right column.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @returns The mirrored image.
+*/
+vector<vector<Pixel>> process17(const vector<vector<Pixel>>& image)
+{
+    ViewTransform view(image.size(), image.empty() ? 0 : image[0].size());
+    view.flip_columns();
+    return materialize_view(image, view);
+}
+
+
+// PROCESS 18
+/**
+    Transposes an image: its rows become columns, flipping it over the diagonal from
+    the top left corner.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @returns The transposed image.
+*/
+vector<vector<Pixel>> process18(const vector<vector<Pixel>>& image)
+{
+    ViewTransform view(image.size(), image.empty() ? 0 : image[0].size());
+    view.transpose();
+    return materialize_view(image, view);
+}
+
+
+// PROCESS 19
+/**
+    Crops an image to a region, clipped to the image.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param region: The region to keep.
+    @returns The cropped image, or the original image if the region lies outside it.
+*/
+vector<vector<Pixel>> process19(const vector<vector<Pixel>>& image, const Region& region)
+{
+    ViewTransform view(image.size(), image.empty() ? 0 : image[0].size());
+    if (!view.crop(region))
+    {
+        cerr << "Crop region lies outside the image. Returning original image." << endl;
+        return image;
+    }
+    return materialize_view(image, view);
+}
+
+//***************************************************************************************************//
+//                                  CONVOLUTION ENGINE                                              //
+
+// Rows handed to a worker at a time by the horizontal passes
+const int CONVOLUTION_TILE_ROWS = 32;
+
+// Width of the column strips used by the vertical passes. A strip is narrow enough that
+// every row a kernel touches stays in cache while the strip is being filtered.
+const int CONVOLUTION_TILE_COLUMNS = 64;
+
+
+/**
+    Floating point copy of an image used by the convolution engine.
+    Each channel is kept in its own contiguous row-major array so the inner loops
+    run over plain float arrays, which the compiler turns into SIMD code.
+*/
+struct PlanarImage
+{
+    int num_rows;
+    int num_columns;
+    vector<float> channels[3];  // Red, green, blue
+};
+
+
+/**
+    Creates a planar image of the given size with every sample set to zero.
+
+    @param num_rows: Number of rows.
+    @param num_columns: Number of columns.
+    @returns The zeroed planar image.
+*/
+PlanarImage make_planar_image(int num_rows, int num_columns)
+{
+    PlanarImage planar;
+    planar.num_rows = num_rows;
+    planar.num_columns = num_columns;
+    for (vector<float>& channel : planar.channels)
+    {
+        channel.assign(static_cast<size_t>(num_rows) * num_columns, 0.0f);
+    }
+    return planar;
+}
+
+
+/**
+    Splits an image into its red, green and blue planes.
+
+    @param image: The image as a 2D vector of Pixel structs.
+    @returns The planar copy of the image.
+*/
+PlanarImage to_planar(const vector<vector<Pixel>>& image)
+{
+    pair<int, int> dimensions = get_image_dimensions(image);
+    PlanarImage planar = make_planar_image(dimensions.first, dimensions.second);
+
+    parallel_for(planar.num_rows, [&](int row)
+    {
+        size_t offset = static_cast<size_t>(row) * planar.num_columns;
+        for (int col = 0; col < planar.num_columns; col++)
+        {
+            planar.channels[0][offset + col] = image[row][col].red;
+            planar.channels[1][offset + col] = image[row][col].green;
+            planar.channels[2][offset + col] = image[row][col].blue;
+        }
+    }, planar.num_columns);
+    return planar;
+}
+
+
+/**
+    Rounds a filtered sample and confines it to the permissible 0-255 range.
+
+    @param value: The filtered sample.
+    @returns The sample as a valid color value.
+*/
+int clamp_channel(float value)
+{
+    return max(0, min(255, static_cast<int>(lround(value))));
+}
+
+
+/**
+    Joins red, green and blue planes back into an image.
+
+    @param planar: The planar image.
+    @returns The image as a 2D vector of Pixel structs.
+*/
+vector<vector<Pixel>> from_planar(const PlanarImage& planar)
+{
+    vector<vector<Pixel>> new_image = initialize_new_image(planar.num_rows, planar.num_columns);
+
+    parallel_for(planar.num_rows, [&](int row)
+    {
+        size_t offset = static_cast<size_t>(row) * planar.num_columns;
+        for (int col = 0; col < planar.num_columns; col++)
+        {
+            new_image[row][col].red = clamp_channel(planar.channels[0][offset + col]);
+            new_image[row][col].green = clamp_channel(planar.channels[1][offset + col]);
+            new_image[row][col].blue = clamp_channel(planar.channels[2][offset + col]);
+        }
+    }, planar.num_columns);
+    return new_image;
+}
+
+
+/**
+    Maps an index that may fall outside the image onto the nearest edge pixel,
+    so borders are handled by repeating the outermost row or column.
+
+    @param index: Row or column index, possibly out of range.
+    @param limit: Number of rows or columns in the image.
+    @returns An index between 0 and limit - 1.
+*/
+int clamp_index(int index, int limit)
+{
+    return max(0, min(limit - 1, index));
+}
+
+
+/**
+    Runs a function over every tile of a grid covering num_rows x num_columns,
+    spreading the tiles over all hardware threads.
+
+    @param num_rows: Number of rows to cover.
+    @param num_columns: Number of columns to cover.
+    @param tile_rows: Height of each tile.
+    @param tile_columns: Width of each tile.
+    @param body: Called with (first row, end row, first column, end column) of each tile.
+*/
+void for_each_tile(int num_rows, int num_columns, int tile_rows, int tile_columns,
+                   const function<void(int, int, int, int)>& body)
+{
+    int tiles_down = (num_rows + tile_rows - 1) / tile_rows;
+    int tiles_across = (num_columns + tile_columns - 1) / tile_columns;
+
+    parallel_for(tiles_down * tiles_across, [&](int tile)
+    {
+        int row_begin = (tile / tiles_across) * tile_rows;
+        int col_begin = (tile % tiles_across) * tile_columns;
+        body(row_begin, min(num_rows, row_begin + tile_rows),
+             col_begin, min(num_columns, col_begin + tile_columns));
+    }, static_cast<size_t>(tile_rows) * tile_columns);
+}
+
+
+/**
+    Copies a row into a buffer with radius extra samples on each side, repeating
+    the edge samples, so a kernel can be applied without any bounds checks.
+
+    @param row: Pointer to the first sample of the row.
+    @param length: Number of samples in the row.
+    @param radius: Number of border samples to add on each side.
+    @param padded: Buffer receiving length + 2 * radius samples.
+*/
+void pad_row(const float* row, int length, int radius, vector<float>& padded)
+{
+    padded.resize(length + 2 * radius);
+    for (int i = 0; i < length + 2 * radius; i++)
+    {
+        padded[i] = row[clamp_index(i - radius, length)];
+    }
+}
+
+
+/**
+    Box blurs every row of a planar image using a running sum, so the cost per
+    pixel stays the same whatever the radius.
+
+    @param source: The planar image to blur.
+    @param target: Planar image of the same size receiving the result.
+    @param radius: Number of pixels on each side included in the average.
+*/
+void box_blur_horizontal(const PlanarImage& source, PlanarImage& target, int radius)
+{
+    int num_columns = source.num_columns;
+    double inverse_width = 1.0 / (2 * radius + 1);
+
+    for_each_tile(source.num_rows, 1, CONVOLUTION_TILE_ROWS, 1, [&](int row_begin, int row_end, int, int)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            for (int row = row_begin; row < row_end; row++)
+            {
+                const float* in = &source.channels[c][static_cast<size_t>(row) * num_columns];
+                float* out = &target.channels[c][static_cast<size_t>(row) * num_columns];
+
+                // Sum of the window centred on column 0
+                double sum = 0.0;
+                for (int k = -radius; k <= radius; k++)
+                {
+                    sum += in[clamp_index(k, num_columns)];
+                }
+
+                // Slide the window: add the sample entering, drop the sample leaving
+                for (int col = 0; col < num_columns; col++)
+                {
+                    out[col] = static_cast<float>(sum * inverse_width);
+                    sum += in[clamp_index(col + radius + 1, num_columns)] - in[clamp_index(col - radius, num_columns)];
+                }
+            }
+        }
+    });
+}
+
+
+/**
+    Box blurs every column of a planar image using running sums. Columns are
+    processed in strips, one running sum per column, walking down the rows, so
+    memory is read row by row and the updates across a strip vectorize.
+
+    @param source: The planar image to blur.
+    @param target: Planar image of the same size receiving the result.
+    @param radius: Number of pixels above and below included in the average.
+*/
+void box_blur_vertical(const PlanarImage& source, PlanarImage& target, int radius)
+{
+    int num_rows = source.num_rows;
+    int num_columns = source.num_columns;
+    double inverse_height = 1.0 / (2 * radius + 1);
+
+    for_each_tile(1, num_columns, 1, CONVOLUTION_TILE_COLUMNS, [&](int, int, int col_begin, int col_end)
+    {
+        int strip_width = col_end - col_begin;
+        vector<double> sums(strip_width);  // Double, like the horizontal pass, so tall images do not drift
+
+        for (int c = 0; c < 3; c++)
+        {
+            const float* in = source.channels[c].data() + col_begin;
+            float* out = target.channels[c].data() + col_begin;
+
+            // Sums of the windows centred on row 0
+            fill(sums.begin(), sums.end(), 0.0);
+            for (int k = -radius; k <= radius; k++)
+            {
+                const float* src = in + static_cast<size_t>(clamp_index(k, num_rows)) * num_columns;
+                for (int j = 0; j < strip_width; j++)
+                {
+                    sums[j] += src[j];
+                }
+            }
+
+            // Slide the windows down the strip
+            for (int row = 0; row < num_rows; row++)
+            {
+                const float* entering = in + static_cast<size_t>(clamp_index(row + radius + 1, num_rows)) * num_columns;
+                const float* leaving = in + static_cast<size_t>(clamp_index(row - radius, num_rows)) * num_columns;
+                float* dst = out + static_cast<size_t>(row) * num_columns;
+                for (int j = 0; j < strip_width; j++)
+                {
+                    dst[j] = static_cast<float>(sums[j] * inverse_height);
+                    sums[j] += static_cast<double>(entering[j]) - leaving[j];
+                }
+            }
+        }
+    });
+}
+
+
+/**
+    Builds normalized one-dimensional Gaussian weights covering three standard deviations.
+
+    @param sigma: Standard deviation of the Gaussian in pixels.
+    @param radius: Receives the number of weights on each side of the centre.
+    @returns The 2 * radius + 1 weights, summing to 1.
+*/
+vector<float> gaussian_weights(double sigma, int& radius)
+{
+    radius = max(1, static_cast<int>(ceil(3.0 * sigma)));
+    vector<float> weights(2 * radius + 1);
+
+    double total = 0.0;
+    for (int k = -radius; k <= radius; k++)
+    {
+        double weight = exp(-(k * k) / (2.0 * sigma * sigma));
+        weights[k + radius] = static_cast<float>(weight);
+        total += weight;
+    }
+    for (float& weight : weights)
+    {
+        weight = static_cast<float>(weight / total);
+    }
+    return weights;
+}
+
+
+/**
+    Convolves every row of a planar image with a one-dimensional kernel.
+
+    @param source: The planar image to filter.
+    @param target: Planar image of the same size receiving the result.
+    @param weights: The 2 * radius + 1 kernel weights.
+*/
+void convolve_horizontal(const PlanarImage& source, PlanarImage& target, const vector<float>& weights)
+{
+    int num_columns = source.num_columns;
+    int radius = weights.size() / 2;
+
+    for_each_tile(source.num_rows, 1, CONVOLUTION_TILE_ROWS, 1, [&](int row_begin, int row_end, int, int)
+    {
+        vector<float> padded;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int row = row_begin; row < row_end; row++)
+            {
+                pad_row(&source.channels[c][static_cast<size_t>(row) * num_columns], num_columns, radius, padded);
+                float* out = &target.channels[c][static_cast<size_t>(row) * num_columns];
+
+                // One pass over the row per weight keeps the inner loop a plain multiply-add
+                fill(out, out + num_columns, 0.0f);
+                for (size_t k = 0; k < weights.size(); k++)
+                {
+                    const float* src = padded.data() + k;
+                    float weight = weights[k];
+                    for (int col = 0; col < num_columns; col++)
+                    {
+                        out[col] += weight * src[col];
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+/**
+    Convolves every column of a planar image with a one-dimensional kernel,
+    one tile at a time, by adding weighted copies of the neighbouring rows.
+
+    @param source: The planar image to filter.
+    @param target: Planar image of the same size receiving the result.
+    @param weights: The 2 * radius + 1 kernel weights.
+*/
+void convolve_vertical(const PlanarImage& source, PlanarImage& target, const vector<float>& weights)
+{
+    int num_rows = source.num_rows;
+    int num_columns = source.num_columns;
+    int radius = weights.size() / 2;
+
+    for_each_tile(num_rows, num_columns, CONVOLUTION_TILE_ROWS, CONVOLUTION_TILE_COLUMNS,
+                  [&](int row_begin, int row_end, int col_begin, int col_end)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            for (int row = row_begin; row < row_end; row++)
+            {
+                float* out = target.channels[c].data() + static_cast<size_t>(row) * num_columns;
+                fill(out + col_begin, out + col_end, 0.0f);
+                for (size_t k = 0; k < weights.size(); k++)
+                {
+                    int src_row = clamp_index(row - radius + static_cast<int>(k), num_rows);
+                    const float* src = source.channels[c].data() + static_cast<size_t>(src_row) * num_columns;
+                    float weight = weights[k];
+                    for (int col = col_begin; col < col_end; col++)
+                    {
+                        out[col] += weight * src[col];
+                    }
+                }
+            }
+        }
+    });
+}
+
+
+/**
+    Applies a separable Gaussian blur to a planar image.
+
+    @param planar: The planar image to blur.
+    @param sigma: Standard deviation of the blur in pixels.
+    @returns The blurred planar image.
+*/
+PlanarImage gaussian_blur_planar(const PlanarImage& planar, double sigma)
+{
+    int radius;
+    vector<float> weights = gaussian_weights(sigma, radius);
+
+    PlanarImage temp = make_planar_image(planar.num_rows, planar.num_columns);
+    PlanarImage blurred = make_planar_image(planar.num_rows, planar.num_columns);
+    convolve_horizontal(planar, temp, weights);
+    convolve_vertical(temp, blurred, weights);
+    return blurred;
+}
+
+
+/**
+    Convolves an image with a square (3x3 or 5x5) kernel that need not be separable.
+    Each kernel row is applied as a weighted sum over a padded source row.
+
+    @param planar: The planar image to filter.
+    @param kernel: size * size weights in row-major order.
+    @param size: Width and height of the kernel (3 or 5).
+    @returns The filtered planar image.
+*/
+PlanarImage convolve_kernel_planar(const PlanarImage& planar, const vector<float>& kernel, int size)
+{
+    int num_rows = planar.num_rows;
+    int num_columns = planar.num_columns;
+    int radius = size / 2;
+    PlanarImage filtered = make_planar_image(num_rows, num_columns);
+
+    for_each_tile(num_rows, 1, CONVOLUTION_TILE_ROWS, 1, [&](int row_begin, int row_end, int, int)
+    {
+        vector<float> padded;
+        for (int c = 0; c < 3; c++)
+        {
+            for (int row = row_begin; row < row_end; row++)
+            {
+                float* out = filtered.channels[c].data() + static_cast<size_t>(row) * num_columns;
+                for (int ky = 0; ky < size; ky++)
+                {
+                    int src_row = clamp_index(row - radius + ky, num_rows);
+                    pad_row(planar.channels[c].data() + static_cast<size_t>(src_row) * num_columns, num_columns, radius, padded);
+                    for (int kx = 0; kx < size; kx++)
+                    {
+                        const float* src = padded.data() + kx;
+                        float weight = kernel[ky * size + kx];
+                        for (int col = 0; col < num_columns; col++)
+                        {
+                            out[col] += weight * src[col];
+                        }
+                    }
+                }
+            }
+        }
+    });
+    return filtered;
+}
+
+
+/**
+    Box blurs a planar image in place with a horizontal and a vertical running sum pass.
+
+    @param planar: The planar image.
+    @param radius: Number of pixels on each side of the centre included in the average.
+*/
+void box_blur_planar(PlanarImage& planar, int radius)
+{
+    PlanarImage temp = make_planar_image(planar.num_rows, planar.num_columns);
+    box_blur_horizontal(planar, temp, radius);
+    box_blur_vertical(temp, planar, radius);
+}
+
+
+/**
+    Sharpens a planar image in place with an unsharp mask.
+
+    @param planar: The planar image.
+    @param sigma: Standard deviation of the blur used to find the edges.
+    @param amount: Strength of the sharpening.
+*/
+void unsharp_mask_planar(PlanarImage& planar, double sigma, double amount)
+{
+    PlanarImage blurred = gaussian_blur_planar(planar, sigma);
+    float strength = static_cast<float>(amount);
+
+    // sharpened = original + amount * (original - blurred)
+    for (int c = 0; c < 3; c++)
+    {
+        float* original = planar.channels[c].data();
+        const float* blur = blurred.channels[c].data();
+        size_t num_samples = planar.channels[c].size();
+        for (size_t i = 0; i < num_samples; i++)
+        {
+            original[i] += strength * (original[i] - blur[i]);
+        }
+    }
+}
+
+
+/**
+    Divides a kernel's weights by their sum, unless the sum is zero.
+
+    @param kernel: The weights in row-major order.
+    @returns The normalized weights.
+*/
+vector<float> normalize_kernel(const vector<double>& kernel)
+{
+    double total = 0.0;
+    for (double weight : kernel)
+    {
+        total += weight;
+    }
+    double divisor = (fabs(total) > 1e-9) ? total : 1.0;
+
+    vector<float> weights;
+    for (double weight : kernel)
+    {
+        weights.push_back(static_cast<float>(weight / divisor));
+    }
+    return weights;
+}
+
+
+// PROCESS 11
+/**
+    Applies a box blur, replacing each pixel with the average of the square of pixels
+    around it. The blur is done as a horizontal pass followed by a vertical pass, each
+    using a running sum, so larger radii cost no extra time per pixel.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param radius: Number of pixels on each side of the centre included in the average.
+    @returns The blurred image.
+*/
+vector<vector<Pixel>> process11(const vector<vector<Pixel>>& image, int radius)
+{
+    PlanarImage planar = to_planar(image);
+    box_blur_planar(planar, radius);
+    return from_planar(planar);  // Return the blurred image
+}
+
+
+// PROCESS 12
+/**
+    Applies a Gaussian blur, softening the image with weights that fall off smoothly
+    with distance from each pixel.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param sigma: Standard deviation of the blur in pixels.
+    @returns The blurred image.
+*/
+vector<vector<Pixel>> process12(const vector<vector<Pixel>>& image, double sigma)
+{
+    return from_planar(gaussian_blur_planar(to_planar(image), sigma));
+}
+
+
+// PROCESS 13
+/**
+    Sharpens an image with an unsharp mask: a Gaussian blurred copy is subtracted from
+    the original to find the edges, which are then added back scaled by the amount.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param sigma: Standard deviation of the blur used to find the edges.
+    @param amount: Strength of the sharpening (0.0 leaves the image unchanged).
+    @returns The sharpened image.
+*/
+vector<vector<Pixel>> process13(const vector<vector<Pixel>>& image, double sigma, double amount)
+{
+    PlanarImage planar = to_planar(image);
+    unsharp_mask_planar(planar, sigma, amount);
+    return from_planar(planar);  // Return the sharpened image
+}
+
+
+// PROCESS 14
+/**
+    Convolves an image with a user-supplied 3x3 or 5x5 kernel. The weights are
+    divided by their sum (when it is not zero) so the overall brightness is kept;
+    kernels summing to zero, such as edge detectors, are applied as given.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param kernel: 9 or 25 weights in row-major order.
+    @returns The filtered image.
+*/
+vector<vector<Pixel>> process14(const vector<vector<Pixel>>& image, const vector<double>& kernel)
+{
+    int size = (kernel.size() == 25) ? 5 : 3;
+    return from_planar(convolve_kernel_planar(to_planar(image), normalize_kernel(kernel), size));
+}
+
+
+//***************************************************************************************************//
+//                                    BATCH PIPELINE                                                //
+
+/**
+    One effect of a batch effect chain: the menu option together with the
+    parameters the interactive prompts would otherwise ask for.
+*/
+struct EffectStep
+{
+    int choice = 0;               // Menu option number (1-19)
+    double scaling_factor = 0.0;  // Processes 2, 8 and 9
+    int number = 0;               // Number of 90-degree rotations (process 5)
+    int xscale = 1;               // Width scale (process 6)
+    int yscale = 1;               // Height scale (process 6)
+    int radius = 1;               // Box blur radius (process 11)
+    double sigma = 1.0;           // Gaussian standard deviation (processes 12, 13)
+    double amount = 1.0;          // Sharpening strength (process 13)
+    vector<double> kernel;        // 3x3 or 5x5 weights (process 14)
+    string lut_file;              // .cube file (process 15)
+    bool trilinear = false;       // Trilinear instead of tetrahedral interpolation (process 15)
+    Region crop;                  // Region to keep (process 19)
+    LumaWeights luma = LumaWeights::Average;  // Brightness weighting (processes 2, 3 and 7)
+};
+
+
+/**
+    Parses one step of an effect chain. A step is the menu option number followed by
+    its parameters, all separated by ':', for example "2:0.5", "5:3", "6:2:3", "11:4",
+    "13:1.5:0.8", "14:0:-1:0:-1:5:-1:0:-1:0" or "19:x:y:width:height". Clarendon,
+    greyscale and high contrast may end with 601 or 709 to weight the brightness by
+    BT.601 or BT.709 instead of averaging: "2:0.5:709", "3:601" or "7:709". A color
+    grade names its .cube file, optionally followed by "trilinear": "15:film.cube" or
+    "15:film.cube:trilinear".
+
+    @param spec: The text of the step.
+    @param step: Receives the parsed step.
+    @returns true if the step is valid, false otherwise.
+*/
+bool parse_effect_step(const string& spec, EffectStep& step)
+{
+    vector<string> fields;
+    stringstream spec_stream(spec);
+    string field;
+    while (getline(spec_stream, field, ':'))
+    {
+        fields.push_back(field);
+    }
+    if (fields.empty())
+    {
+        return false;
+    }
+
+    // The color grade is the one step with a file name
+    if (fields[0] == "15")
+    {
+        step = EffectStep();
+        step.choice = 15;
+        if (fields.size() < 2 || fields.size() > 3 || (fields.size() == 3 && fields[2] != "trilinear"))
+        {
+            return false;
+        }
+        step.lut_file = fields[1];
+        step.trilinear = (fields.size() == 3);
+        return cached_color_lut(step.lut_file) != nullptr;
+    }
+
+    // Every field must be a number with nothing after it
+    vector<double> values;
+    for (const string& text : fields)
+    {
+        stringstream converter(text);
+        double value;
+        if (!(converter >> value) || !(converter >> ws).eof())
+        {
+            return false;
+        }
+        values.push_back(value);
+    }
+
+    step = EffectStep();
+    step.choice = static_cast<int>(values[0]);
+    if (step.choice != values[0])
+    {
+        return false;
+    }
+    size_t num_params = values.size() - 1;
+
+    // A trailing 601 or 709 picks the luma weights
+    if ((step.choice == 2 || step.choice == 3 || step.choice == 7) && num_params > 0 &&
+        (values.back() == 601 || values.back() == 709))
+    {
+        step.luma = (values.back() == 601) ? LumaWeights::Bt601 : LumaWeights::Bt709;
+        num_params--;
+    }
+
+    switch (step.choice)
+    {
+        case 1: case 3: case 4: case 7: case 10: case 16: case 17: case 18:
+            return num_params == 0;
+
+        case 2: case 8: case 9:
+            if (num_params != 1) { return false; }
+            step.scaling_factor = values[1];
+            return step.scaling_factor >= 0.0 && step.scaling_factor <= 1.0;
+
+        case 5:
+            if (num_params != 1) { return false; }
+            step.number = static_cast<int>(values[1]);
+            return step.number == values[1] && step.number >= 0;
+
+        case 6:
+            if (num_params != 2) { return false; }
+            step.xscale = static_cast<int>(values[1]);
+            step.yscale = static_cast<int>(values[2]);
+            return step.xscale == values[1] && step.yscale == values[2] && step.xscale > 0 && step.yscale > 0;
+
+        case 11:
+            if (num_params != 1) { return false; }
+            step.radius = static_cast<int>(values[1]);
+            return step.radius == values[1] && step.radius >= 1;
+
+        case 12:
+            if (num_params != 1) { return false; }
+            step.sigma = values[1];
+            return step.sigma > 0.0;
+
+        case 13:
+            if (num_params != 2) { return false; }
+            step.sigma = values[1];
+            step.amount = values[2];
+            return step.sigma > 0.0 && step.amount >= 0.0;
+
+        case 14:
+            if (num_params != 9 && num_params != 25) { return false; }
+            step.kernel.assign(values.begin() + 1, values.end());
+            return true;
+
+        case 19:
+            if (num_params != 4) { return false; }
+            step.crop.col = static_cast<int>(values[1]);
+            step.crop.row = static_cast<int>(values[2]);
+            step.crop.num_columns = static_cast<int>(values[3]);
+            step.crop.num_rows = static_cast<int>(values[4]);
+            return step.crop.col == values[1] && step.crop.row == values[2] && step.crop.num_columns == values[3] &&
+                   step.crop.num_rows == values[4] && step.crop.col >= 0 && step.crop.row >= 0 &&
+                   step.crop.num_columns > 0 && step.crop.num_rows > 0;
+    }
+    return false;
+}
+
+
+/**
+    Parses a comma separated effect chain such as "11:2,2:0.5,4".
+
+    @param spec: The text of the chain.
+    @param chain: Receives the parsed steps, in order.
+    @returns true if every step is valid, false otherwise.
+*/
+bool parse_effect_chain(const string& spec, vector<EffectStep>& chain)
+{
+    chain.clear();
+    stringstream spec_stream(spec);
+    string step_spec;
+    while (getline(spec_stream, step_spec, ','))
+    {
+        EffectStep step;
+        if (!parse_effect_step(step_spec, step))
+        {
+            cerr << "Error: Invalid effect step '" << step_spec << "'." << endl;
+            return false;
+        }
+        chain.push_back(step);
+    }
+    return !chain.empty();
+}
+
+
+/**
+    Calls a visitor with the filter functor of a point effect (1, 2, 3, 7, 8, 9, 10 or 15),
+    built for an image of the given size. Vignette masks and lookup tables come from
+    the effect caches.
+
+    @param step: The effect and its parameters.
+    @param num_rows: Height of the image the filter will run over.
+    @param num_columns: Width of the image the filter will run over.
+    @param visitor: Called once with the functor.
+    @returns true if the effect is a point effect, false if the visitor was not called.
+*/
+template <typename Visitor>
+bool visit_point_filter(const EffectStep& step, int num_rows, int num_columns, Visitor&& visitor)
+{
+    switch (step.choice)
+    {
+        case 1:
+        {
+            shared_ptr<const vector<double>> mask = vignette_mask(num_rows, num_columns);
+            visitor(VignetteFilter{num_rows, num_columns, mask ? mask->data() : nullptr});
+            return true;
+        }
+        case 2: case 3: case 7:
+            visit_luma_weights(step.luma, [&](auto luma)
+            {
+                constexpr LumaWeights Weights = decltype(luma)::value;
+                if (step.choice == 2)
+                {
+                    visitor(*cached_lut_filter<ClarendonFilter<170, 90, Weights>, make_clarendon_filter<Weights>>(step.scaling_factor));
+                }
+                else if (step.choice == 3)
+                {
+                    visitor(GreyscaleFilter<Weights>());
+                }
+                else
+                {
+                    visitor(HighContrastFilter<128, Weights>());
+                }
+            });
+            return true;
+        case 8:  visitor(*cached_lut_filter<ChannelLutFilter, make_lighten_filter>(step.scaling_factor)); return true;
+        case 9:  visitor(*cached_lut_filter<ChannelLutFilter, make_darken_filter>(step.scaling_factor)); return true;
+        case 10: visitor(PrimaryColorsFilter<550, 150>()); return true;
+        case 15:
+        {
+            shared_ptr<const ColorLut3D> lut = cached_color_lut(step.lut_file);
+            if (!lut)
+            {
+                return false;
+            }
+            if (step.trilinear)
+            {
+                visitor(Lut3DFilter<LutInterpolation::Trilinear>(lut));
+            }
+            else
+            {
+                visitor(Lut3DFilter<LutInterpolation::Tetrahedral>(lut));
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+    Whether an effect step leaves every image unchanged: a rotation by a multiple of
+    four turns, a 1x1 enlargement, Clarendon, lighten or darken with a scaling factor
+    that maps every value to itself, or an unsharp mask of amount 0.
+
+    @param step: The effect and its parameters.
+    @returns true if the step is a no-op.
+*/
+bool effect_is_identity(const EffectStep& step)
+{
+    switch (step.choice)
+    {
+        case 5:  return step.number % 4 == 0;
+        case 6:  return step.xscale == 1 && step.yscale == 1;
+        case 2:  return cached_lut_filter<ClarendonFilter<>, make_clarendon_filter<>>(step.scaling_factor)->is_identity();
+        case 8:  return cached_lut_filter<ChannelLutFilter, make_lighten_filter>(step.scaling_factor)->is_identity();
+        case 9:  return cached_lut_filter<ChannelLutFilter, make_darken_filter>(step.scaling_factor)->is_identity();
+        case 13: return step.amount == 0;
+    }
+    return false;
+}
+
+
+/**
+    Applies a single effect step to an image.
+
+    @param image: The original image represented as a 2D vector of Pixel structs.
+    @param step: The effect and its parameters.
+    @returns The modified image.
+*/
+vector<vector<Pixel>> apply_effect(const vector<vector<Pixel>>& image, const EffectStep& step)
+{
+    switch (step.choice)
+    {
+        case 1:  return process1(image);
+        case 2:  return process2(image, step.scaling_factor, step.luma);
+        case 3:  return process3(image, step.luma);
+        case 4:  return process4(image);
+        case 5:  return process5(image, step.number);
+        case 6:  return process6(image, step.xscale, step.yscale);
+        case 7:  return process7(image, step.luma);
+        case 8:  return process8(image, step.scaling_factor);
+        case 9:  return process9(image, step.scaling_factor);
+        case 10: return process10(image);
+        case 11: return process11(image, step.radius);
+        case 12: return process12(image, step.sigma);
+        case 13: return process13(image, step.sigma, step.amount);
+        case 14: return process14(image, step.kernel);
+        case 15: return process15(image, step.lut_file, step.trilinear);
+        case 16: return process16(image);
+        case 17: return process17(image);
+        case 18: return process18(image);
+        case 19: return process19(image, step.crop);
+    }
+    // This part shouldn't execute
+    cerr << "Unexpected effect option. Returning original image." << endl;
+    return image;
+}
+
+
+/**
+    Applies a rotation, flip, transpose or crop to a view transform.
+
+    @param view: The transform to change.
+    @param step: The effect and its parameters; is_view_effect() must hold for it.
+    @returns false, leaving the transform as it is, if a crop lies outside the view.
+*/
+bool apply_view_effect(ViewTransform& view, const EffectStep& step)
+{
+    switch (step.choice)
+    {
+        case 4:  view.rotate(1); break;
+        case 5:  view.rotate(step.number % 4); break;
+        case 16: view.flip_rows(); break;
+        case 17: view.flip_columns(); break;
+        case 18: view.transpose(); break;
+        case 19: return view.crop(step.crop);
+    }
+    return true;
+}
+
+
+/**
+    Enlarges an alpha plane the way process6() enlarges pixels.
+
+    @param alpha: The alpha plane.
+    @param xscale: Scale factor for the width.
+    @param yscale: Scale factor for the height.
+    @returns The enlarged alpha plane.
+*/
+AlphaPlane enlarge_alpha(const AlphaPlane& alpha, int xscale, int yscale)
+{
+    int new_rows = yscale * alpha.size();
+    int new_cols = xscale * alpha[0].size();
+    AlphaPlane new_alpha = initialize_alpha_plane(new_rows, new_cols);
+    for (int row = 0; row < new_rows; row++)
+    {
+        for (int col = 0; col < new_cols; col++)
+        {
+            new_alpha[row][col] = alpha[row / yscale][col / xscale];
+        }
+    }
+    return new_alpha;
+}
+
+
+/**
+    Carries an image's alpha plane through an effect step. Rotations, flips, the
+    transpose, crops and enlarging move the alpha values along with their pixels; all
+    other effects change only color and leave the alpha plane as it is.
+
+    @param alpha: The alpha plane of the original image (empty for an opaque image).
+    @param step: The effect and its parameters.
+    @returns The alpha plane of the modified image.
+*/
+AlphaPlane apply_effect_alpha(const AlphaPlane& alpha, const EffectStep& step)
+{
+    if (alpha.empty())
+    {
+        return alpha;
+    }
+
+    if (is_view_effect(step.choice))
+    {
+        ViewTransform view(alpha.size(), alpha[0].size());
+        return apply_view_effect(view, step) ? materialize_view(alpha, view) : alpha;
+    }
+    if (step.choice == 6)
+    {
+        return enlarge_alpha(alpha, step.xscale, step.yscale);
+    }
+    return alpha;
+}
+
+
+/**
+    Applies a single effect step to an image handle. A step that changes nothing
+    returns the handle itself, so the result shares the original's pixels. A point
+    effect runs in place when the handle is the only user of its pixels, and the
+    alpha plane is only copied by the effects that move it.
+
+    @param image: The original image.
+    @param step: The effect and its parameters.
+    @returns The modified image.
+*/
+ImageHandle apply_effect(ImageHandle image, const EffectStep& step)
+{
+    if (image.empty() || effect_is_identity(step))
+    {
+        return image;
+    }
+
+    pair<int, int> dimensions = get_image_dimensions(image.pixels());
+    ImageHandle result;
+    bool point_effect = visit_point_filter(step, dimensions.first, dimensions.second, [&](const auto& filter)
+    {
+        if (image.owns_pixels())
+        {
+            apply_filter_in_place(image.mutable_pixels(), filter);
+            result = move(image);
+        }
+        else
+        {
+            result = image.with_pixels(apply_filter(image.pixels(), filter));
+        }
+    });
+    if (point_effect)
+    {
+        return result;
+    }
+
+    // Moving pixels around is one pass through a view, alpha plane included
+    if (is_view_effect(step.choice))
+    {
+        ImageView view(move(image));
+        if (!apply_view_effect(view.transform, step))
+        {
+            cerr << "Crop region lies outside the image. Returning original image." << endl;
+        }
+        return release_view(view);
+    }
+
+    vector<vector<Pixel>> pixels = apply_effect(image.pixels(), step);
+    if (step.choice == 6)
+    {
+        return ImageHandle(move(pixels), apply_effect_alpha(image.alpha(), step));
+    }
+    return image.with_pixels(move(pixels));
+}
+
+
+//***************************************************************************************************//
+//                                     EFFECT GRAPH                                                 //
+//
+// An effect chain is first collected into a graph of effect nodes without running
+// anything. Before the graph is evaluated, an optimizer rewrites it into an equivalent
+// graph with fewer or cheaper passes; every rewrite gives exactly the same pixels:
+//     - steps that change nothing are dropped,
+//     - neighbouring rotations become one rotation by their sum mod 4,
+//     - neighbouring enlargements become one enlargement by the product of their scales,
+//     - neighbouring lighten and darken steps become one per-channel lookup table,
+//     - a greyscale step right after another one is dropped,
+//     - color effects that look at nothing but the pixel itself (all point effects but
+//       the vignette) move ahead of enlargements, and so do rotations, flips and
+//       transposes, so they run over fewer pixels; crops move ahead of color effects.
+// Rotations, flips, transposes and crops never run on their own: they only change the
+// view the image is seen through (see IMAGE VIEWS). Runs of such color effects are then
+// evaluated in a single pass that reads the image through the view, and a view still
+// left at the end goes to the writer as it is. A color run with a color grade that ends
+// in a quantizing effect is baked into an exact color table once the graph has run it
+// over as many pixels as the table has colors, after which the whole run is one lookup
+// per pixel. Runs of the other color effects are already table lookups and branches as
+// cheap as the exact table's scattered reads. Chains are linear, so the graph is kept as
+// a list of nodes.
+
+// Pixels a quantizing color run must have been evaluated over before it is baked
+const size_t EXACT_TABLE_MIN_PIXELS = EXACT_TABLE_COLORS;
+
+
+/**
+    One node of an effect graph.
+*/
+struct EffectNode
+{
+    EffectStep step;
+    shared_ptr<const ChannelLutFilter> lut;  // When set, the node is this per-channel table instead of step
+};
+
+
+/**
+    Whether a node only looks at the pixel it is changing, so it can be moved across
+    enlargements and crops: Clarendon, greyscale, high contrast, lighten, darken,
+    primary colors, color grades and lookup-table nodes.
+*/
+bool is_pure_color_node(const EffectNode& node)
+{
+    if (node.lut)
+    {
+        return true;
+    }
+    switch (node.step.choice)
+    {
+        case 2: case 3: case 7: case 8: case 9: case 10: case 15:
+            return true;
+    }
+    return false;
+}
+
+
+/**
+    The per-channel table of a lighten, darken or lookup-table node, or null for any other node.
+*/
+shared_ptr<const ChannelLutFilter> node_channel_lut(const EffectNode& node)
+{
+    if (node.lut)
+    {
+        return node.lut;
+    }
+    switch (node.step.choice)
+    {
+        case 8:  return cached_lut_filter<ChannelLutFilter, make_lighten_filter>(node.step.scaling_factor);
+        case 9:  return cached_lut_filter<ChannelLutFilter, make_darken_filter>(node.step.scaling_factor);
+    }
+    return nullptr;
+}
+
+
+/**
+    A deferred effect chain. Steps are only recorded when they are added; optimize()
+    simplifies the graph and evaluate() runs it on an image.
+*/
+class EffectGraph
+{
+public:
+    EffectGraph() = default;
+
+    explicit EffectGraph(const vector<EffectStep>& chain)
+    {
+        for (const EffectStep& step : chain)
+        {
+            add(step);
+        }
+    }
+
+    /**
+        Appends an effect step to the graph without running it.
+    */
+    void add(const EffectStep& step)
+    {
+        graph_nodes.push_back(EffectNode{step, nullptr});
+        exact_tables = make_shared<ExactRunTables>();
+    }
+
+    const vector<EffectNode>& nodes() const
+    {
+        return graph_nodes;
+    }
+
+    /**
+        Rewrites the graph into an equivalent one with fewer or cheaper passes.
+    */
+    void optimize()
+    {
+        vector<EffectNode> input;
+        input.swap(graph_nodes);
+        for (EffectNode& node : input)
+        {
+            if (node.step.choice == 4)
+            {
+                node.step.choice = 5;  // Rotations are all counted in quarter turns
+                node.step.number = 1;
+            }
+            if (!effect_is_identity(node.step))
+            {
+                push_optimized(move(node));
+            }
+        }
+        exact_tables = make_shared<ExactRunTables>();
+    }
+
+    /**
+        Runs the graph on an image, leaving rotations, flips, transposes and crops at
+        the end of the graph as a view of the result. Neighbouring pure color nodes run
+        together in one pass, reading the image through the view built so far.
+
+        @param image: The original image.
+        @returns A view of the modified image.
+    */
+    ImageView evaluate_view(ImageHandle image) const
+    {
+        ImageView view(move(image));
+        size_t index = 0;
+        while (index < graph_nodes.size() && !view.empty())
+        {
+            const EffectNode& node = graph_nodes[index];
+            if (!node.lut && is_view_effect(node.step.choice))
+            {
+                if (!apply_view_effect(view.transform, node.step))
+                {
+                    cerr << "Crop region lies outside the image. Returning original image." << endl;
+                }
+                index++;
+                continue;
+            }
+
+            size_t end = index;
+            while (end < graph_nodes.size() && is_pure_color_node(graph_nodes[end]))
+            {
+                end++;
+            }
+            if (end - index > 1 || (end > index && (node.lut || !view.is_whole())))
+            {
+                view = ImageView(apply_color_nodes(view, index, end));
+                index = end;
+            }
+            else
+            {
+                view = ImageView(apply_effect(release_view(view), node.step));
+                index++;
+            }
+        }
+        return view;
+    }
+
+    /**
+        Runs the graph on an image (see evaluate_view()).
+
+        @param image: The original image.
+        @returns The modified image.
+    */
+    ImageHandle evaluate(ImageHandle image) const
+    {
+        ImageView view = evaluate_view(move(image));
+        return release_view(view);
+    }
+
+private:
+    /**
+        Exact table of one quantizing color run, and how many pixels the run has been
+        evaluated over while there was none.
+    */
+    struct ExactRunTable
+    {
+        size_t pixels_seen = 0;
+        bool baking = false;
+        shared_ptr<const ExactColorTable> table;
+    };
+
+    struct ExactRunTables
+    {
+        mutex tables_mutex;
+        map<size_t, ExactRunTable> runs;  // Keyed by the run's first node
+    };
+
+    vector<EffectNode> graph_nodes;
+    shared_ptr<ExactRunTables> exact_tables = make_shared<ExactRunTables>();
+
+    /**
+        Appends a node to the optimized graph, merging it into the nodes before it or
+        moving it ahead of them where that gives the same result.
+    */
+    void push_optimized(EffectNode node)
+    {
+        if (graph_nodes.empty())
+        {
+            graph_nodes.push_back(move(node));
+            return;
+        }
+
+        EffectNode& last = graph_nodes.back();
+        int last_choice = last.lut ? 0 : last.step.choice;
+        int choice = node.lut ? 0 : node.step.choice;
+
+        if (last_choice == 5 && choice == 5)
+        {
+            last.step.number = (last.step.number + node.step.number) % 4;
+            if (last.step.number == 0)
+            {
+                graph_nodes.pop_back();
+            }
+            return;
+        }
+        if (last_choice == 6 && choice == 6)
+        {
+            last.step.xscale *= node.step.xscale;
+            last.step.yscale *= node.step.yscale;
+            return;
+        }
+        shared_ptr<const ChannelLutFilter> first_lut = node_channel_lut(last);
+        shared_ptr<const ChannelLutFilter> second_lut = first_lut ? node_channel_lut(node) : nullptr;
+        if (first_lut && second_lut)
+        {
+            shared_ptr<ChannelLutFilter> combined = make_shared<ChannelLutFilter>();
+            for (int value = 0; value < 256; value++)
+            {
+                combined->table[value] = second_lut->table[first_lut->table[value]];
+            }
+            if (combined->is_identity())
+            {
+                graph_nodes.pop_back();
+            }
+            else
+            {
+                last.lut = move(combined);
+            }
+            return;
+        }
+        if (last_choice == 3 && choice == 3)
+        {
+            return;  // Greyscale pixels are already their own luma, whatever the weights
+        }
+
+        // Color effects and pixel moves go before enlargements, and crops before color effects
+        bool moves_pixels = (choice == 5 || choice == 16 || choice == 17 || choice == 18);
+        if ((last_choice == 6 && (is_pure_color_node(node) || moves_pixels)) ||
+            (choice == 19 && is_pure_color_node(last)))
+        {
+            EffectNode moved = move(last);
+            graph_nodes.pop_back();
+            if ((choice == 5 && node.step.number % 2 == 1) || choice == 18)
+            {
+                swap(moved.step.xscale, moved.step.yscale);
+            }
+            push_optimized(move(node));
+            push_optimized(move(moved));
+            return;
+        }
+        graph_nodes.push_back(move(node));
+    }
+
+    /**
+        Runs the pure color nodes [begin, end) over a view of an image in a single
+        pass, one row at a time, giving a new image unless the view shows all of its
+        image unchanged.
+    */
+    ImageHandle apply_color_nodes(ImageView& view, size_t begin, size_t end) const
+    {
+        pair<int, int> dimensions(view.transform.num_rows, view.transform.num_columns);
+        int num_columns = dimensions.second;
+
+        // Each filter is copied into its row pass, so cache eviction cannot free it mid-run
+        vector<function<void(Pixel*, int)>> row_passes;
+        for (size_t index = begin; index < end; index++)
+        {
+            const EffectNode& node = graph_nodes[index];
+            if (node.lut)
+            {
+                shared_ptr<const ChannelLutFilter> lut = node.lut;
+                row_passes.push_back([lut](Pixel* pixels, int count)
+                {
+                    for (int col = 0; col < count; col++)
+                    {
+                        pixels[col] = (*lut)(pixels[col]);
+                    }
+                });
+                continue;
+            }
+            visit_point_filter(node.step, dimensions.first, num_columns, [&](const auto& filter)
+            {
+                if constexpr (is_invocable_v<decltype(filter), const Pixel*, Pixel*, int>)
+                {
+                    row_passes.push_back([filter](Pixel* pixels, int count)
+                    {
+                        filter(pixels, pixels, count);
+                    });
+                }
+                else if constexpr (is_invocable_v<decltype(filter), const Pixel&>)
+                {
+                    row_passes.push_back([filter](Pixel* pixels, int count)
+                    {
+                        for (int col = 0; col < count; col++)
+                        {
+                            pixels[col] = filter(pixels[col]);
+                        }
+                    });
+                }
+            });
+        }
+
+        size_t num_pixels = static_cast<size_t>(dimensions.first) * num_columns;
+        shared_ptr<const ExactColorTable> exact = exact_run_table(begin, end, row_passes, num_pixels);
+        if (exact)
+        {
+            row_passes.assign(1, [exact](Pixel* pixels, int count)
+            {
+                for (int col = 0; col < count; col++)
+                {
+                    pixels[col] = (*exact)(pixels[col]);
+                }
+            });
+        }
+
+        return release_view(view, [&row_passes](Pixel* pixels, int count)
+        {
+            for (const function<void(Pixel*, int)>& row_pass : row_passes)
+            {
+                row_pass(pixels, count);
+            }
+        });
+    }
+
+    /**
+        The exact table of the color run [begin, end), baked from its row passes when
+        the run has a color grade, ends in a quantizing effect (greyscale, high contrast
+        or black/white/red/green/blue) and has now been evaluated over enough pixels to
+        pay for it.
+
+        @returns The table, or null while the run is evaluated pass by pass.
+    */
+    shared_ptr<const ExactColorTable> exact_run_table(size_t begin, size_t end,
+                                                      const vector<function<void(Pixel*, int)>>& row_passes,
+                                                      size_t num_pixels) const
+    {
+        const EffectNode& last = graph_nodes[end - 1];
+        bool quantizing = !last.lut && (last.step.choice == 3 || last.step.choice == 7 || last.step.choice == 10);
+        bool graded = any_of(graph_nodes.begin() + begin, graph_nodes.begin() + end, [](const EffectNode& node)
+        {
+            return !node.lut && node.step.choice == 15;
+        });
+        if (!quantizing || !graded || row_passes.size() != end - begin)
+        {
+            return nullptr;
+        }
+
+        shared_ptr<ExactRunTables> tables = exact_tables;
+        {
+            lock_guard<mutex> lock(tables->tables_mutex);
+            ExactRunTable& run = tables->runs[begin];
+            if (run.table || run.baking)
+            {
+                return run.table;  // Still null while another image is baking it
+            }
+            run.pixels_seen += num_pixels;
+            if (run.pixels_seen < EXACT_TABLE_MIN_PIXELS)
+            {
+                return nullptr;
+            }
+            run.baking = true;
+        }
+
+        shared_ptr<const ExactColorTable> table = bake_exact_color_table([&](Pixel* pixels, int count)
+        {
+            for (const function<void(Pixel*, int)>& row_pass : row_passes)
+            {
+                row_pass(pixels, count);
+            }
+        });
+        lock_guard<mutex> lock(tables->tables_mutex);
+        tables->runs[begin].table = table;
+        return table;
+    }
+};
+
+
+//***************************************************************************************************//
+//                                     RESULT CACHE                                                 //
+//
+// Finished images are kept on disk as .nyk files named by a 64-bit hash of the input
+// pixels together with the effect chain, so a repeated request is answered by decoding
+// the stored result instead of running the effects. The hash is FNV-1a style, taken a
+// word at a time over each row (rows in parallel) and then over the row hashes. The
+// least recently used entries are deleted once the cache grows past its size limit.
+
+const unsigned long long FNV_OFFSET_BASIS = 14695981039346656037ULL;
+const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+// Bumped whenever an effect's output changes, so stale results are never returned
+const string RESULT_CACHE_VERSION = "nyarko-result-1";
+
+// Default size limit of the result cache, in megabytes
+const unsigned long long DEFAULT_CACHE_MEGABYTES = 1024;
+
+
+/**
+    Hashes a block of memory, eight bytes at a time with a final pass over the rest.
+
+    @param data: The bytes to hash.
+    @param size: Number of bytes.
+    @param hash: Hash of the data before this block, for hashing several blocks in turn.
+    @returns The updated hash.
+*/
+unsigned long long hash_bytes(const void* data, size_t size, unsigned long long hash = FNV_OFFSET_BASIS)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * FNV_PRIME;
+        hash ^= hash >> 32;  // Let the high bits of each word reach the low bits
+    }
+    for (; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+
+/**
+    Describes an effect step by its menu option and only the parameters that option
+    uses, with doubles written exactly, so equal requests always give equal text.
+*/
+string effect_step_key(const EffectStep& step)
+{
+    stringstream key;
+    key << hexfloat << step.choice;
+    switch (step.choice)
+    {
+        case 2: case 8: case 9: key << ":" << step.scaling_factor; break;
+        case 5:  key << ":" << step.number % 4; break;
+        case 6:  key << ":" << step.xscale << ":" << step.yscale; break;
+        case 11: key << ":" << step.radius; break;
+        case 12: key << ":" << step.sigma; break;
+        case 13: key << ":" << step.sigma << ":" << step.amount; break;
+        case 19: key << ":" << step.crop.col << ":" << step.crop.row << ":" << step.crop.num_columns << ":" << step.crop.num_rows; break;
+        case 14:
+            for (double weight : step.kernel)
+            {
+                key << ":" << weight;
+            }
+            break;
+        case 15:
+        {
+            // By the table's contents, so an edited .cube file is never served from the cache
+            shared_ptr<const ColorLut3D> lut = cached_color_lut(step.lut_file);
+            unsigned long long hash = lut ? hash_bytes(lut->nodes.data(), lut->nodes.size() * sizeof(float)) : 0;
+            if (lut)
+            {
+                hash = hash_bytes(lut->domain_min, sizeof(lut->domain_min), hash);
+                hash = hash_bytes(lut->domain_max, sizeof(lut->domain_max), hash);
+            }
+            key << ":" << hash << (step.trilinear ? ":t" : "");
+            break;
+        }
+    }
+    if ((step.choice == 2 || step.choice == 3 || step.choice == 7) && step.luma != LumaWeights::Average)
+    {
+        // Only the perceptual weights are written, so the keys of averaging steps stay as they were
+        key << ":" << ((step.luma == LumaWeights::Bt601) ? "601" : "709");
+    }
+    return key.str();
+}
+
+
+/**
+    Computes the result cache key of applying an effect chain to an image.
+
+    @param image: The input image.
+    @param alpha: The input alpha plane (empty if opaque).
+    @param chain: The effects, in order.
+    @returns The 64-bit key.
+*/
+unsigned long long result_cache_key(const vector<vector<Pixel>>& image, const AlphaPlane& alpha,
+                                    const vector<EffectStep>& chain)
+{
+    int num_rows = image.size();
+    vector<unsigned long long> row_hashes(num_rows * 2, FNV_OFFSET_BASIS);
+    parallel_for(num_rows, [&](int row)
+    {
+        row_hashes[row] = hash_bytes(image[row].data(), image[row].size() * sizeof(Pixel));
+        if (!alpha.empty())
+        {
+            row_hashes[num_rows + row] = hash_bytes(alpha[row].data(), alpha[row].size());
+        }
+    }, image.empty() ? 0 : image[0].size());
+
+    string description = RESULT_CACHE_VERSION + " " + to_string(num_rows) + "x" +
+                         to_string(image.empty() ? 0 : image[0].size());
+    for (const EffectStep& step : chain)
+    {
+        description += "," + effect_step_key(step);
+    }
+    unsigned long long hash = hash_bytes(description.data(), description.size());
+    return hash_bytes(row_hashes.data(), row_hashes.size() * sizeof(unsigned long long), hash);
+}
+
+
+/**
+    On-disk cache of effect results, shared safely by the threads of one process.
+    Several processes may also use the same directory: entries are written under a
+    temporary name and renamed into place, and an entry that has gone missing counts
+    as a miss.
+*/
+class ResultCache
+{
+public:
+    /**
+        @param directory: Directory holding the entries; created if needed.
+        @param max_bytes: Size the entries are kept under.
+    */
+    ResultCache(const string& directory, unsigned long long max_bytes) : directory(directory), max_bytes(max_bytes)
+    {
+        error_code error;
+        filesystem::create_directories(directory, error);
+
+        // Existing entries are used oldest first, by modification time
+        vector<tuple<filesystem::file_time_type, unsigned long long, unsigned long long>> found;
+        for (filesystem::directory_iterator it(directory, error), end; !error && it != end; it.increment(error))
+        {
+            string stem = it->path().stem().string();
+            if (it->path().extension() != NYK_EXTENSION || stem.size() != 16 ||
+                stem.find_first_not_of("0123456789abcdef") != string::npos)
+            {
+                continue;
+            }
+            error_code entry_error;
+            unsigned long long size = it->file_size(entry_error);
+            filesystem::file_time_type modified = it->last_write_time(entry_error);
+            if (!entry_error)
+            {
+                found.emplace_back(modified, stoull(stem, nullptr, 16), size);
+            }
+        }
+        sort(found.begin(), found.end());
+        for (const auto& [modified, key, size] : found)
+        {
+            entries[key] = CacheEntry{size, ++clock};
+            total_bytes += size;
+        }
+    }
+
+    /**
+        Path of the entry for a key.
+    */
+    string entry_path(unsigned long long key) const
+    {
+        char name[17];
+        snprintf(name, sizeof(name), "%016llx", key);
+        return (filesystem::path(directory) / (string(name) + NYK_EXTENSION)).string();
+    }
+
+    /**
+        A unique temporary path to write a new entry to before add_entry().
+    */
+    string temp_path(unsigned long long key)
+    {
+        return entry_path(key) + "." + to_string(getpid()) + "." + to_string(++temp_counter) + ".tmp";
+    }
+
+    /**
+        Decodes the bytes read from an entry's path and counts the hit or miss.
+
+        @param key: The entry's key.
+        @param bytes: The contents of the entry's file (empty if it does not exist).
+        @param image: Receives the cached result on a hit.
+        @param alpha: Receives the cached alpha plane on a hit.
+        @returns true on a hit, false on a miss.
+    */
+    bool decode_entry(unsigned long long key, const vector<unsigned char>& bytes,
+                      vector<vector<Pixel>>& image, AlphaPlane& alpha)
+    {
+        AlphaPlane cached_alpha;
+        vector<vector<Pixel>> cached = bytes.empty() ? vector<vector<Pixel>>()
+                                                     : decode_nyk(bytes.data(), bytes.size(), &cached_alpha);
+        lock_guard<mutex> lock(index_mutex);
+        auto entry = entries.find(key);
+        if (cached.empty())
+        {
+            misses++;
+            if (entry != entries.end())
+            {
+                total_bytes -= entry->second.size;
+                entries.erase(entry);
+            }
+            return false;
+        }
+
+        hits++;
+        if (entry != entries.end())
+        {
+            entry->second.last_used = ++clock;
+        }
+        error_code error;
+        filesystem::last_write_time(entry_path(key), filesystem::file_time_type::clock::now(), error);
+        image = move(cached);
+        alpha = move(cached_alpha);
+        return true;
+    }
+
+    /**
+        Moves a fully written temporary file into place as an entry, then deletes the
+        least recently used entries until the cache is within its size limit.
+
+        @param key: The entry's key.
+        @param temp_filename: The file written, from temp_path().
+        @param size: Size of the file in bytes.
+    */
+    void add_entry(unsigned long long key, const string& temp_filename, unsigned long long size)
+    {
+        if (rename(temp_filename.c_str(), entry_path(key).c_str()) != 0)
+        {
+            remove(temp_filename.c_str());
+            return;
+        }
+
+        lock_guard<mutex> lock(index_mutex);
+        CacheEntry& entry = entries[key];
+        total_bytes += size - entry.size;
+        entry = CacheEntry{size, ++clock};
+        while (total_bytes > max_bytes && entries.size() > 1)
+        {
+            auto oldest = min_element(entries.begin(), entries.end(), [](const auto& a, const auto& b)
+            {
+                return a.second.last_used < b.second.last_used;
+            });
+            error_code error;
+            filesystem::remove(entry_path(oldest->first), error);
+            total_bytes -= oldest->second.size;
+            entries.erase(oldest);
+        }
+    }
+
+    /**
+        Looks a result up, reading the entry synchronously.
+
+        @returns true on a hit, with the result in image and alpha.
+    */
+    bool lookup(unsigned long long key, vector<vector<Pixel>>& image, AlphaPlane& alpha)
+    {
+        vector<unsigned char> bytes;
+        read_file_bytes(entry_path(key), bytes);
+        return decode_entry(key, bytes, image, alpha);
+    }
+
+    /**
+        Stores a result, writing the entry synchronously.
+    */
+    void store(unsigned long long key, const vector<vector<Pixel>>& image, const AlphaPlane& alpha)
+    {
+        string temp_filename = temp_path(key);
+        vector<unsigned char> bytes = encode_nyk(image, alpha);
+        if (write_file_bytes(temp_filename, bytes))
+        {
+            add_entry(key, temp_filename, bytes.size());
+        }
+    }
+
+    long hit_count() const
+    {
+        return hits;
+    }
+
+    long miss_count() const
+    {
+        return misses;
+    }
+
+private:
+    struct CacheEntry
+    {
+        unsigned long long size = 0;
+        unsigned long long last_used = 0;
+    };
+
+    string directory;
+    unsigned long long max_bytes;
+    mutex index_mutex;
+    map<unsigned long long, CacheEntry> entries;
+    unsigned long long total_bytes = 0;
+    unsigned long long clock = 0;        // Orders entries by last use
+    atomic<unsigned long long> temp_counter{0};
+    atomic<long> hits{0};
+    atomic<long> misses{0};
+};
+
+
+//***************************************************************************************************//
+//                                      LIBRARY API                                                 //
+//
+// Runs the effects on pixel buffers owned by the caller, for programs that already hold
+// decoded frames and would otherwise write them out as BMPs to read them back. A buffer
+// is described by a pointer to its top row, its size, its stride and its pixel format,
+// and may live in a POSIX shared memory segment (SharedImage). Color effects run their
+// filter functors straight over the caller's bytes; rotations and enlargements copy
+// pixels once into the destination; convolutions go through their float planes.
+// Compile with -DNYARKO_LIBRARY to leave out main() and link these into another program.
+
+/**
+    Byte layout of the pixels of an ImageBuffer.
+*/
+enum class PixelFormat
+{
+    BGR24,   // Blue, green, red (the BMP order)
+    RGB24,   // Red, green, blue
+    BGRA32,  // Blue, green, red, alpha
+    RGBA32   // Red, green, blue, alpha
+};
+
+
+/**
+    A caller-owned image: num_rows rows of num_columns pixels, each row starting
+    stride bytes after the previous one.
+*/
+struct ImageBuffer
+{
+    unsigned char* data = nullptr;  // First byte of the top row
+    int num_rows = 0;
+    int num_columns = 0;
+    size_t stride = 0;              // Bytes from the start of one row to the next
+    PixelFormat format = PixelFormat::BGR24;
+};
+
+
+/**
+    Size of a pixel and the offset of each channel within it.
+*/
+struct FormatLayout
+{
+    int bytes_per_pixel;
+    int red;
+    int green;
+    int blue;
+    int alpha;  // -1 if the format has no alpha
+};
+
+
+/**
+    @param format: A pixel format.
+    @returns The layout of the format's pixels.
+*/
+FormatLayout format_layout(PixelFormat format)
+{
+    switch (format)
+    {
+        case PixelFormat::BGR24:  return FormatLayout{3, 2, 1, 0, -1};
+        case PixelFormat::RGB24:  return FormatLayout{3, 0, 1, 2, -1};
+        case PixelFormat::BGRA32: return FormatLayout{4, 2, 1, 0, 3};
+        case PixelFormat::RGBA32: return FormatLayout{4, 0, 1, 2, 3};
+    }
+    return FormatLayout{3, 2, 1, 0, -1};
+}
+
+
+/**
+    @returns Address of the first byte of a pixel of a buffer.
+*/
+inline unsigned char* buffer_pixel(const ImageBuffer& buffer, int row, int col)
+{
+    return buffer.data + row * buffer.stride + static_cast<size_t>(col) * format_layout(buffer.format).bytes_per_pixel;
+}
+
+
+/**
+    Gives the size of the image an effect step produces.
+
+    @param num_rows: Height of the image the step is applied to.
+    @param num_columns: Width of the image the step is applied to.
+    @param step: The effect and its parameters.
+    @returns The (rows, columns) of the result.
+*/
+pair<int, int> effect_output_dimensions(int num_rows, int num_columns, const EffectStep& step)
+{
+    if (is_view_effect(step.choice))
+    {
+        ViewTransform view(num_rows, num_columns);
+        apply_view_effect(view, step);
+        return {view.num_rows, view.num_columns};
+    }
+    if (step.choice == 6)
+    {
+        return {num_rows * step.yscale, num_columns * step.xscale};
+    }
+    return {num_rows, num_columns};
+}
+
+
+/**
+    Gives the size of the image an effect chain produces, so callers can allocate
+    the destination buffer.
+
+    @param num_rows: Height of the source image.
+    @param num_columns: Width of the source image.
+    @param chain: The effects, in order.
+    @returns The (rows, columns) of the result.
+*/
+pair<int, int> chain_output_dimensions(int num_rows, int num_columns, const vector<EffectStep>& chain)
+{
+    pair<int, int> dimensions(num_rows, num_columns);
+    for (const EffectStep& step : chain)
+    {
+        dimensions = effect_output_dimensions(dimensions.first, dimensions.second, step);
+    }
+    return dimensions;
+}
+
+
+/**
+    Whether an effect can write its result over its source, pixel for pixel.
+*/
+bool effect_runs_in_place(const EffectStep& step)
+{
+    return !is_view_effect(step.choice) && step.choice != 6;
+}
+
+
+/**
+    Runs a filter functor over the pixels of a buffer, writing to a buffer of the same
+    size and format, which may be the source itself. Alpha is carried over unchanged.
+
+    @param source: The buffer to read.
+    @param destination: The buffer to write.
+    @param filter: The functor to apply.
+*/
+template <typename Filter>
+void apply_filter_buffer(const ImageBuffer& source, const ImageBuffer& destination, const Filter& filter)
+{
+    FormatLayout layout = format_layout(source.format);
+    parallel_for(source.num_rows, [&](int row)
+    {
+        const unsigned char* src = source.data + row * source.stride;
+        unsigned char* dst = destination.data + row * destination.stride;
+        for (int col = 0; col < source.num_columns; col++)
+        {
+            Pixel p{src[layout.red], src[layout.green], src[layout.blue]};
+            Pixel q;
+            if constexpr (is_invocable_v<const Filter&, const Pixel&, int, int>)
+            {
+                q = filter(p, row, col);
+            }
+            else
+            {
+                q = filter(p);
+            }
+            if (layout.alpha >= 0)
+            {
+                dst[layout.alpha] = src[layout.alpha];
+            }
+            dst[layout.red] = q.red;
+            dst[layout.green] = q.green;
+            dst[layout.blue] = q.blue;
+            src += layout.bytes_per_pixel;
+            dst += layout.bytes_per_pixel;
+        }
+    }, source.num_columns);
+}
+
+
+/**
+    Copies a view of a buffer into another buffer, moving whole pixels (alpha included),
+    for rotations, flips, the transpose and crops.
+*/
+void view_buffer(const ImageBuffer& source, const ImageBuffer& destination, const ViewTransform& view)
+{
+    int bytes_per_pixel = format_layout(source.format).bytes_per_pixel;
+    parallel_for(view.num_rows, [&](int row)
+    {
+        unsigned char* dst = destination.data + row * destination.stride;
+        int src_row = view.origin_row + row * view.row_step[0];
+        int src_col = view.origin_column + row * view.row_step[1];
+        for (int col = 0; col < view.num_columns; col++)
+        {
+            memcpy(dst, buffer_pixel(source, src_row, src_col), bytes_per_pixel);
+            dst += bytes_per_pixel;
+            src_row += view.column_step[0];
+            src_col += view.column_step[1];
+        }
+    }, view.num_columns);
+}
+
+
+/**
+    Enlarges a buffer into another buffer, repeating each pixel xscale times across
+    and each row yscale times down, like enlarge_image().
+*/
+void enlarge_buffer(const ImageBuffer& source, const ImageBuffer& destination, int xscale, int yscale)
+{
+    int bytes_per_pixel = format_layout(source.format).bytes_per_pixel;
+    size_t row_bytes = static_cast<size_t>(destination.num_columns) * bytes_per_pixel;
+    parallel_for(source.num_rows, [&](int row)
+    {
+        const unsigned char* src = source.data + row * source.stride;
+        unsigned char* first_copy = destination.data + static_cast<size_t>(row) * yscale * destination.stride;
+        unsigned char* dst = first_copy;
+        for (int col = 0; col < source.num_columns; col++)
+        {
+            for (int k = 0; k < xscale; k++)
+            {
+                memcpy(dst, src, bytes_per_pixel);
+                dst += bytes_per_pixel;
+            }
+            src += bytes_per_pixel;
+        }
+        for (int k = 1; k < yscale; k++)
+        {
+            memcpy(first_copy + k * destination.stride, first_copy, row_bytes);
+        }
+    }, static_cast<size_t>(destination.num_columns) * yscale);
+}
+
+
+/**
+    Splits a buffer into red, green and blue float planes for the convolution engine.
+*/
+PlanarImage buffer_to_planar(const ImageBuffer& buffer)
+{
+    FormatLayout layout = format_layout(buffer.format);
+    PlanarImage planar = make_planar_image(buffer.num_rows, buffer.num_columns);
+    parallel_for(planar.num_rows, [&](int row)
+    {
+        const unsigned char* src = buffer.data + row * buffer.stride;
+        size_t offset = static_cast<size_t>(row) * planar.num_columns;
+        for (int col = 0; col < planar.num_columns; col++)
+        {
+            planar.channels[0][offset + col] = src[layout.red];
+            planar.channels[1][offset + col] = src[layout.green];
+            planar.channels[2][offset + col] = src[layout.blue];
+            src += layout.bytes_per_pixel;
+        }
+    }, planar.num_columns);
+    return planar;
+}
+
+
+/**
+    Writes float planes into a buffer of the same size, taking alpha from the source
+    buffer the planes were made from (which may be the destination itself).
+*/
+void planar_to_buffer(const PlanarImage& planar, const ImageBuffer& source, const ImageBuffer& destination)
+{
+    FormatLayout layout = format_layout(destination.format);
+    parallel_for(planar.num_rows, [&](int row)
+    {
+        const unsigned char* src = source.data + row * source.stride;
+        unsigned char* dst = destination.data + row * destination.stride;
+        size_t offset = static_cast<size_t>(row) * planar.num_columns;
+        for (int col = 0; col < planar.num_columns; col++)
+        {
+            if (layout.alpha >= 0)
+            {
+                dst[layout.alpha] = src[layout.alpha];
+            }
+            dst[layout.red] = clamp_channel(planar.channels[0][offset + col]);
+            dst[layout.green] = clamp_channel(planar.channels[1][offset + col]);
+            dst[layout.blue] = clamp_channel(planar.channels[2][offset + col]);
+            src += layout.bytes_per_pixel;
+            dst += layout.bytes_per_pixel;
+        }
+    }, planar.num_columns);
+}
+
+
+/**
+    Checks that a buffer has pixels and rows long enough for its width.
+*/
+bool is_valid_buffer(const ImageBuffer& buffer)
+{
+    return buffer.data != nullptr && buffer.num_rows > 0 && buffer.num_columns > 0 &&
+           buffer.stride >= static_cast<size_t>(buffer.num_columns) * format_layout(buffer.format).bytes_per_pixel;
+}
+
+
+/**
+    Applies one effect step to a caller-owned buffer. The destination must have the
+    size effect_output_dimensions() gives and the same format as the source. Color
+    and convolution effects (all but 4-6 and 16-19) may use the source as the destination.
+
+    @param source: The buffer to read.
+    @param destination: The buffer to write the result into.
+    @param step: The effect and its parameters.
+    @returns true if the effect was applied, false if the buffers do not fit it.
+*/
+bool apply_effect_buffer(const ImageBuffer& source, const ImageBuffer& destination, const EffectStep& step)
+{
+    pair<int, int> dimensions = effect_output_dimensions(source.num_rows, source.num_columns, step);
+    if (!is_valid_buffer(source) || !is_valid_buffer(destination) || source.format != destination.format ||
+        destination.num_rows != dimensions.first || destination.num_columns != dimensions.second)
+    {
+        cerr << "Error: Buffers do not match effect " << step.choice << "." << endl;
+        return false;
+    }
+    if (!effect_runs_in_place(step) && source.data == destination.data)
+    {
+        cerr << "Error: Effect " << step.choice << " cannot write over its source." << endl;
+        return false;
+    }
+
+    if (visit_point_filter(step, source.num_rows, source.num_columns, [&](const auto& filter)
+        {
+            apply_filter_buffer(source, destination, filter);
+        }))
+    {
+        return true;
+    }
+    if (is_view_effect(step.choice))
+    {
+        ViewTransform view(source.num_rows, source.num_columns);
+        apply_view_effect(view, step);
+        view_buffer(source, destination, view);
+        return true;
+    }
+    if (step.choice == 6)
+    {
+        enlarge_buffer(source, destination, step.xscale, step.yscale);
+        return true;
+    }
+
+    PlanarImage planar = buffer_to_planar(source);
+    switch (step.choice)
+    {
+        case 11: box_blur_planar(planar, step.radius); break;
+        case 12: planar = gaussian_blur_planar(planar, step.sigma); break;
+        case 13: unsharp_mask_planar(planar, step.sigma, step.amount); break;
+        case 14: planar = convolve_kernel_planar(planar, normalize_kernel(step.kernel), (step.kernel.size() == 25) ? 5 : 3); break;
+        default:
+            cerr << "Error: Unknown effect " << step.choice << "." << endl;
+            return false;
+    }
+    planar_to_buffer(planar, source, destination);
+    return true;
+}
+
+
+/**
+    Applies an effect chain to a caller-owned buffer. Runs of color and convolution
+    effects are applied straight into the destination; only an effect that moves
+    pixels (a rotation, flip, transpose, crop or enlargement) in the middle of the
+    chain needs a scratch buffer.
+
+    @param source: The buffer to read; left unchanged unless it is also the destination.
+    @param destination: The buffer to write, of the size chain_output_dimensions() gives.
+    @param chain: The effects to apply, in order.
+    @returns true if the chain was applied, false if the buffers do not fit it.
+*/
+bool apply_effect_chain_buffer(const ImageBuffer& source, const ImageBuffer& destination, const vector<EffectStep>& chain)
+{
+    pair<int, int> dimensions = chain_output_dimensions(source.num_rows, source.num_columns, chain);
+    if (chain.empty() || destination.num_rows != dimensions.first || destination.num_columns != dimensions.second)
+    {
+        cerr << "Error: Destination buffer does not match the effect chain." << endl;
+        return false;
+    }
+
+    int bytes_per_pixel = format_layout(source.format).bytes_per_pixel;
+    vector<unsigned char> scratch[2];
+    auto scratch_buffer = [&](int index, int num_rows, int num_columns)
+    {
+        ImageBuffer buffer;
+        buffer.num_rows = num_rows;
+        buffer.num_columns = num_columns;
+        buffer.stride = static_cast<size_t>(num_columns) * bytes_per_pixel;
+        buffer.format = source.format;
+        scratch[index].resize(buffer.stride * num_rows);
+        buffer.data = scratch[index].data();
+        return buffer;
+    };
+
+    ImageBuffer current = source;
+    for (size_t i = 0; i < chain.size(); i++)
+    {
+        const EffectStep& step = chain[i];
+        dimensions = effect_output_dimensions(current.num_rows, current.num_columns, step);
+        bool last = (i + 1 == chain.size());
+        bool fits_destination = dimensions.first == destination.num_rows && dimensions.second == destination.num_columns;
+
+        ImageBuffer target;
+        if (last || (effect_runs_in_place(step) && fits_destination &&
+                     (current.data == source.data || current.data == destination.data)))
+        {
+            target = destination;
+        }
+        else
+        {
+            // Use whichever scratch buffer the current image is not in
+            target = scratch_buffer(current.data == scratch[0].data() ? 1 : 0, dimensions.first, dimensions.second);
+        }
+
+        if (!effect_runs_in_place(step) && target.data == current.data)
+        {
+            // A final pixel move reading the destination works from a copy
+            ImageBuffer copy = scratch_buffer(0, current.num_rows, current.num_columns);
+            for (int row = 0; row < current.num_rows; row++)
+            {
+                memcpy(copy.data + row * copy.stride, current.data + row * current.stride, copy.stride);
+            }
+            current = copy;
+        }
+        if (!apply_effect_buffer(current, target, step))
+        {
+            return false;
+        }
+        current = target;
+    }
+    return true;
+}
+
+
+/**
+    An image in a POSIX shared memory segment, mapped into this process as an
+    ImageBuffer with tightly packed rows. Another process can map the same segment
+    by name to hand frames over without copying them.
+*/
+class SharedImage
+{
+public:
+    /**
+        @param name: Name of the segment, starting with '/'.
+        @param num_rows: Height of the image.
+        @param num_columns: Width of the image.
+        @param format: Pixel format of the image.
+        @param create: If true the segment is created (or resized) for the image,
+                       otherwise an existing segment at least that large is opened.
+    */
+    SharedImage(const string& name, int num_rows, int num_columns, PixelFormat format, bool create)
+    {
+        image.num_rows = num_rows;
+        image.num_columns = num_columns;
+        image.format = format;
+        image.stride = static_cast<size_t>(num_columns) * format_layout(format).bytes_per_pixel;
+        size = image.stride * num_rows;
+
+        struct stat info;
+        fd = shm_open(name.c_str(), create ? (O_RDWR | O_CREAT) : O_RDWR, 0600);
+        if (fd < 0 || size == 0 || (create && ftruncate(fd, size) != 0) ||
+            fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < size)
+        {
+            cerr << "Error: Unable to open shared image " << name << "." << endl;
+            return;
+        }
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED)
+        {
+            cerr << "Error: Unable to map shared image " << name << "." << endl;
+            return;
+        }
+        image.data = static_cast<unsigned char*>(mapping);
+    }
+
+    ~SharedImage()
+    {
+        if (image.data != nullptr)
+        {
+            munmap(image.data, size);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    SharedImage(const SharedImage&) = delete;
+    SharedImage& operator=(const SharedImage&) = delete;
+
+    /**
+        Whether the segment was opened and mapped.
+    */
+    bool is_open() const
+    {
+        return image.data != nullptr;
+    }
+
+    /**
+        The mapped image, for apply_effect_buffer() and apply_effect_chain_buffer().
+    */
+    const ImageBuffer& buffer() const
+    {
+        return image;
+    }
+
+    /**
+        Removes a segment's name; mappings that are still open stay valid.
+    */
+    static bool remove(const string& name)
+    {
+        return shm_unlink(name.c_str()) == 0;
+    }
+
+private:
+    int fd = -1;
+    size_t size = 0;
+    ImageBuffer image;
+};
+
+
+//***************************************************************************************************//
+//                                 REGIONS OF INTEREST                                              //
+
+/**
+    Parses a region written as "x,y,width,height" (x is the left column, y the top row).
+
+    @param spec: The text of the region.
+    @param region: Receives the region.
+    @returns true if the region is valid, false otherwise.
+*/
+bool parse_region(const string& spec, Region& region)
+{
+    stringstream spec_stream(spec);
+    char comma1, comma2, comma3;
+    if (!(spec_stream >> region.col >> comma1 >> region.row >> comma2 >> region.num_columns >> comma3 >> region.num_rows) ||
+        comma1 != ',' || comma2 != ',' || comma3 != ',' || !(spec_stream >> ws).eof())
+    {
+        return false;
+    }
+    return region.row >= 0 && region.col >= 0 && region.num_rows > 0 && region.num_columns > 0;
+}
+
+
+/**
+    Shrinks a region so it lies inside an image of the given size.
+
+    @param region: The region to clip.
+    @param num_rows: Height of the image.
+    @param num_columns: Width of the image.
+    @returns false if nothing of the region is left inside the image.
+*/
+bool clip_region(Region& region, int num_rows, int num_columns)
+{
+    region.num_rows = min(region.num_rows, num_rows - region.row);
+    region.num_columns = min(region.num_columns, num_columns - region.col);
+    return region.num_rows > 0 && region.num_columns > 0;
+}
+
+
+/**
+    Checks whether an effect can be applied to just a region of an image. Effects that
+    change the image size or read neighbouring pixels need the whole image.
+
+    @param choice: Menu option number of the effect.
+    @returns true for vignette, Clarendon, greyscale, high contrast, lighten, darken,
+             black/white/red/green/blue and color grades.
+*/
+bool effect_supports_region(int choice)
+{
+    switch (choice)
+    {
+        case 1: case 2: case 3: case 7: case 8: case 9: case 10: case 15:
+            return true;
+    }
+    return false;
+}
+
+
+/**
+    Copies a region of an image into a new image of the region's size.
+
+    @param image: The image as a 2D vector of Pixel structs.
+    @param region: The region to copy (must lie inside the image).
+    @returns The pixels of the region.
+*/
+vector<vector<Pixel>> copy_region(const vector<vector<Pixel>>& image, const Region& region)
+{
+    vector<vector<Pixel>> patch(region.num_rows);
+    parallel_for(region.num_rows, [&](int row)
+    {
+        const Pixel* src = image[region.row + row].data() + region.col;
+        patch[row].assign(src, src + region.num_columns);
+    }, region.num_columns);
+    return patch;
+}
+
+
+/**
+    Copies an image of a region's size into that region of an image.
+
+    @param image: The image, modified in place.
+    @param patch: The pixels to copy in.
+    @param region: The region to overwrite (must lie inside the image).
+*/
+void paste_region(vector<vector<Pixel>>& image, const vector<vector<Pixel>>& patch, const Region& region)
+{
+    parallel_for(region.num_rows, [&](int row)
+    {
+        copy(patch[row].begin(), patch[row].end(), image[region.row + row].begin() + region.col);
+    }, region.num_columns);
+}
+
+
+/**
+    Reads just the part of a BMP file covering a region: only the headers and the
+    scanlines the region spans are read from disk, and only the region's columns are
+    decoded.
+
+    @param filename: BMP image filename.
+    @param region: The region to read; clipped to the image.
+    @param info: Receives the layout of the file.
+    @returns The pixels of the region, or an empty vector if the file could not be read
+             or the region lies outside the image.
+*/
+vector<vector<Pixel>> read_bmp_region(const string& filename, Region& region, BmpInfo& info)
+{
+    ifstream stream(filename, ios::in | ios::binary | ios::ate);
+    if (!stream.is_open())
+    {
+        return {};
+    }
+    size_t file_size = stream.tellg();
+
+    // Headers first, then everything up to the pixel array for the palette or bit masks
+    vector<unsigned char> header(min<size_t>(file_size, 54));
+    stream.seekg(0);
+    stream.read(reinterpret_cast<char*>(header.data()), header.size());
+    if (!stream || header.size() < 54)
+    {
+        return {};
+    }
+    size_t header_size = min<size_t>(file_size, get_uint(header.data(), 10, 4));
+    header.resize(max<size_t>(header_size, 54));
+    stream.seekg(0);
+    stream.read(reinterpret_cast<char*>(header.data()), header.size());
+    if (!stream || !parse_bmp_header(header.data(), header.size(), file_size, info) ||
+        !clip_region(region, info.height, info.width))
+    {
+        return {};
+    }
+
+    // The region's scanlines are contiguous in the file in either row order
+    int first_stored_row = info.top_down ? region.row : info.height - region.row - region.num_rows;
+    vector<unsigned char> rows(info.row_stride * region.num_rows);
+    stream.seekg(info.pixel_offset + info.row_stride * first_stored_row);
+    stream.read(reinterpret_cast<char*>(rows.data()), rows.size());
+    if (!stream)
+    {
+        return {};
+    }
+
+    size_t column_offset = static_cast<size_t>(region.col) * info.bits_per_pixel / 8;
+    vector<vector<Pixel>> patch = initialize_new_image(region.num_rows, region.num_columns);
+    parallel_for(region.num_rows, [&](int row)
+    {
+        int stored_row = info.top_down ? row : region.num_rows - 1 - row;
+        decode_bmp_row(rows.data() + info.row_stride * stored_row + column_offset, info, patch[row], nullptr);
+    }, region.num_columns);
+    return patch;
+}
+
+
+/**
+    Checks whether a BMP file's pixels can be overwritten in place by write_bmp_region().
+
+    @param info: Layout of the file.
+    @returns true for 24 bpp files and 32 bpp files with the standard channel order.
+*/
+bool bmp_region_writable(const BmpInfo& info)
+{
+    bool standard_masks = info.masks[0] == 0x00FF0000 && info.masks[1] == 0x0000FF00 && info.masks[2] == 0x000000FF;
+    return info.bits_per_pixel == 24 || (info.bits_per_pixel == 32 && standard_masks);
+}
+
+
+/**
+    Overwrites a region of an existing BMP file with new pixels, reading and rewriting
+    only the scanlines the region spans. Alpha values in 32 bpp files are kept.
+
+    @param filename: BMP image filename.
+    @param patch: The new pixels of the region.
+    @param region: The region to overwrite (must lie inside the image).
+    @param info: Layout of the file; must be writable (see bmp_region_writable()).
+    @returns True if successful and false otherwise.
+*/
+bool write_bmp_region(const string& filename, const vector<vector<Pixel>>& patch, const Region& region, const BmpInfo& info)
+{
+    fstream stream(filename, ios::in | ios::out | ios::binary);
+    if (!stream.is_open() || !bmp_region_writable(info))
+    {
+        return false;
+    }
+
+    int first_stored_row = info.top_down ? region.row : info.height - region.row - region.num_rows;
+    size_t block_start = info.pixel_offset + info.row_stride * first_stored_row;
+    vector<unsigned char> rows(info.row_stride * region.num_rows);
+    stream.seekg(block_start);
+    stream.read(reinterpret_cast<char*>(rows.data()), rows.size());
+    if (!stream)
+    {
+        return false;
+    }
+
+    int bytes_per_pixel = info.bits_per_pixel / 8;
+    parallel_for(region.num_rows, [&](int row)
+    {
+        int stored_row = info.top_down ? row : region.num_rows - 1 - row;
+        unsigned char* dst = rows.data() + info.row_stride * stored_row + static_cast<size_t>(region.col) * bytes_per_pixel;
+        for (int col = 0; col < region.num_columns; col++, dst += bytes_per_pixel)
+        {
+            dst[0] = patch[row][col].blue;
+            dst[1] = patch[row][col].green;
+            dst[2] = patch[row][col].red;
+        }
+    }, region.num_columns);
+
+    stream.seekp(block_start);
+    stream.write(reinterpret_cast<const char*>(rows.data()), rows.size());
+    return static_cast<bool>(stream);
+}
+
+
+//***************************************************************************************************//
+//                                         MEMORY PLANNING                                          //
+//
+// A job's memory cost is known before any pixel is read: the file headers give the image
+// size, and each effect's output size follows from its parameters. The planner walks the
+// chain with those sizes and takes the largest amount held at once (the file bytes while
+// decoding, an effect's source and result while it runs, the encoded output at the end).
+// Batch jobs reserve that much of a global budget before they start. A job larger than
+// the whole budget is run in strips of rows when its chain allows, reading and writing
+// each strip with positional I/O so only a strip is ever in memory; otherwise it waits
+// for the whole budget and runs alone.
+
+// Bytes of a job run in strips that are in memory at once, at most
+const unsigned long long STRIP_TARGET_BYTES = 64 << 20;
+
+// Smallest default memory budget, for machines whose memory size cannot be read
+const unsigned long long MIN_MEMORY_BUDGET = 256ULL << 20;
+
+
+/**
+    Size and format of an image file, read from its headers alone.
+*/
+struct ImageShape
+{
+    int num_rows = 0;
+    int num_columns = 0;
+    bool has_alpha = false;          // May be true for a 32 bpp BMP whose alpha turns out to be unused
+    bool is_bmp = false;             // Whether the file is a BMP rather than .nyk
+    unsigned long long file_bytes = 0;
+};
+
+
+/**
+    Reads the size of a BMP or .nyk image from the headers of its file.
+
+    @param filename: Name of the image file.
+    @param shape: Receives the size and format.
+    @returns true if the file is an image that can be read, false otherwise.
+*/
+bool read_image_shape(const string& filename, ImageShape& shape)
+{
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat file_status;
+    BmpInfo bmp_info;
+    NykInfo nyk_info;
+    unsigned char header[NYK_HEADER_SIZE];
+    bool valid = fstat(fd, &file_status) == 0;
+    if (valid && read_bmp_file_info(fd, bmp_info))
+    {
+        shape = ImageShape{bmp_info.height, bmp_info.width, bmp_has_alpha(bmp_info), true,
+                           static_cast<unsigned long long>(file_status.st_size)};
+    }
+    else if (valid && pread_fully(fd, header, sizeof(header), 0) && parse_nyk_header(header, sizeof(header), nyk_info))
+    {
+        shape = ImageShape{nyk_info.height, nyk_info.width, nyk_info.channels == 4, false,
+                           static_cast<unsigned long long>(file_status.st_size)};
+    }
+    else
+    {
+        valid = false;
+    }
+    close(fd);
+    return valid;
+}
+
+
+/**
+    Bytes a decoded image of the given size takes, rows and alpha plane included.
+*/
+unsigned long long decoded_image_bytes(unsigned long long num_rows, unsigned long long num_columns, bool has_alpha)
+{
+    unsigned long long bytes = num_rows * (num_columns * sizeof(Pixel) + sizeof(vector<Pixel>));
+    if (has_alpha)
+    {
+        bytes += num_rows * (num_columns + sizeof(vector<unsigned char>));
+    }
+    return bytes;
+}
+
+
+/**
+    Bytes of the BMP file an image of the given size is written as.
+*/
+unsigned long long encoded_bmp_bytes(unsigned long long num_rows, unsigned long long num_columns, bool has_alpha)
+{
+    return 122 + num_rows * ((num_columns * (has_alpha ? 4 : 3) + 3) / 4 * 4);
+}
+
+
+/**
+    Whether an effect only needs the rows it changes, so an image can be run through
+    it strip by strip: the point effects, enlarging, flips, 180 degree rotations and crops.
+*/
+bool is_strip_effect(const EffectStep& step)
+{
+    switch (step.choice)
+    {
+        case 1: case 2: case 3: case 7: case 8: case 9: case 10: case 15:
+        case 6: case 16: case 17: case 19:
+            return true;
+        case 5:
+            return step.number % 2 == 0;
+    }
+    return false;
+}
+
+
+/**
+    Memory an effect chain needs on one image, from the planner.
+*/
+struct MemoryPlan
+{
+    unsigned long long peak_bytes = 0;       // Most bytes held at once when the whole image is in memory
+    unsigned long long strip_row_bytes = 0;  // Most bytes held per input row when run in strips, or 0 if the chain cannot be
+    int num_rows = 0;                        // Size of the result
+    int num_columns = 0;
+};
+
+
+/**
+    Estimates the peak memory of running an effect chain over an image file the way
+    the batch pipeline does. The estimate follows the chain as written; the optimizer
+    only ever removes work, so it is an upper bound.
+
+    @param shape: Size and format of the input file.
+    @param chain: The effects to apply, in order.
+    @param cached: Whether the result is stored in a result cache as well.
+    @param plan: Receives the estimate.
+    @returns false if the result would be too large to represent, true otherwise.
+*/
+bool plan_job_memory(const ImageShape& shape, const vector<EffectStep>& chain, bool cached, MemoryPlan& plan)
+{
+    unsigned long long num_rows = shape.num_rows;
+    unsigned long long num_columns = shape.num_columns;
+    unsigned long long rows_per_input_row = 1;  // Rows of the current image made from each input row
+    unsigned long long current = decoded_image_bytes(num_rows, num_columns, shape.has_alpha);
+    unsigned long long input_row_bytes = (num_columns * 4 + 3) / 4 * 4;
+    unsigned long long strip_pixel_bytes = 0;
+    bool strips = shape.is_bmp;
+
+    plan.peak_bytes = shape.file_bytes + current;
+    for (const EffectStep& step : chain)
+    {
+        unsigned long long new_rows = num_rows;
+        unsigned long long new_columns = num_columns;
+        if (step.choice == 6)
+        {
+            new_rows *= step.yscale;
+            new_columns *= step.xscale;
+            rows_per_input_row *= step.yscale;
+        }
+        else if (is_view_effect(step.choice))
+        {
+            pair<int, int> dimensions = effect_output_dimensions(num_rows, num_columns, step);
+            new_rows = dimensions.first;
+            new_columns = dimensions.second;
+        }
+        if (max(new_rows, new_columns) > static_cast<unsigned long long>(numeric_limits<int>::max()))
+        {
+            return false;
+        }
+
+        // Point effects run in place; convolutions hold up to three float planes besides the source and result
+        unsigned long long result = decoded_image_bytes(new_rows, new_columns, shape.has_alpha);
+        unsigned long long working = current;
+        if (step.choice == 6 || is_view_effect(step.choice))
+        {
+            working += result;
+        }
+        else if (step.choice >= 11 && step.choice <= 14)
+        {
+            working += 3 * num_rows * num_columns * 3 * sizeof(float) + result;
+        }
+        plan.peak_bytes = max(plan.peak_bytes, working);
+
+        strips = strips && is_strip_effect(step);
+        strip_pixel_bytes = max(strip_pixel_bytes, rows_per_input_row * (num_columns + new_columns) *
+                                                   (sizeof(Pixel) + (shape.has_alpha ? 1 : 0)));
+        num_rows = new_rows;
+        num_columns = new_columns;
+        current = result;
+    }
+
+    // Encoding holds the final image and its file bytes; a cache entry is encoded next to it the same way
+    unsigned long long encoded = encoded_bmp_bytes(num_rows, num_columns, shape.has_alpha);
+    plan.peak_bytes = max(plan.peak_bytes, current + encoded * (cached ? 2 : 1));
+    plan.strip_row_bytes = strips ? input_row_bytes + strip_pixel_bytes + rows_per_input_row * encoded / max(1ULL, num_rows) : 0;
+    plan.num_rows = num_rows;
+    plan.num_columns = num_columns;
+    return true;
+}
+
+
+/**
+    Runs one strip of an image through an effect step. The strip is rows
+    [first_row, first_row + strip.size()) of an image of num_rows x num_columns, and
+    all three are updated to describe the strip of the result.
+
+    @param step: The effect and its parameters; is_strip_effect() must hold for it,
+                 and a crop must already be clipped to the image.
+    @param strip: The rows of the strip, replaced by those of the result.
+    @param alpha: The strip's alpha rows, or an empty plane for an opaque image.
+    @param first_row: Image row of the strip's first row.
+    @param num_rows: Height of the image.
+    @param num_columns: Width of the image.
+    @returns false if the effect could not be applied.
+*/
+bool apply_strip_effect(const EffectStep& step, vector<vector<Pixel>>& strip, AlphaPlane& alpha,
+                        int& first_row, int& num_rows, int& num_columns)
+{
+    int strip_rows = strip.size();
+    if (step.choice == 1)
+    {
+        // The vignette depends on the position in the whole image, which is too large for a mask
+        VignetteFilter vignette{num_rows, num_columns, nullptr};
+        apply_filter_in_place(strip, [&](const Pixel& p, int row, int col)
+        {
+            return vignette(p, first_row + row, col);
+        });
+        return true;
+    }
+    if (step.choice == 6)
+    {
+        strip = process6(strip, step.xscale, step.yscale);
+        alpha = apply_effect_alpha(alpha, step);
+        first_row *= step.yscale;
+        num_rows *= step.yscale;
+        num_columns *= step.xscale;
+        return true;
+    }
+    if (step.choice == 19)
+    {
+        // Only the part of the crop that overlaps this strip is kept
+        int top = max(first_row, step.crop.row);
+        int bottom = min(first_row + strip_rows, step.crop.row + step.crop.num_rows);
+        ViewTransform view(strip_rows, num_columns);
+        if (top >= bottom || !view.crop(Region{top - first_row, step.crop.col, bottom - top, step.crop.num_columns}))
+        {
+            strip.clear();
+            alpha.clear();
+        }
+        else
+        {
+            strip = materialize_view(strip, view);
+            alpha = alpha.empty() ? alpha : materialize_view(alpha, view);
+        }
+        first_row = max(0, top - step.crop.row);
+        num_rows = step.crop.num_rows;
+        num_columns = step.crop.num_columns;
+        return true;
+    }
+    if (is_view_effect(step.choice))
+    {
+        // Flips and half turns reverse the strip's rows, which also moves the strip to the other end of the image
+        ViewTransform view(strip_rows, num_columns);
+        apply_view_effect(view, step);
+        strip = materialize_view(strip, view);
+        alpha = alpha.empty() ? alpha : materialize_view(alpha, view);
+        if (view.row_step[0] < 0)
+        {
+            first_row = num_rows - first_row - strip_rows;
+        }
+        return true;
+    }
+    return visit_point_filter(step, num_rows, num_columns, [&](const auto& filter)
+    {
+        apply_filter_in_place(strip, filter);
+    });
+}
+
+
+/**
+    Applies an effect chain to a BMP file one strip of rows at a time, writing a BMP
+    file: each strip is read with one pread, run through the chain and written with
+    one pwrite at its place in the output, which is preallocated to its final size.
+    The result is the same as that of the whole image at any strip height.
+
+    @param input_filename: Name of the input BMP file.
+    @param output_filename: Name of the output BMP file.
+    @param chain: The effects to apply, in order; is_strip_effect() must hold for each.
+    @param strip_rows: Input rows in each strip.
+    @returns true if the output file was written, false otherwise.
+*/
+bool process_file_strips(const string& input_filename, const string& output_filename,
+                         const vector<EffectStep>& chain, int strip_rows)
+{
+    int input_fd = open(input_filename.c_str(), O_RDONLY | O_CLOEXEC);
+    BmpInfo info;
+    if (input_fd < 0 || !read_bmp_file_info(input_fd, info))
+    {
+        if (input_fd >= 0)
+        {
+            close(input_fd);
+        }
+        return false;
+    }
+
+    // Crops are clipped to the image they apply to, and crops outside it are dropped, as they are on whole images
+    vector<EffectStep> steps;
+    pair<int, int> dimensions(info.height, info.width);
+    for (const EffectStep& step : chain)
+    {
+        ViewTransform view(dimensions.first, dimensions.second);
+        if (step.choice == 19 && !view.crop(step.crop))
+        {
+            cerr << "Crop region lies outside the image. Returning original image." << endl;
+            continue;
+        }
+        steps.push_back(step);
+        if (step.choice == 19)
+        {
+            steps.back().crop.num_rows = view.num_rows;
+            steps.back().crop.num_columns = view.num_columns;
+        }
+        dimensions = effect_output_dimensions(dimensions.first, dimensions.second, step);
+    }
+
+    // Whether the alpha is unused takes a pass over the file to tell
+    bool has_alpha = bmp_has_alpha(info);
+    bool failed = false;
+    if (bmp_alpha_may_be_unused(info))
+    {
+        has_alpha = false;
+        vector<vector<Pixel>> strip = initialize_new_image(min(strip_rows, info.height), info.width);
+        AlphaPlane alpha = initialize_alpha_plane(strip.size(), info.width);
+        for (int first = 0; first < info.height && !has_alpha && !failed; first += strip_rows)
+        {
+            int last = min(info.height, first + strip_rows);
+            failed = !read_bmp_rows(input_fd, info, first, last, strip.data(), alpha.data());
+            alpha.resize(last - first);
+            has_alpha = !is_alpha_plane_zero(alpha);
+        }
+    }
+
+    size_t row_bytes;
+    vector<unsigned char> header = encode_bmp_header(dimensions.second, dimensions.first, has_alpha, row_bytes);
+    size_t file_size = header.size() + row_bytes * dimensions.first;
+    int output_fd = failed ? -1 : open(output_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    failed = output_fd < 0 || (posix_fallocate(output_fd, 0, file_size) != 0 && ftruncate(output_fd, file_size) != 0) ||
+             !pwrite_fully(output_fd, header.data(), header.size(), 0);
+
+    for (int first = 0; first < info.height && !failed; first += strip_rows)
+    {
+        int last = min(info.height, first + strip_rows);
+        vector<vector<Pixel>> strip = initialize_new_image(last - first, info.width);
+        AlphaPlane alpha = has_alpha ? initialize_alpha_plane(last - first, info.width) : AlphaPlane();
+        failed = !read_bmp_rows(input_fd, info, first, last, strip.data(), has_alpha ? alpha.data() : nullptr);
+
+        int first_row = first;
+        int num_rows = info.height;
+        int num_columns = info.width;
+        for (const EffectStep& step : steps)
+        {
+            if (failed || strip.empty())
+            {
+                break;
+            }
+            failed = !apply_strip_effect(step, strip, alpha, first_row, num_rows, num_columns);
+        }
+        if (failed || strip.empty())
+        {
+            continue;
+        }
+
+        // Result rows [first_row, first_row + count) are stored bottom-up as one block
+        int count = strip.size();
+        vector<unsigned char> rows(row_bytes * count, 0);
+        for (int row = 0; row < count; row++)
+        {
+            encode_bmp_row(strip[row], has_alpha ? &alpha[row] : nullptr, rows.data() + row_bytes * (count - 1 - row));
+        }
+        failed = !pwrite_fully(output_fd, rows.data(), rows.size(),
+                               header.size() + row_bytes * (dimensions.first - first_row - count));
+    }
+
+    close(input_fd);
+    return output_fd >= 0 && close(output_fd) == 0 && !failed;
+}
+
+
+//***************************************************************************************************//
+//                                      BATCH MODE                                                  //
+
+/**
+    Options given to the batch pipeline before the effect chain.
+*/
+struct BatchOptions
+{
+    bool has_region = false;  // --roi x,y,width,height: apply the chain to this region only
+    Region region;
+    int queue_depth = DEFAULT_QUEUE_DEPTH;  // --queue-depth n: file reads and writes in progress at once
+    int max_in_flight = DEFAULT_MAX_IN_FLIGHT;  // --max-in-flight n: files being processed at once
+    string cache_directory;                     // --cache dir: reuse results stored in this directory
+    unsigned long long cache_megabytes = DEFAULT_CACHE_MEGABYTES;  // --cache-size n: megabytes the cache is kept under
+    unsigned long long memory_megabytes = 0;  // --memory-budget n: megabytes of images held at once (0: half the physical memory)
+};
+
+
+/**
+    Parses one of the options shared by batch mode, the daemon and the interactive
+    dialog. Each takes a single value.
+
+    @param option: The option's name, such as "--queue-depth".
+    @param value: The argument following it.
+    @param options: Receives the option.
+    @returns true if the option and its value are valid, false otherwise.
+*/
+bool parse_pipeline_option(const string& option, const string& value, BatchOptions& options)
+{
+    stringstream value_stream(value);
+    if (option == "--queue-depth")
+    {
+        return value_stream >> options.queue_depth && options.queue_depth > 0;
+    }
+    if (option == "--max-in-flight")
+    {
+        return value_stream >> options.max_in_flight && options.max_in_flight > 0;
+    }
+    if (option == "--cache")
+    {
+        options.cache_directory = value;
+        return !value.empty();
+    }
+    if (option == "--cache-size")
+    {
+        return value_stream >> options.cache_megabytes && options.cache_megabytes > 0;
+    }
+    if (option == "--memory-budget")
+    {
+        return value_stream >> options.memory_megabytes && options.memory_megabytes > 0;
+    }
+    return false;
+}
+
+
+/**
+    Opens the result cache the options ask for.
+
+    @returns The cache, or null if no cache directory was given.
+*/
+unique_ptr<ResultCache> open_result_cache(const BatchOptions& options)
+{
+    if (options.cache_directory.empty())
+    {
+        return nullptr;
+    }
+    return make_unique<ResultCache>(options.cache_directory, options.cache_megabytes << 20);
+}
+
+
+/**
+    Gives the memory budget of the batch pipeline: the one given in the options, or by
+    default half of the machine's physical memory.
+
+    @returns The budget in bytes.
+*/
+unsigned long long memory_budget_bytes(const BatchOptions& options)
+{
+    if (options.memory_megabytes > 0)
+    {
+        return options.memory_megabytes << 20;
+    }
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages <= 0 || page_size <= 0)
+    {
+        return MIN_MEMORY_BUDGET;
+    }
+    return max(MIN_MEMORY_BUDGET, static_cast<unsigned long long>(pages) * page_size / 2);
+}
+
+
+/**
+    Applies an effect chain to a region of one image file. When both files are BMPs
+    in a format that can be patched in place, the input file is copied and only the
+    scanlines covering the region are read, processed and rewritten; otherwise the
+    whole image is decoded, and only the region is cut out, processed and copied back.
+
+    @param input_filename: Name of the input image file.
+    @param output_filename: Name of the output image file.
+    @param chain: The effects to apply, in order; all must support regions.
+    @param requested_region: The region to modify; clipped to the image.
+    @returns true if the output file was written, false otherwise.
+*/
+bool process_file_region(const string& input_filename, const string& output_filename,
+                         const vector<EffectStep>& chain, const Region& requested_region)
+{
+    for (const EffectStep& step : chain)
+    {
+        if (!effect_supports_region(step.choice))
+        {
+            cerr << "Error: Effect " << step.choice << " cannot be applied to a region." << endl;
+            return false;
+        }
+    }
+
+    Region region = requested_region;
+    BmpInfo info;
+    vector<vector<Pixel>> patch;
+    if (!has_extension(output_filename, NYK_EXTENSION))
+    {
+        patch = read_bmp_region(input_filename, region, info);
+    }
+    if (!patch.empty() && bmp_region_writable(info))
+    {
+        for (const EffectStep& step : chain)
+        {
+            patch = apply_effect(patch, step);
+        }
+        error_code error;
+        filesystem::copy_file(input_filename, output_filename, filesystem::copy_options::overwrite_existing, error);
+        return !error && write_bmp_region(output_filename, patch, region, info);
+    }
+
+    // Any other combination of formats decodes the whole image and patches it in memory
+    AlphaPlane alpha;
+    vector<vector<Pixel>> image = read_image_file(input_filename, &alpha);
+    region = requested_region;
+    if (image.empty() || !clip_region(region, image.size(), image[0].size()))
+    {
+        return false;
+    }
+    patch = copy_region(image, region);
+    for (const EffectStep& step : chain)
+    {
+        patch = apply_effect(patch, step);
+    }
+    paste_region(image, patch, region);
+    return write_image_file(output_filename, image, alpha);
+}
+
+
+/**
+    Applies an effect chain to one image file.
+
+    @param input_filename: Name of the input image file.
+    @param output_filename: Name of the output image file.
+    @param chain: The effects to apply, in order.
+    @param options: Batch options.
+    @returns true if the output file was written, false otherwise.
+*/
+bool process_file(const string& input_filename, const string& output_filename,
+                  const vector<EffectStep>& chain, const BatchOptions& options)
+{
+    if (options.has_region)
+    {
+        return process_file_region(input_filename, output_filename, chain, options.region);
+    }
+
+    AlphaPlane alpha;
+    vector<vector<Pixel>> image = read_image_file(input_filename, &alpha);
+    if (image.empty())
+    {
+        cerr << "Error: Unable to read " << input_filename << "." << endl;
+        return false;
+    }
+
+    EffectGraph graph(chain);
+    graph.optimize();
+    return write_image_view(output_filename, graph.evaluate_view(ImageHandle(move(image), move(alpha))));
+}
+
+
+// Called when a file's task ends, with an error message or an empty string on success
+using FileTaskCallback = function<void(const string&)>;
+
+
+/**
+    File I/O and memory limits shared by the coroutines processing files, kept for
+    one batch run or for the whole life of the daemon.
+*/
+struct BatchPipeline
+{
+    AsyncFileIo io;
+    AsyncSemaphore file_slots;    // Bounds the number of files being processed
+    AsyncMemoryBudget memory;     // Bounds the bytes those files hold, from each job's memory plan
+    unique_ptr<ResultCache> cache;  // Null when results are not cached
+    mutex graphs_mutex;
+    map<string, shared_ptr<const EffectGraph>> graphs;  // Optimized graphs by chain, so baked tables are reused
+
+    explicit BatchPipeline(const BatchOptions& options)
+        : io(options.queue_depth), file_slots(options.max_in_flight), memory(memory_budget_bytes(options)),
+          cache(open_result_cache(options))
+    {
+    }
+};
+
+
+// Optimized effect graphs a pipeline keeps before it starts over
+const size_t GRAPH_CACHE_ENTRIES = 64;
+
+
+/**
+    Returns the optimized graph of an effect chain, shared by every file the pipeline
+    runs the same chain over.
+
+    @param pipeline: The pipeline the files run on.
+    @param chain: The effects to apply, in order.
+    @returns The graph.
+*/
+shared_ptr<const EffectGraph> pipeline_graph(BatchPipeline& pipeline, const vector<EffectStep>& chain)
+{
+    string key;
+    for (const EffectStep& step : chain)
+    {
+        key += effect_step_key(step) + ",";
+    }
+    lock_guard<mutex> lock(pipeline.graphs_mutex);
+    auto found = pipeline.graphs.find(key);
+    if (found != pipeline.graphs.end())
+    {
+        return found->second;
+    }
+    if (pipeline.graphs.size() >= GRAPH_CACHE_ENTRIES)
+    {
+        pipeline.graphs.clear();
+    }
+    shared_ptr<EffectGraph> graph = make_shared<EffectGraph>(chain);
+    graph->optimize();
+    pipeline.graphs[key] = graph;
+    return graph;
+}
+
+
+/**
+    Processes one file as a coroutine: waits for a free slot and for the memory its
+    plan needs, reads the input, applies the chain, writes the output and reports. It
+    suspends while its file is being read or written, leaving the scheduler's threads
+    free for other files. A file too large for the memory budget is run in strips
+    when its chain allows, and otherwise waits for the whole budget.
+
+    @param pipeline: The pipeline this file runs on.
+    @param chain: The effects to apply, in order.
+    @param input_filename: Name of the input image file.
+    @param output_filename: Name of the output image file.
+    @param on_done: Called last, once the output has been written or the job has failed.
+*/
+DetachedTask process_file_task(BatchPipeline& pipeline, vector<EffectStep> chain, string input_filename,
+                               string output_filename, FileTaskCallback on_done)
+{
+    co_await pipeline.file_slots.acquire();
+
+    // Files that cannot be planned are left for the reader below to report
+    string error;
+    ImageShape shape;
+    MemoryPlan plan;
+    bool planned = read_image_shape(input_filename, shape);
+    if (planned && !plan_job_memory(shape, chain, pipeline.cache != nullptr, plan))
+    {
+        error = "Error: " + input_filename + " would be too large after the effect chain.";
+    }
+    unsigned long long reserved = planned ? plan.peak_bytes : 0;
+    int strip_rows = 0;
+    if (error.empty() && reserved > pipeline.memory.capacity())
+    {
+        if (plan.strip_row_bytes > 0 && !has_extension(output_filename, NYK_EXTENSION))
+        {
+            unsigned long long strip_bytes = min(STRIP_TARGET_BYTES, pipeline.memory.capacity());
+            strip_rows = static_cast<int>(clamp<unsigned long long>(strip_bytes / plan.strip_row_bytes, 1, shape.num_rows));
+            reserved = strip_rows * plan.strip_row_bytes;
+        }
+        else
+        {
+            cerr << "Warning: " << input_filename << " needs about " << (reserved >> 20)
+                 << " MB, more than the memory budget; it runs alone." << endl;
+        }
+    }
+    co_await pipeline.memory.acquire(reserved);
+
+    vector<unsigned char> bytes;
+    AlphaPlane alpha;
+    vector<vector<Pixel>> image;
+    if (error.empty() && strip_rows == 0)
+    {
+        bytes = co_await FileReadAwaiter(pipeline.io, input_filename);
+        image = decode_image_bytes(bytes, &alpha);
+        bytes = vector<unsigned char>();
+    }
+
+    if (error.empty() && strip_rows > 0)
+    {
+        // Strips are read and written as they are processed, so the result cache is left out
+        if (!process_file_strips(input_filename, output_filename, chain, strip_rows))
+        {
+            error = "Error: Unable to process " + input_filename + " into " + output_filename + ".";
+        }
+    }
+    else if (error.empty() && image.empty())
+    {
+        error = "Error: Unable to read " + input_filename + ".";
+    }
+    else if (error.empty())
+    {
+        // A cached result replaces running the chain; a new one is stored for next time
+        ImageView result(ImageHandle(move(image), move(alpha)));
+        unsigned long long key = 0;
+        bool cached = false;
+        if (pipeline.cache)
+        {
+            key = result_cache_key(result.image.pixels(), result.image.alpha(), chain);
+            bytes = co_await FileReadAwaiter(pipeline.io, pipeline.cache->entry_path(key));
+            cached = pipeline.cache->decode_entry(key, bytes, image, alpha);
+            bytes = vector<unsigned char>();
+            if (cached)
+            {
+                result = ImageView(ImageHandle(move(image), move(alpha)));
+            }
+        }
+        if (!cached)
+        {
+            result = pipeline_graph(pipeline, chain)->evaluate_view(move(result.image));
+        }
+        if (!cached && pipeline.cache)
+        {
+            // Stored entries are whole images, so a view left by the chain is made into one here
+            ImageHandle stored = release_view(result);
+            string temp_filename = pipeline.cache->temp_path(key);
+            vector<unsigned char> entry = encode_nyk(stored.pixels(), stored.alpha());
+            unsigned long long entry_size = entry.size();
+            result = ImageView(move(stored));
+            if (co_await FileWriteAwaiter(pipeline.io, temp_filename, move(entry)))
+            {
+                pipeline.cache->add_entry(key, temp_filename, entry_size);
+            }
+        }
+        bytes = encode_image_view(output_filename, move(result));
+        result = ImageView();
+        if (!co_await FileWriteAwaiter(pipeline.io, output_filename, move(bytes)))
+        {
+            error = "Error: Unable to write " + output_filename + ".";
+        }
+    }
+
+    pipeline.memory.release(reserved);
+    pipeline.file_slots.release();
+    on_done(error);
+}
+
+
+/**
+    Names a file by its normalized absolute path, so "b.bmp" and "./b.bmp" compare equal.
+*/
+string job_file_key(const string& filename)
+{
+    error_code error;
+    filesystem::path path = filesystem::absolute(filename, error);
+    if (error)
+    {
+        return filename;
+    }
+    filesystem::path canonical = filesystem::weakly_canonical(path, error);
+    return error ? path.lexically_normal().string() : canonical.string();
+}
+
+
+/**
+    Orders a sequence of jobs by the files they share, so running them concurrently
+    gives the same files as running them one after another. A job reading a file waits
+    for the last earlier job writing it, and a job writing a file waits for the earlier
+    jobs reading or writing it since it was last written. Jobs are numbered from 0 in
+    the order they are added.
+*/
+struct JobFileOrder
+{
+    map<string, size_t> last_writer;
+    map<string, vector<size_t>> readers;  // Jobs reading each file since its last writer
+    size_t num_jobs = 0;
+
+    /**
+        Adds the next job.
+
+        @param input_filename: Name of the job's input file.
+        @param output_filename: Name of the job's output file.
+        @returns The numbers of the earlier jobs it must wait for.
+    */
+    vector<size_t> add(const string& input_filename, const string& output_filename)
+    {
+        size_t index = num_jobs++;
+        string input = job_file_key(input_filename);
+        string output = job_file_key(output_filename);
+        vector<size_t> waits;
+
+        auto writer = last_writer.find(input);
+        if (writer != last_writer.end())
+        {
+            waits.push_back(writer->second);
+        }
+        writer = last_writer.find(output);
+        if (writer != last_writer.end())
+        {
+            waits.push_back(writer->second);
+        }
+        vector<size_t>& output_readers = readers[output];
+        waits.insert(waits.end(), output_readers.begin(), output_readers.end());
+        output_readers.clear();
+
+        readers[input].push_back(index);
+        last_writer[output] = index;
+        sort(waits.begin(), waits.end());
+        waits.erase(unique(waits.begin(), waits.end()), waits.end());
+        return waits;
+    }
+};
+
+
+/**
+    Works out which earlier jobs each job of a batch must wait for (see JobFileOrder).
+
+    @param jobs: Input and output filename pairs, in order.
+    @returns For each job, the indices of the jobs it waits for.
+*/
+vector<vector<size_t>> batch_job_dependencies(const vector<pair<string, string>>& jobs)
+{
+    JobFileOrder order;
+    vector<vector<size_t>> waits_for;
+    for (const pair<string, string>& job : jobs)
+    {
+        waits_for.push_back(order.add(job.first, job.second));
+    }
+    return waits_for;
+}
+
+
+/**
+    Runs the effect chain over a list of jobs, one coroutine per file. Files are read,
+    processed and written concurrently, except that a job whose input is an earlier
+    job's output (or which writes a file an earlier job reads or writes) starts only
+    once that job has finished. Reports are printed as files finish, so their order
+    may differ from the order of the jobs.
+
+    @param jobs: Input and output filename pairs.
+    @param chain: The effects to apply, in order.
+    @param options: Batch options.
+    @returns Number of jobs that failed.
+*/
+int run_batch_jobs(const vector<pair<string, string>>& jobs, const vector<EffectStep>& chain, const BatchOptions& options)
+{
+    BatchPipeline pipeline(options);
+    TaskGroup finished(jobs.size());  // One task per file
+    mutex report_mutex;               // Keeps progress lines whole and guards the waiting counts
+    int failures = 0;
+
+    vector<vector<size_t>> dependents(jobs.size());
+    vector<size_t> waiting(jobs.size());
+    vector<vector<size_t>> waits_for = batch_job_dependencies(jobs);
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        waiting[index] = waits_for[index].size();
+        for (size_t earlier : waits_for[index])
+        {
+            dependents[earlier].push_back(index);
+        }
+    }
+
+    // A finished job starts the jobs that were waiting only for it
+    function<void(size_t)> start_job = [&](size_t index)
+    {
+        const pair<string, string>& job = jobs[index];
+        process_file_task(pipeline, chain, job.first, job.second, [&, index](const string& error)
+        {
+            vector<size_t> ready;
+            {
+                lock_guard<mutex> lock(report_mutex);
+                if (error.empty())
+                {
+                    cout << jobs[index].first << " -> " << jobs[index].second << endl;
+                }
+                else
+                {
+                    cerr << error << endl;
+                    failures++;
+                }
+                for (size_t dependent : dependents[index])
+                {
+                    if (--waiting[dependent] == 0)
+                    {
+                        ready.push_back(dependent);
+                    }
+                }
+            }
+            for (size_t next : ready)
+            {
+                start_job(next);
+            }
+            task_scheduler().finish(finished);
+        });
+    };
+    for (size_t index = 0; index < jobs.size(); index++)
+    {
+        if (waiting[index] == 0)
+        {
+            start_job(index);
+        }
+    }
+    task_scheduler().wait(finished);
+
+    if (pipeline.cache)
+    {
+        cout << "Result cache: " << pipeline.cache->hit_count() << " hits, " << pipeline.cache->miss_count() << " misses" << endl;
+    }
+    return failures;
+}
+
+
+/**
+    Runs the batch pipeline: applies an effect chain to a list of input/output file pairs
+    without any prompts. Usage:
+        program --batch [options] <effect chain> <input> <output> [<input> <output> ...]
+    Options:
+        --roi x,y,width,height   apply the chain to this region only
+        --queue-depth n          file reads and writes in progress at once (default 4)
+        --max-in-flight n        files being processed at once (default 64)
+        --cache dir              reuse results stored in dir, storing new ones there
+        --cache-size n           megabytes the result cache is kept under (default 1024)
+        --memory-budget n        megabytes of images held in memory at once (default half the physical memory)
+
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 if every image was processed, 1 otherwise.
+*/
+int run_batch(int argc, char* argv[])
+{
+    BatchOptions options;
+    int arg = 2;
+    for (; arg < argc && string(argv[arg]).rfind("--", 0) == 0; arg++)
+    {
+        string option = argv[arg];
+        string value = (arg + 1 < argc) ? argv[arg + 1] : "";
+        if (option == "--roi" && parse_region(value, options.region))
+        {
+            options.has_region = true;
+            arg++;
+        }
+        else if (parse_pipeline_option(option, value, options))
+        {
+            arg++;
+        }
+        else
+        {
+            cerr << "Error: Invalid batch option '" << option << "'." << endl;
+            return 1;
+        }
+    }
+
+    vector<EffectStep> chain;
+    if (argc - arg < 3 || (argc - arg - 1) % 2 != 0)
+    {
+        cerr << "Usage: " << argv[0] << " --batch [--roi x,y,width,height] [--queue-depth n] [--max-in-flight n] [--cache dir] [--cache-size n] [--memory-budget n] <effect chain> <input> <output> [<input> <output> ...]" << endl;
+        return 1;
+    }
+    if (!parse_effect_chain(argv[arg], chain))
+    {
+        return 1;
+    }
+
+    int failures = 0;
+    vector<pair<string, string>> jobs;
+    for (int i = arg + 1; i < argc; i += 2)
+    {
+        if (string(argv[i]) == argv[i + 1] || job_file_key(argv[i]) == job_file_key(argv[i + 1]))
+        {
+            cerr << "Error: Input and Output filenames are the same for " << argv[i] << "." << endl;
+            failures++;
+            continue;
+        }
+        jobs.emplace_back(argv[i], argv[i + 1]);
+    }
+
+    if (!options.has_region)
+    {
+        failures += run_batch_jobs(jobs, chain, options);
+        return failures == 0 ? 0 : 1;
+    }
+
+    // Region jobs patch files in place and run one at a time
+    for (const pair<string, string>& job : jobs)
+    {
+        if (!process_file(job.first, job.second, chain, options))
+        {
+            cerr << "Error: Unable to process " << job.first << " into " << job.second << "." << endl;
+            failures++;
+            continue;
+        }
+        cout << job.first << " -> " << job.second << endl;
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+
+/**
+    Bakes an effect chain of color effects into a .cube 3D lookup table, so other tools
+    (or effect 15) can apply the whole chain as one color grade. Usage:
+        program --bake-lut <effect chain> <output.cube> [lattice size, default 33]
+
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 if the table was written, 1 otherwise.
+*/
+int run_bake_lut(int argc, char* argv[])
+{
+    int size = DEFAULT_CUBE_SIZE;
+    if (argc == 5)
+    {
+        stringstream converter(argv[4]);
+        if (!(converter >> size) || !(converter >> ws).eof() || size < 2 || size > MAX_CUBE_SIZE)
+        {
+            cerr << "Error: The lattice size must be from 2 to " << MAX_CUBE_SIZE << "." << endl;
+            return 1;
+        }
+    }
+    else if (argc != 4)
+    {
+        cerr << "Usage: " << argv[0] << " --bake-lut <effect chain> <output.cube> [lattice size]" << endl;
+        return 1;
+    }
+
+    vector<EffectStep> chain;
+    if (!parse_effect_chain(argv[2], chain))
+    {
+        return 1;
+    }
+    for (const EffectStep& step : chain)
+    {
+        if (!is_pure_color_node(EffectNode{step, nullptr}))
+        {
+            cerr << "Error: Effect " << step.choice << " is not a color effect and cannot be baked." << endl;
+            return 1;
+        }
+    }
+
+    // One pixel per lattice point: a row per red and green pair, a column per blue
+    vector<vector<Pixel>> lattice(size * size, vector<Pixel>(size));
+    auto level = [size](int i)
+    {
+        return static_cast<int>(lround(i * 255.0 / (size - 1)));
+    };
+    for (int red = 0; red < size; red++)
+    {
+        for (int green = 0; green < size; green++)
+        {
+            for (int blue = 0; blue < size; blue++)
+            {
+                lattice[red * size + green][blue] = Pixel{level(red), level(green), level(blue)};
+            }
+        }
+    }
+
+    EffectGraph graph(chain);
+    graph.optimize();
+    ImageHandle result = graph.evaluate(ImageHandle(move(lattice)));
+
+    ColorLut3D lut;
+    lut.size = size;
+    lut.nodes.reserve(4 * static_cast<size_t>(size) * size * size);
+    for (const vector<Pixel>& row : result.pixels())
+    {
+        for (const Pixel& p : row)
+        {
+            lut.nodes.insert(lut.nodes.end(), {static_cast<float>(p.red), static_cast<float>(p.green),
+                                               static_cast<float>(p.blue), 0.0f});
+        }
+    }
+    if (!save_cube_file(argv[3], lut, argv[2]))
+    {
+        cerr << "Error: Unable to write " << argv[3] << "." << endl;
+        return 1;
+    }
+    cout << "Baked " << argv[2] << " into " << argv[3] << " (" << size << "x" << size << "x" << size << ")" << endl;
+    return 0;
+}
+
+
+//***************************************************************************************************//
+//                                      STREAM MODE                                                 //
+//
+// Stream mode reads BMP frames back to back from standard input, applies the effect
+// chain to each and writes the results back to back to standard output, so the program
+// can sit in a shell pipeline between a capture tool and an encoder. A reader thread
+// and a writer thread each own two frame buffers: frame N+1 is read and frame N-1 is
+// written while frame N is processed. Buffers go back and forth between the threads
+// instead of being freed, and the decoded image is kept for the next frame, so frames
+// of the same size allocate nothing after the first.
+
+// Frame buffers in flight between each I/O thread and the processing thread (double buffering)
+const size_t STREAM_FRAME_BUFFERS = 2;
+
+// Largest BMP header (file header, DIB header and palette) accepted in a stream
+const size_t MAX_STREAM_HEADER_BYTES = 1 << 16;
+
+// Largest frame accepted in a stream
+const size_t MAX_STREAM_FRAME_BYTES = size_t(1) << 34;
+
+
+/**
+    Bounded queue of frame buffers passed between threads. Frames are moved in and out,
+    so their memory is handed over rather than copied.
+*/
+class FrameQueue
+{
+public:
+    /**
+        Adds a frame, waiting while the queue is full.
+
+        @param frame: The frame, moved into the queue.
+        @returns false if the queue was closed (the frame is then left as it was).
+    */
+    bool push(vector<unsigned char>& frame)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        changed.wait(lock, [this] { return closed || frames.size() < STREAM_FRAME_BUFFERS; });
+        if (closed)
+        {
+            return false;
+        }
+        frames.push_back(move(frame));
+        changed.notify_all();
+        return true;
+    }
+
+    /**
+        Takes the oldest frame, waiting while the queue is empty.
+
+        @param frame: Receives the frame.
+        @returns false once the queue is closed and empty.
+    */
+    bool pop(vector<unsigned char>& frame)
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        changed.wait(lock, [this] { return closed || !frames.empty(); });
+        if (frames.empty())
+        {
+            return false;
+        }
+        frame = move(frames.front());
+        frames.pop_front();
+        changed.notify_all();
+        return true;
+    }
+
+    /**
+        Wakes every waiting thread; frames already queued can still be popped.
+    */
+    void close()
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        closed = true;
+        changed.notify_all();
+    }
+
+private:
+    mutex queue_mutex;
+    condition_variable changed;
+    deque<vector<unsigned char>> frames;
+    bool closed = false;
+};
+
+
+/**
+    Reads up to size bytes, stopping early only at the end of the input.
+
+    @returns The number of bytes read, or -1 on a read error.
+*/
+ssize_t read_fully(int fd, unsigned char* buffer, size_t size)
+{
+    size_t total = 0;
+    while (total < size)
+    {
+        ssize_t count = read(fd, buffer + total, size - total);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            return -1;
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        total += count;
+    }
+    return total;
+}
+
+
+/**
+    Writes all of a buffer, retrying short and interrupted writes.
+
+    @returns true if every byte was written.
+*/
+bool write_fully(int fd, const unsigned char* buffer, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t count = write(fd, buffer, size);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        buffer += count;
+        size -= count;
+    }
+    return true;
+}
+
+
+/**
+    Reads the next BMP frame of a stream. The frame ends after its pixel array, or at
+    the file size its header gives if that is larger.
+
+    @param fd: The stream.
+    @param frame: Receives the frame; its memory is reused.
+    @param error: Set to a message if the stream holds something other than a whole frame.
+    @returns true if a frame was read, false at the end of the stream or on an error.
+*/
+bool read_bmp_frame(int fd, vector<unsigned char>& frame, string& error)
+{
+    // File header and the DIB header size give where the pixel array starts
+    const size_t PREFIX_SIZE = 18;
+    frame.resize(PREFIX_SIZE);
+    ssize_t count = read_fully(fd, frame.data(), PREFIX_SIZE);
+    if (count == 0)
+    {
+        return false;
+    }
+    size_t pixel_offset = (count == PREFIX_SIZE) ? get_uint(frame.data(), 10, 4) : 0;
+    if (count != PREFIX_SIZE || frame[0] != 'B' || frame[1] != 'M' ||
+        pixel_offset < 14 + get_uint(frame.data(), 14, 4) || pixel_offset > MAX_STREAM_HEADER_BYTES)
+    {
+        error = "Error: Invalid BMP frame header.";
+        return false;
+    }
+
+    BmpInfo info;
+    frame.resize(max<size_t>(pixel_offset, 54));
+    if (read_fully(fd, frame.data() + PREFIX_SIZE, frame.size() - PREFIX_SIZE) != static_cast<ssize_t>(frame.size() - PREFIX_SIZE) ||
+        !parse_bmp_header(frame.data(), frame.size(), MAX_STREAM_FRAME_BYTES, info))
+    {
+        error = "Error: Unsupported or truncated BMP frame.";
+        return false;
+    }
+
+    size_t header_size = frame.size();
+    size_t frame_size = max<size_t>(info.pixel_offset + info.row_stride * info.height, get_uint(frame.data(), 2, 4));
+    frame.resize(frame_size);
+    if (read_fully(fd, frame.data() + header_size, frame_size - header_size) != static_cast<ssize_t>(frame_size - header_size))
+    {
+        error = "Error: Truncated BMP frame.";
+        return false;
+    }
+    return true;
+}
+
+
+/**
+    Frame buffers and queues shared by the stream threads. Owned jointly by the threads,
+    so a reader still blocked on its input can be left behind when processing stops early.
+*/
+struct StreamState
+{
+    FrameQueue input_free;     // Empty buffers for the reader
+    FrameQueue input_ready;    // Frames read, waiting to be processed
+    FrameQueue output_free;    // Empty buffers for the processing thread
+    FrameQueue output_ready;   // Processed frames, waiting to be written
+    string read_error;
+    atomic<bool> write_failed{false};
+};
+
+
+/**
+    Applies an effect chain to every BMP frame on standard input and writes the results
+    to standard output. Usage:
+        program --stream <effect chain>
+    Output frames are 24 bpp, or 32 bpp for frames with alpha.
+
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 if every frame was processed and written, 1 otherwise.
+*/
+int run_stream(int argc, char* argv[])
+{
+    vector<EffectStep> chain;
+    if (argc != 3)
+    {
+        cerr << "Usage: " << argv[0] << " --stream <effect chain> < frames.bmp > output.bmp" << endl;
+        return 1;
+    }
+    if (!parse_effect_chain(argv[2], chain))
+    {
+        return 1;
+    }
+    EffectGraph graph(chain);
+    graph.optimize();
+
+    shared_ptr<StreamState> state = make_shared<StreamState>();
+    for (size_t i = 0; i < STREAM_FRAME_BUFFERS; i++)
+    {
+        vector<unsigned char> input_buffer;
+        vector<unsigned char> output_buffer;
+        state->input_free.push(input_buffer);
+        state->output_free.push(output_buffer);
+    }
+
+    thread reader([state]
+    {
+        vector<unsigned char> frame;
+        while (state->input_free.pop(frame) && read_bmp_frame(STDIN_FILENO, frame, state->read_error) &&
+               state->input_ready.push(frame))
+        {
+        }
+        state->input_ready.close();
+    });
+    thread writer([state]
+    {
+        vector<unsigned char> frame;
+        while (state->output_ready.pop(frame))
+        {
+            if (!write_fully(STDOUT_FILENO, frame.data(), frame.size()))
+            {
+                state->write_failed = true;
+                state->output_free.close();
+                state->output_ready.close();
+                break;
+            }
+            state->output_free.push(frame);
+        }
+    });
+
+    // Decode, process and encode; the decoded image is handed back for reuse each time
+    vector<vector<Pixel>> pixels;
+    AlphaPlane alpha;
+    vector<unsigned char> input_frame;
+    vector<unsigned char> output_frame;
+    long num_frames = 0;
+    bool failed = false;
+    while (state->input_ready.pop(input_frame))
+    {
+        bool decoded = decode_bmp_into(input_frame.data(), input_frame.size(), pixels, &alpha);
+        state->input_free.push(input_frame);
+        if (!decoded || !state->output_free.pop(output_frame))
+        {
+            failed = true;
+            break;
+        }
+
+        ImageView result = graph.evaluate_view(ImageHandle(move(pixels), move(alpha)));
+        encode_bmp_view_into(result, output_frame);
+        alpha = result.image.release_alpha();
+        pixels = result.image.release_pixels();
+        if (!state->output_ready.push(output_frame))
+        {
+            failed = true;
+            break;
+        }
+        num_frames++;
+    }
+
+    state->output_ready.close();
+    writer.join();
+    if (failed)
+    {
+        // The reader may be waiting for input that never comes; it owns its share of the state
+        state->input_free.close();
+        state->input_ready.close();
+        reader.detach();
+    }
+    else
+    {
+        reader.join();
+    }
+
+    if (!failed && !state->read_error.empty())
+    {
+        cerr << state->read_error << " (after " << num_frames << " frames)" << endl;
+    }
+    if (state->write_failed)
+    {
+        cerr << "Error: Unable to write frame to standard output." << endl;
+    }
+    return (failed || state->write_failed || !state->read_error.empty()) ? 1 : 0;
+}
+
+
+//***************************************************************************************************//
+//                                      DAEMON MODE                                                 //
+//
+// The daemon listens on a Unix domain socket and runs jobs through one long-lived
+// pipeline, so the task scheduler, the async file I/O and the effect caches stay warm
+// between jobs. Requests and replies are lines of tab-separated fields:
+//     job <effect chain> <input> <output>   ->  ok <input> <output>  or  error <message>
+//     stats                                 ->  stats <jobs completed> <jobs failed> <cache hits> <cache misses>
+//     shutdown                              ->  ok shutdown
+// Replies to jobs are sent as the jobs finish, so they may arrive out of order.
+
+/**
+    State of a running daemon.
+*/
+struct DaemonState
+{
+    int listen_fd;
+    BatchPipeline pipeline;
+    TaskGroup running{1};         // Finished once the daemon has stopped
+    atomic<bool> stopping{false};
+    atomic<long> jobs_completed{0};
+    atomic<long> jobs_failed{0};
+    mutex clients_mutex;
+    condition_variable clients_done;
+    vector<int> client_fds;       // Connections being served
+
+    DaemonState(int listen_fd, const BatchOptions& options)
+        : listen_fd(listen_fd), pipeline(options)
+    {
+    }
+};
+
+
+/**
+    Sends one line over a socket.
+
+    @param fd: The socket.
+    @param line: The line, without its newline.
+    @returns true if the whole line was sent, false otherwise.
+*/
+bool send_line(int fd, const string& line)
+{
+    string data = line + "\n";
+    size_t sent = 0;
+    while (sent < data.size())
+    {
+        ssize_t result = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result > 0)
+        {
+            sent += result;
+        }
+        else if (!(result < 0 && errno == EINTR))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+    Receives the next line from a socket.
+
+    @param fd: The socket.
+    @param buffer: Bytes received but not yet returned; kept between calls.
+    @param line: Receives the line, without its newline.
+    @returns true if a line was received, false at the end of the stream.
+*/
+bool receive_line(int fd, string& buffer, string& line)
+{
+    size_t newline;
+    while ((newline = buffer.find('\n')) == string::npos)
+    {
+        char chunk[4096];
+        ssize_t result = recv(fd, chunk, sizeof(chunk), 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            if (buffer.empty())
+            {
+                return false;
+            }
+            newline = buffer.size();  // Last line without a newline
+            buffer += '\n';
+            break;
+        }
+        buffer.append(chunk, result);
+    }
+    line = buffer.substr(0, newline);
+    buffer.erase(0, newline + 1);
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.pop_back();
+    }
+    return true;
+}
+
+
+/**
+    Splits a protocol line into its tab-separated fields.
+*/
+vector<string> split_fields(const string& line)
+{
+    vector<string> fields;
+    stringstream line_stream(line);
+    string field;
+    while (getline(line_stream, field, '\t'))
+    {
+        fields.push_back(field);
+    }
+    return fields;
+}
+
+
+/**
+    Stops the daemon: no new connections are accepted and every connection stops
+    reading requests. Jobs already started still finish and are replied to.
+*/
+void stop_daemon(DaemonState& daemon)
+{
+    daemon.stopping = true;
+    shutdown(daemon.listen_fd, SHUT_RDWR);
+    lock_guard<mutex> lock(daemon.clients_mutex);
+    for (int fd : daemon.client_fds)
+    {
+        shutdown(fd, SHUT_RD);
+    }
+}
+
+
+// A job received on a connection, kept until it has been replied to
+struct ClientJob
+{
+    vector<EffectStep> chain;
+    string input_filename;
+    string output_filename;
+    vector<size_t> dependents;  // Later jobs of the connection waiting for this one
+    size_t waiting = 0;         // Earlier jobs this one still waits for
+    bool finished = false;
+};
+
+
+/**
+    Serves one connection: reads requests until the client stops sending, starts a
+    coroutine for each job, and closes the connection once every job has been replied to.
+    Jobs of one connection are ordered by their files as a batch is, so a job reading
+    an earlier job's output starts once that output has been written.
+
+    @param daemon: The running daemon.
+    @param fd: The connected socket.
+*/
+void serve_client(DaemonState& daemon, int fd)
+{
+    mutex jobs_mutex;              // Guards the jobs and outstanding, and keeps replies whole
+    condition_variable jobs_done;
+    int outstanding = 0;
+    deque<ClientJob> jobs;         // Every job of the connection, by number
+    JobFileOrder order;
+
+    // A finished job starts the jobs that were waiting only for it
+    function<void(size_t)> start_job = [&](size_t index)
+    {
+        vector<EffectStep> chain;
+        string input_filename;
+        string output_filename;
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            chain = move(jobs[index].chain);
+            input_filename = jobs[index].input_filename;
+            output_filename = jobs[index].output_filename;
+        }
+        process_file_task(daemon.pipeline, move(chain), input_filename, output_filename,
+                          [&, index, input_filename, output_filename](const string& error)
+        {
+            (error.empty() ? daemon.jobs_completed : daemon.jobs_failed)++;
+            vector<size_t> ready;
+            {
+                lock_guard<mutex> lock(jobs_mutex);
+                send_line(fd, error.empty() ? "ok\t" + input_filename + "\t" + output_filename : "error\t" + error);
+                jobs[index].finished = true;
+                for (size_t dependent : jobs[index].dependents)
+                {
+                    if (--jobs[dependent].waiting == 0)
+                    {
+                        ready.push_back(dependent);
+                    }
+                }
+            }
+            for (size_t next : ready)
+            {
+                start_job(next);
+            }
+            lock_guard<mutex> lock(jobs_mutex);
+            if (--outstanding == 0)
+            {
+                jobs_done.notify_all();
+            }
+        });
+    };
+
+    auto reply = [&](const string& line)
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        send_line(fd, line);
+    };
+
+    string buffer;
+    string line;
+    while (receive_line(fd, buffer, line))
+    {
+        vector<string> fields = split_fields(line);
+        if (fields.empty())
+        {
+            continue;
+        }
+        if (fields[0] == "stats" && fields.size() == 1)
+        {
+            ResultCache* cache = daemon.pipeline.cache.get();
+            reply("stats\t" + to_string(daemon.jobs_completed) + "\t" + to_string(daemon.jobs_failed) + "\t" +
+                  to_string(cache ? cache->hit_count() : 0) + "\t" + to_string(cache ? cache->miss_count() : 0));
+            continue;
+        }
+        if (fields[0] == "shutdown" && fields.size() == 1)
+        {
+            reply("ok\tshutdown");
+            stop_daemon(daemon);
+            continue;
+        }
+        if (fields[0] != "job" || fields.size() != 4)
+        {
+            reply("error\tError: Invalid request '" + line + "'.");
+            continue;
+        }
+
+        vector<EffectStep> chain;
+        string input_filename = fields[2];
+        string output_filename = fields[3];
+        if (!parse_effect_chain(fields[1], chain))
+        {
+            daemon.jobs_failed++;
+            reply("error\tError: Invalid effect chain '" + fields[1] + "'.");
+            continue;
+        }
+        if (input_filename == output_filename || job_file_key(input_filename) == job_file_key(output_filename))
+        {
+            daemon.jobs_failed++;
+            reply("error\tError: Input and Output filenames are the same for " + input_filename + ".");
+            continue;
+        }
+
+        size_t index;
+        bool ready;
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            outstanding++;
+            index = jobs.size();
+            jobs.push_back(ClientJob{move(chain), input_filename, output_filename, {}, 0, false});
+            for (size_t earlier : order.add(input_filename, output_filename))
+            {
+                if (!jobs[earlier].finished)
+                {
+                    jobs[earlier].dependents.push_back(index);
+                    jobs[index].waiting++;
+                }
+            }
+            ready = (jobs[index].waiting == 0);
+        }
+        if (ready)
+        {
+            start_job(index);
+        }
+    }
+
+    {
+        unique_lock<mutex> lock(jobs_mutex);
+        jobs_done.wait(lock, [&]() { return outstanding == 0; });
+    }
+
+    lock_guard<mutex> lock(daemon.clients_mutex);
+    daemon.client_fds.erase(find(daemon.client_fds.begin(), daemon.client_fds.end(), fd));
+    close(fd);
+    daemon.clients_done.notify_all();
+}
+
+
+/**
+    Accepts connections until the daemon stops, serving each on its own thread, then
+    waits for every connection to close and finishes the daemon's running group.
+*/
+void accept_clients(DaemonState& daemon)
+{
+    while (!daemon.stopping)
+    {
+        int fd = accept4(daemon.listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        lock_guard<mutex> lock(daemon.clients_mutex);
+        if (daemon.stopping)
+        {
+            close(fd);
+            break;
+        }
+        daemon.client_fds.push_back(fd);
+        thread(serve_client, ref(daemon), fd).detach();
+    }
+
+    {
+        unique_lock<mutex> lock(daemon.clients_mutex);
+        daemon.clients_done.wait(lock, [&]() { return daemon.client_fds.empty(); });
+    }
+    task_scheduler().finish(daemon.running);
+}
+
+
+/**
+    Fills in the address of a Unix domain socket.
+
+    @param path: Filesystem path of the socket.
+    @param address: Receives the address.
+    @returns true if the path fits in the address, false otherwise.
+*/
+bool make_socket_address(const string& path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Error: Invalid socket path '" << path << "'." << endl;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+
+/**
+    Removes a socket file left behind by a daemon that did not shut down cleanly. Only
+    a socket that refuses connections is removed: a running daemon keeps its socket,
+    and any other kind of file is left alone for bind() to fail on.
+
+    @param path: The socket path.
+    @param address: The socket address made from the path.
+*/
+void remove_stale_socket(const string& path, const sockaddr_un& address)
+{
+    struct stat file_status;
+    if (lstat(path.c_str(), &file_status) != 0 || !S_ISSOCK(file_status.st_mode))
+    {
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return;
+    }
+    bool stale = connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 && errno == ECONNREFUSED;
+    close(fd);
+    if (stale)
+    {
+        unlink(path.c_str());
+    }
+}
+
+
+/**
+    Runs the daemon until a client sends "shutdown". The socket is only accessible to
+    the user running the daemon, since its jobs read and write files as that user. Usage:
+        program --daemon <socket path> [--queue-depth n] [--max-in-flight n] [--cache dir] [--cache-size n] [--memory-budget n]
+
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 after a clean shutdown, 1 if the socket could not be opened.
+*/
+int run_daemon(int argc, char* argv[])
+{
+    BatchOptions options;
+    int arg = 3;
+    while (arg + 1 < argc && parse_pipeline_option(argv[arg], argv[arg + 1], options))
+    {
+        arg += 2;
+    }
+    sockaddr_un address;
+    if (argc < 3 || arg < argc)
+    {
+        cerr << "Usage: " << argv[0] << " --daemon <socket path> [--queue-depth n] [--max-in-flight n] [--cache dir] [--cache-size n] [--memory-budget n]" << endl;
+        return 1;
+    }
+    string path = argv[2];
+    if (!make_socket_address(path, address))
+    {
+        return 1;
+    }
+
+    remove_stale_socket(path, address);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool bound = false;
+    if (listen_fd >= 0)
+    {
+        mode_t old_mask = umask(077);  // The socket file is created with owner-only permissions
+        bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+        umask(old_mask);
+    }
+    if (!bound || listen(listen_fd, SOMAXCONN) != 0)
+    {
+        cerr << "Error: Unable to listen on " << path << ": " << strerror(errno) << "." << endl;
+        if (listen_fd >= 0)
+        {
+            close(listen_fd);
+        }
+        return 1;
+    }
+
+    {
+        DaemonState daemon(listen_fd, options);
+        cout << "Listening on " << path << " (" << daemon.pipeline.io.backend() << " file I/O)" << endl;
+        thread acceptor(accept_clients, ref(daemon));
+        task_scheduler().wait(daemon.running);  // This thread runs jobs too until the daemon stops
+        acceptor.join();
+    }
+    close(listen_fd);
+    unlink(path.c_str());
+    return 0;
+}
+
+
+/**
+    Sends requests to a running daemon and prints the replies. Usage:
+        program --submit <socket path> <effect chain> <input> <output> [<input> <output> ...]
+        program --submit <socket path> stats|shutdown
+
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 if every request succeeded, 1 otherwise.
+*/
+int run_client(int argc, char* argv[])
+{
+    sockaddr_un address;
+    bool command = (argc == 4 && (string(argv[3]) == "stats" || string(argv[3]) == "shutdown"));
+    if (!command && (argc < 6 || (argc - 4) % 2 != 0))
+    {
+        cerr << "Usage: " << argv[0] << " --submit <socket path> <effect chain> <input> <output> [<input> <output> ...]" << endl
+             << "       " << argv[0] << " --submit <socket path> stats|shutdown" << endl;
+        return 1;
+    }
+    if (!make_socket_address(argv[2], address))
+    {
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        cerr << "Error: Unable to connect to " << argv[2] << ": " << strerror(errno) << "." << endl;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+
+    // The daemon resolves paths from its own directory, so send absolute ones
+    bool sent = true;
+    if (command)
+    {
+        sent = send_line(fd, argv[3]);
+    }
+    for (int i = 4; !command && sent && i < argc; i += 2)
+    {
+        sent = send_line(fd, string("job\t") + argv[3] + "\t" + filesystem::absolute(argv[i]).string() +
+                                 "\t" + filesystem::absolute(argv[i + 1]).string());
+    }
+    shutdown(fd, SHUT_WR);
+
+    int failures = sent ? 0 : 1;
+    string buffer;
+    string line;
+    while (receive_line(fd, buffer, line))
+    {
+        vector<string> fields = split_fields(line);
+        if (fields.size() == 3 && fields[0] == "ok")
+        {
+            cout << fields[1] << " -> " << fields[2] << endl;
+        }
+        else if (fields.size() == 5 && fields[0] == "stats")
+        {
+            cout << fields[1] << " jobs completed, " << fields[2] << " failed" << endl;
+            cout << "Result cache: " << fields[3] << " hits, " << fields[4] << " misses" << endl;
+        }
+        else if (fields.size() == 2 && fields[0] == "ok")
+        {
+            cout << "Daemon is shutting down" << endl;
+        }
+        else
+        {
+            cerr << (fields.size() == 2 ? fields[1] : line) << endl;
+            failures++;
+        }
+    }
+    close(fd);
+    return failures == 0 ? 0 : 1;
+}
+
+
+//***************************************************************************************************//
+//                                        PREVIEWS                                                  //
+//
+// A preview samples every scale-th row and column of the input, reading only those rows
+// of a BMP file, so an effect can be judged in a fraction of the time it takes on the
+// full image. Effects that depend on position or distance are given the full image's
+// geometry: the vignette is computed at the full-size position of each sampled pixel,
+// crops are scaled down and blur radii shrink with the preview.
+
+/**
+    How a preview relates to the full image it stands for: preview pixel (row, col)
+    samples full image pixel (row * scale, col * scale).
+*/
+struct PreviewGeometry
+{
+    int scale = 1;
+    int num_rows = 0;     // Size of the full image
+    int num_columns = 0;
+};
+
+
+/**
+    Keeps every scale-th row and column of a 2D vector (pixels or alpha values),
+    starting with the first.
+*/
+template <typename T>
+vector<vector<T>> subsample_image(const vector<vector<T>>& source, int scale)
+{
+    vector<vector<T>> result;
+    for (size_t row = 0; row < source.size(); row += scale)
+    {
+        vector<T> kept;
+        for (size_t col = 0; col < source[row].size(); col += scale)
+        {
+            kept.push_back(source[row][col]);
+        }
+        result.push_back(move(kept));
+    }
+    return result;
+}
+
+
+/**
+    Reads a preview of an image file, at most preview_size pixels on its longer side.
+    BMP files are sampled straight from the file; other files are read whole first.
+
+    @param filename: Name of the image file.
+    @param preview_size: Longest side of the preview, in pixels.
+    @param preview: Receives the preview.
+    @param geometry: Receives the scale of the preview and the size of the full image.
+    @returns true if the preview was read, false otherwise.
+*/
+bool load_preview(const string& filename, int preview_size, ImageHandle& preview, PreviewGeometry& geometry)
+{
+    ImageShape shape;
+    if (!read_image_shape(filename, shape))
+    {
+        return false;
+    }
+    geometry.num_rows = shape.num_rows;
+    geometry.num_columns = shape.num_columns;
+    geometry.scale = max(1, (max(shape.num_rows, shape.num_columns) + preview_size - 1) / preview_size);
+
+    AlphaPlane alpha;
+    vector<vector<Pixel>> pixels;
+    if (shape.is_bmp)
+    {
+        pixels = read_bmp_subsampled(filename, geometry.scale, &alpha);
+    }
+    else
+    {
+        pixels = subsample_image(read_image_file(filename, &alpha), geometry.scale);
+        alpha = subsample_image(alpha, geometry.scale);
+    }
+    preview = ImageHandle(move(pixels), move(alpha));
+    return !preview.empty();
+}
+
+
+/**
+    Applies an effect step to a preview as if to the full image it stands for.
+
+    @param preview: The preview.
+    @param step: The effect and its parameters, as given for the full image.
+    @param geometry: The preview's geometry; updated to the full size of the result.
+    @returns The preview of the result.
+*/
+ImageHandle apply_preview_effect(ImageHandle preview, const EffectStep& step, PreviewGeometry& geometry)
+{
+    EffectStep scaled = step;
+    int scale = geometry.scale;
+    pair<int, int> dimensions = effect_output_dimensions(geometry.num_rows, geometry.num_columns, step);
+    switch (step.choice)
+    {
+        case 1:
+        {
+            // Each sampled pixel is darkened as much as the full-size pixel it stands for
+            VignetteFilter vignette{geometry.num_rows, geometry.num_columns, nullptr};
+            vector<vector<Pixel>> pixels = apply_filter(preview.pixels(), [&](const Pixel& p, int row, int col)
+            {
+                return vignette(p, min(row * scale, vignette.num_rows - 1), min(col * scale, vignette.num_columns - 1));
+            });
+            preview = ImageHandle(move(pixels), preview.alpha());
+            break;
+        }
+        case 11:
+            scaled.radius = static_cast<int>(lround(static_cast<double>(step.radius) / scale));
+            preview = (scaled.radius > 0) ? apply_effect(move(preview), scaled) : preview;
+            break;
+        case 12:
+        case 13:
+            scaled.sigma = step.sigma / scale;
+            preview = apply_effect(move(preview), scaled);
+            break;
+        case 19:
+            scaled.crop = Region{step.crop.row / scale, step.crop.col / scale, (step.crop.num_rows + scale - 1) / scale,
+                                 (step.crop.num_columns + scale - 1) / scale};
+            preview = apply_effect(move(preview), scaled);
+            break;
+        default:
+            preview = apply_effect(move(preview), step);
+    }
+    geometry.num_rows = dimensions.first;
+    geometry.num_columns = dimensions.second;
+    return preview;
+}
+
+
+/**
+    Name of the preview written for an output file: its name with the extension
+    replaced by ".preview.bmp".
+*/
+string preview_filename(const string& output_filename)
+{
+    size_t dot = output_filename.find_last_of('.');
+    size_t slash = output_filename.find_last_of('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+    {
+        return output_filename + ".preview.bmp";
+    }
+    return output_filename.substr(0, dot) + ".preview.bmp";
+}
+
+
+/**
+    Decides whether the preview may be written to its file. The input image is never
+    overwritten, and the user is asked before any other existing file is replaced,
+    except one this run has already written a preview to.
+
+    @param filename: Name of the preview file.
+    @param input_filename: Name of the input image file.
+    @returns true if the preview may be written.
+*/
+bool preview_file_free(const string& filename, const string& input_filename)
+{
+    if (filename == input_filename || job_file_key(filename) == job_file_key(input_filename))
+    {
+        cout << "The preview would overwrite the input image " << input_filename << ", so it is not written." << endl;
+        return false;
+    }
+    static set<string> preview_files;  // Files this run may keep writing previews to
+    string key = job_file_key(filename);
+    error_code error;
+    if (preview_files.count(key) == 0 && filesystem::exists(filename, error))
+    {
+        string answer;
+        cout << filename << " already exists. Overwrite it with the preview? (y/n): \n";
+        getline(cin, answer);
+        if (answer != "y" && answer != "Y")
+        {
+            return false;
+        }
+    }
+    preview_files.insert(key);
+    return true;
+}
+
+
+/**
+    Applies an effect to a preview, writes it next to the output file and asks the user
+    whether to process the full image as well.
+
+    @param preview: The preview of the input image.
+    @param geometry: The preview's geometry.
+    @param step: The chosen effect and its parameters.
+    @param input_filename: Name of the input image file, which the preview must not replace.
+    @param output_filename: Name of the full-quality output file.
+    @returns true if the user asked for the full-quality image.
+*/
+bool offer_preview(const ImageHandle& preview, PreviewGeometry geometry, const EffectStep& step,
+                   const string& input_filename, const string& output_filename)
+{
+    string filename = preview_filename(output_filename);
+    if (!preview_file_free(filename, input_filename))
+    {
+        cout << "Preview skipped." << endl;
+    }
+    else if (write_image_view(filename, ImageView(apply_preview_effect(preview, step, geometry))))
+    {
+        cout << "Preview written to " << filename << " (1/" << geometry.scale << " scale)." << endl;
+    }
+    else
+    {
+        cout << "Sorry, writing the preview failed." << endl;
+    }
+
+    string answer;
+    cout << "Write the full-quality image to " << output_filename << "? (y/n): \n";
+    getline(cin, answer);
+    return answer == "y" || answer == "Y";
+}
+
+
+//***************************************************************************************************//
+//                                   INTERACTIVE SESSION                                            //
+//
+// A session keeps one decoded image in memory and stacks effects on the current result.
+// The edit history stores the effect steps themselves plus a few checkpoint images:
+// undo replays the steps from the nearest earlier checkpoint rather than keeping a copy
+// of every state, and checkpoints are dropped, oldest first, once they use more than
+// the history budget. Nothing is written until the user saves.
+
+// Number of steps between checkpoints of the edit history
+const int SESSION_CHECKPOINT_INTERVAL = 4;
+
+// Default memory budget for history checkpoints (--history-size), in megabytes
+const int DEFAULT_HISTORY_MEGABYTES = 256;
+
+
+/**
+    Announces the chosen effect and asks the user for its parameters.
+
+    @param choice: Menu option of the effect (1-14).
+    @param step: Filled with the effect and its parameters.
+    @returns true if choice is an effect, false otherwise.
+*/
+bool prompt_effect_step(int choice, EffectStep& step)
+{
+    double scaling_factor; // to collect user-supplied scaling_factor
+
+    switch (choice) 
+    {
+        case 1: // Vignette effect
+        
+            cout << "Vignette selected\n";
+            cout << endl;
+            step.choice = 1;
+            break;
+
+        case 2: // Clarendon type effect
+
+            cout << "Clarendon selected\n";
+            cout << endl;
+            cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
+            cout << endl;
+            cin >> scaling_factor;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            // Check if the input is valid and within range
+            while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
+            {
+                cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: ";
+                cin >> scaling_factor;
+            }
+            step.choice = 2;
+            step.scaling_factor = scaling_factor;
+            break;
+
+        case 3: // Greyscale effect
+            
+            cout << "Greyscale selected\n";
+            cout << endl;
+            step.choice = 3;
+            break;
+
+        case 4: // Rotates by 90 degrees
+            
+            cout << "Rotate by 90 selected\n";
+            cout << endl;
+            step.choice = 4;
+            break;
+
+        case 5: // Rotates by 90 degrees n times
+
+            int n;
+            cout << "Rotate by 90 n number of times selected\n";
+            cout << endl;
+            cout << "Please enter number of times you would like to rotate by 90 degrees \n";
+            cout << endl;
+            cin >> n;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            // Check if the input is greater than zero)
+            while (handle_input_error() || n < 0)
+            {
+                cout << "Error. Please enter a valid number of times you would like image to rotate: ";
+                cin >> n;
+            }
+            step.choice = 5;
+            step.number = n;
+            break;
+
+        case 6: // Enlargens image
+            
+            int x_scale, y_scale;
+
+            cout << "Enlargen selected\n";
+            cout << endl;
+            cout << "Please enter non-negative integers for x-scale and y-scale separated by just a space: \n";
+            cout << endl;
+            cin >> x_scale >> y_scale;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            // Check if the inputs are valid (both should be integers and greater than zero)
+            while (handle_input_error() || x_scale < 0 || y_scale < 0) 
+            {
+                cout << "Invalid input. Both scales should be non-negative integers. Please enter x-scale and y-scale separated byjust a space: ";
+                cout << endl;
+                cin >> x_scale >> y_scale;
+            }
+            step.choice = 6;
+            step.xscale = x_scale;
+            step.yscale = y_scale;
+            break;
+
+        case 7:  // High contrast
+          
+            cout << "High-contrast selected\n";
+            cout << endl;
+            step.choice = 7;
+            break;
+
+        case 8: // Lightens image
+            
+            cout << "Lighten selected\n";
+            cout << endl;
+            cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
+            cout << endl;
+            cin >> scaling_factor;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
+            {
+                cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: \n";
+                cin >> scaling_factor;
+            }
+            step.choice = 8;
+            step.scaling_factor = scaling_factor;
+            break;
+
+        case 9: // Darkens image
+            
+            cout << "Darken selected\n";
+            cout << endl;
+            cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
+            cout << endl;
+            cin >> scaling_factor;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
+            {
+                cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: \n";
+                cin >> scaling_factor;
+            }
+            step.choice = 9;
+            step.scaling_factor = scaling_factor;
+            break;
+
+        case 10: // Convert to only black, white, red, blue, and green
+            
+            cout << "Black, white, red, blue, and green selected\n";
+            cout << endl;
+            step.choice = 10;
+            break;
+
+        case 11: // Box blur
+
+            int radius;
+            cout << "Box blur selected\n";
+            cout << endl;
+            cout << "Please enter a blur radius of at least 1 \n";
+            cout << endl;
+            cin >> radius;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            while (handle_input_error() || radius < 1)
+            {
+                cout << "Invalid input. Please enter a blur radius of at least 1: \n";
+                cin >> radius;
+            }
+            step.choice = 11;
+            step.radius = radius;
+            break;
+
+        case 12: // Gaussian blur
+
+            double sigma;
+            cout << "Gaussian blur selected\n";
+            cout << endl;
+            cout << "Please enter a blur strength (sigma) greater than 0.0 \n";
+            cout << endl;
+            cin >> sigma;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            while (handle_input_error() || sigma <= 0.0)
+            {
+                cout << "Invalid input. Please enter a blur strength (sigma) greater than 0.0: \n";
+                cin >> sigma;
+            }
+            step.choice = 12;
+            step.sigma = sigma;
+            break;
+
+        case 13: // Sharpen (unsharp mask)
+
+            double amount;
+            cout << "Sharpen selected\n";
+            cout << endl;
+            cout << "Please enter a blur strength (sigma) greater than 0.0 and a non-negative amount separated by just a space: \n";
+            cout << endl;
+            cin >> sigma >> amount;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            while (handle_input_error() || sigma <= 0.0 || amount < 0.0)
+            {
+                cout << "Invalid input. Please enter sigma (greater than 0.0) and amount (non-negative) separated by just a space: \n";
+                cin >> sigma >> amount;
+            }
+            step.choice = 13;
+            step.sigma = sigma;
+            step.amount = amount;
+            break;
+
+        case 14: // Custom 3x3 or 5x5 kernel
+        {
+            int kernel_size;
+            cout << "Custom kernel selected\n";
+            cout << endl;
+            cout << "Please enter the kernel size (3 or 5) \n";
+            cout << endl;
+            cin >> kernel_size;
+
+            while (handle_input_error() || (kernel_size != 3 && kernel_size != 5))
+            {
+                cout << "Invalid input. Please enter the kernel size (3 or 5): \n";
+                cin >> kernel_size;
+            }
+
+            vector<double> kernel(kernel_size * kernel_size);
+            cout << "Please enter the " << kernel.size() << " kernel weights row by row, separated by spaces: \n";
+            cout << endl;
+            for (size_t i = 0; i < kernel.size(); i++)
+            {
+                cin >> kernel[i];
+                if (handle_input_error())
+                {
+                    cout << "Please enter the " << kernel.size() << " kernel weights again: \n";
+                    i = -1; // restart from the first weight
+                }
+            }
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+
+            step.choice = 14;
+            step.kernel = kernel;
+            break;
+        }
+
+        case 15: // Color grade from a .cube 3D lookup table
+        {
+            string lut_file;
+            cout << "Color grade selected\n";
+            cout << endl;
+            cout << "Please enter the name of a .cube 3D LUT file: \n";
+            cout << endl;
+            getline(cin, lut_file);
+
+            while (handle_input_error() || !cached_color_lut(lut_file))
+            {
+                cout << "Unable to read that 3D LUT. Please enter the name of a .cube file: \n";
+                getline(cin, lut_file);
+            }
+
+            string interpolation;
+            cout << "Interpolate (t)etrahedrally or t(r)ilinearly? [t]: \n";
+            getline(cin, interpolation);
+
+            step.choice = 15;
+            step.lut_file = lut_file;
+            step.trilinear = (interpolation == "r" || interpolation == "R");
+            break;
+        }
 
-    @param image: The original image represented as a 2D vector of Pixel structs.
-    @param scaling_factor: Multiplier to adjust the brightness.
-    @returns An image that has been modified to exhibit the lightening effect.
-*/
-vector<vector<Pixel>> process8(const vector<vector<Pixel>>& image, double scaling_factor)
-{
-    // Determine the dimensions of the original image
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Prepare the modified image with the same dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Traverse the original image to apply the lightening effect
-    for (int row = 0; row < num_rows; row++)
-    {
-        for (int col = 0; col < num_columns; col++)
+        case 16: // Flip vertically
+        case 17: // Mirror horizontally
+        case 18: // Transpose
+            step.choice = choice;
+            break;
+
+        case 19: // Crop
         {
-            // Fetch the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            
-            // Adjust RGB values based on the scaling factor and confine within the permissible range
-            int new_red = min(255, max(0, 255 - static_cast<int>(round((255 - get<0>(rgb_values)) * scaling_factor))));
-            int new_green = min(255, max(0, 255 - static_cast<int>(round((255 - get<1>(rgb_values)) * scaling_factor))));
-            int new_blue = min(255, max(0, 255 - static_cast<int>(round((255 - get<2>(rgb_values)) * scaling_factor))));
+            Region region;
+            cout << "Crop selected\n";
+            cout << endl;
+            cout << "Please enter the left column, top row, width and height of the region separated by just a space: \n";
+            cout << endl;
+            cin >> region.col >> region.row >> region.num_columns >> region.num_rows;
+            cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
 
-            
-            // Store the adjusted pixel in the modified image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
+            while (handle_input_error() || region.col < 0 || region.row < 0 || region.num_columns <= 0 || region.num_rows <= 0)
+            {
+                cout << "Invalid input. Please enter a non-negative column and row, and a positive width and height: \n";
+                cin >> region.col >> region.row >> region.num_columns >> region.num_rows;
+                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+            }
+            step.choice = 19;
+            step.crop = region;
+            break;
         }
+
+        default:
+            return false;
     }
-    return new_image;  // Return the lightened image
+    return true;
 }
 
 
-// PROCESS 9
 /**
-    Applies a "Darkening" effect on an image by reducing its brightness using a scaling factor. 
-    This process ensures that RGB values never fall below the minimum limit.
+    Memory used by an image's pixels and alpha plane, in bytes.
+*/
+size_t image_handle_bytes(const ImageHandle& image)
+{
+    size_t bytes = 0;
+    for (const vector<Pixel>& row : image.pixels())
+    {
+        bytes += row.size() * sizeof(Pixel);
+    }
+    for (const vector<unsigned char>& row : image.alpha())
+    {
+        bytes += row.size();
+    }
+    return bytes;
+}
 
-    @param image: Original image in the form of a 2D vector of Pixel structs.
-    @param scaling_factor: Factor to reduce brightness.
-    @returns Modified image with the darkening effect.
+
+/**
+    Undo/redo history of a session: the original image, the effect steps applied to it
+    and checkpoint images at some of the positions in between.
 */
-vector<vector<Pixel>> process9(const vector<vector<Pixel>>& image, double scaling_factor)
+class EditHistory
 {
-    // Determine image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Create a new image of same dimensions
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Iterate over each pixel of the original image
-    for (int row = 0; row < num_rows; row++)
+public:
+    /**
+        @param original: The image the session started from; never dropped.
+        @param max_bytes: Memory budget for the other checkpoints.
+    */
+    EditHistory(ImageHandle original, size_t max_bytes)
+        : image(original), max_bytes(max_bytes)
     {
-        for (int col = 0; col < num_columns; col++)
+        checkpoints[0] = move(original);
+    }
+
+    /**
+        The image after the applied steps.
+    */
+    const ImageHandle& current() const
+    {
+        return image;
+    }
+
+    /**
+        Every step in the history; the first position() of them are applied, the rest can be redone.
+    */
+    const vector<EffectStep>& steps() const
+    {
+        return history;
+    }
+
+    size_t position() const
+    {
+        return applied;
+    }
+
+    /**
+        Applies an effect to the current image. Steps that were undone are forgotten.
+    */
+    void apply(const EffectStep& step)
+    {
+        history.resize(applied);
+        drop_checkpoints_after(applied);
+
+        image = apply_effect(move(image), step);
+        history.push_back(step);
+        applied++;
+        if (applied % SESSION_CHECKPOINT_INTERVAL == 0)
         {
-            // Extract the RGB values of the current pixel
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            
-            // Compute the adjusted RGB values using the scaling factor and confine them within the permissible range
-            int new_red = min(255, max(0, static_cast<int>(get<0>(rgb_values) * scaling_factor)));
-            int new_green = min(255, max(0, static_cast<int>(get<1>(rgb_values) * scaling_factor)));
-            int new_blue = min(255, max(0, static_cast<int>(get<2>(rgb_values) * scaling_factor)));
-            
-            // Update the pixel in the new image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
+            add_checkpoint();
+        }
+    }
+
+    /**
+        Goes back one step by replaying the history from the nearest checkpoint.
+
+        @returns false if there is nothing to undo.
+    */
+    bool undo()
+    {
+        if (applied == 0)
+        {
+            return false;
+        }
+        applied--;
+
+        map<size_t, ImageHandle>::const_iterator checkpoint = prev(checkpoints.upper_bound(applied));
+        EffectGraph replay(vector<EffectStep>(history.begin() + checkpoint->first, history.begin() + applied));
+        replay.optimize();
+        image = replay.evaluate(checkpoint->second);
+        return true;
+    }
+
+    /**
+        Applies the next undone step again.
+
+        @returns false if there is nothing to redo.
+    */
+    bool redo()
+    {
+        if (applied == history.size())
+        {
+            return false;
+        }
+        applied++;
+
+        map<size_t, ImageHandle>::const_iterator checkpoint = checkpoints.find(applied);
+        image = (checkpoint != checkpoints.end()) ? checkpoint->second : apply_effect(move(image), history[applied - 1]);
+        return true;
+    }
+
+    /**
+        Memory held by checkpoints other than the original, in bytes.
+    */
+    size_t checkpoint_bytes() const
+    {
+        return used_bytes;
+    }
+
+private:
+    ImageHandle image;
+    vector<EffectStep> history;
+    size_t applied = 0;
+    map<size_t, ImageHandle> checkpoints;  // Image after that many steps
+    size_t max_bytes;
+    size_t used_bytes = 0;
+
+    /**
+        Keeps the current image as a checkpoint, then drops the oldest checkpoints
+        (never the original) until they fit the budget again.
+    */
+    void add_checkpoint()
+    {
+        checkpoints[applied] = image;
+        used_bytes += image_handle_bytes(image);
+        while (used_bytes > max_bytes && checkpoints.size() > 1)
+        {
+            map<size_t, ImageHandle>::iterator oldest = next(checkpoints.begin());
+            used_bytes -= image_handle_bytes(oldest->second);
+            checkpoints.erase(oldest);
+        }
+    }
+
+    void drop_checkpoints_after(size_t position)
+    {
+        map<size_t, ImageHandle>::iterator checkpoint = checkpoints.upper_bound(position);
+        while (checkpoint != checkpoints.end())
+        {
+            used_bytes -= image_handle_bytes(checkpoint->second);
+            checkpoint = checkpoints.erase(checkpoint);
         }
     }
+};
+
+
+/**
+    Prints the session menu: the effects and the history commands.
+
+    @param filename: The image being edited.
+    @param history: The session's edit history.
+*/
+void display_session_menu(const string& filename, const EditHistory& history)
+{
+    cout << "\nEditing " << filename << " (" << history.position() << " of " << history.steps().size() << " effects applied)" << endl;
+    cout << "Please enter option number, or 'u' undo, 'r' redo, 'h' history, 's' save, 'q' quit: " << endl;
+    cout << endl;
+    display_effect_menu();
+}
 
-    return new_image;  // Return the darkened image
+
+/**
+    Lists the effects of the history, marking the ones that have been undone.
+*/
+void display_history(const EditHistory& history)
+{
+    if (history.steps().empty())
+    {
+        cout << "No effects applied yet.\n";
+        return;
+    }
+    for (size_t i = 0; i < history.steps().size(); i++)
+    {
+        const EffectStep& step = history.steps()[i];
+        cout << setw(4) << right << i + 1 << ". " << EFFECT_NAMES[step.choice] << " (" << step.choice << ")"
+             << (i < history.position() ? "" : "  [undone]") << endl;
+    }
+    cout << left;
 }
 
 
 /**
-    Convert the image to emphasize only the colors: Black, White, Red, Blue, and Green.
+    Interactive editing of one image held in memory. Usage:
+        program --session <input> [--history-size n]
+    Effects are stacked on the current result and can be undone and redone; the
+    result is only written when the user saves it.
 
-    @param the original image, in the form of a 2D vector of Pixel structs.
-    @returns a modified image that emphasizes the Black, White, Red, Blue, and Green colors.
+    @param argc: Argument count passed to main.
+    @param argv: Arguments passed to main.
+    @returns 0 when the user quits, 1 if the arguments or the input are invalid.
 */
-vector<vector<Pixel>> process10(const vector<vector<Pixel>>& image)
+int run_session(int argc, char* argv[])
 {
-    // Get the image dimensions
-    pair<int, int> dimensions = get_image_dimensions(image);
-    int num_rows = dimensions.first;
-    int num_columns = dimensions.second;
-    
-    // Initialize an image to store the modifications
-    vector<vector<Pixel>> new_image = initialize_new_image(num_rows, num_columns);
-    
-    // Declare new RGB values in advance
-    int new_red, new_green, new_blue; 
+    int history_megabytes = DEFAULT_HISTORY_MEGABYTES;
+    bool valid = (argc == 3 || argc == 5);
+    if (valid && argc == 5)
+    {
+        stringstream value_stream(argv[4]);
+        valid = (string(argv[3]) == "--history-size" && value_stream >> history_megabytes && history_megabytes >= 0);
+    }
+    if (!valid)
+    {
+        cerr << "Usage: " << argv[0] << " --session <input> [--history-size n]" << endl;
+        return 1;
+    }
 
-    // Iterate through each pixel of the input image
-    for (int row = 0; row < num_rows; row++)
+    string input_filename = argv[2];
+    ImageHandle original;
+    ImageSource source;
+    if (!load_image_handle(input_filename, original, source))
     {
-        for (int col = 0; col < num_columns; col++)
+        cerr << "Error: Unable to read " << input_filename << "." << endl;
+        return 1;
+    }
+    EditHistory history(move(original), static_cast<size_t>(history_megabytes) << 20);
+    bool unsaved = false;
+
+    string command;
+    while (true)
+    {
+        display_session_menu(input_filename, history);
+        if (!getline(cin, command))
         {
-            // Extract the current pixel's RGB values
-            tuple<int, int, int> rgb_values = get_pixel_rgb(image, row, col);
-            int red_value = get<0>(rgb_values);
-            int green_value = get<1>(rgb_values);
-            int blue_value = get<2>(rgb_values);
-            
-            // Determine dominant color and adjust pixel accordingly
-            int max_color = max(red_value, max(green_value, blue_value));
-            if ((red_value + green_value + blue_value) >= 550)   // White
-            {
-                new_red = 255;
-                new_green = 255;
-                new_blue = 255;
-            }
-            else if ((red_value + green_value + blue_value) <= 150)  // Black
+            return 0;
+        }
+
+        if (command == "q" || command == "Q")
+        {
+            if (unsaved)
             {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 0;
+                cout << "Discarding unsaved edits.\n";
             }
-            else if (max_color == red_value)  // Red
+            cout << "Exiting program...Goodbye!" << endl;
+            return 0;
+        }
+        if (command == "u" || command == "U")
+        {
+            cout << (history.undo() ? "Undone.\n" : "Nothing to undo.\n");
+            unsaved = true;
+            continue;
+        }
+        if (command == "r" || command == "R")
+        {
+            cout << (history.redo() ? "Redone.\n" : "Nothing to redo.\n");
+            unsaved = true;
+            continue;
+        }
+        if (command == "h" || command == "H")
+        {
+            display_history(history);
+            continue;
+        }
+        if (command == "s" || command == "S")
+        {
+            string output_filename = get_filename("Enter output BMP filename (or 'q' to cancel): \n");
+            if (output_filename == "q" || !ensure_unique_output_filename(input_filename, output_filename))
             {
-                new_red = 255;
-                new_green = 0;
-                new_blue = 0;
+                continue;
             }
-            else if (max_color == green_value)  // Green
+            if (write_image_file(output_filename, history.current().pixels(), history.current().alpha()))
             {
-                new_red = 0;
-                new_green = 255;
-                new_blue = 0;
+                cout << "Saved " << output_filename << ".\n";
+                unsaved = false;
             }
-            else  // Blue
+            else
             {
-                new_red = 0;
-                new_green = 0;
-                new_blue = 255;
+                cout << "Sorry, saving " << output_filename << " failed.\n";
             }
+            continue;
+        }
 
-            // Store the modified pixel in the new image
-            store_pixel(new_image, row, col, new_red, new_green, new_blue);
+        int choice;
+        EffectStep step;
+        stringstream str_to_int_converter(command);
+        if (str_to_int_converter >> choice && prompt_effect_step(choice, step))
+        {
+            history.apply(step);
+            unsaved = true;
+            cout << EFFECT_NAMES[choice] << " applied.\n";
+        }
+        else
+        {
+            cout << "Invalid choice. Please try again.\n";
         }
     }
-
-    return new_image;
 }
 
 //***************************************************************************************************//
 
-int main()
+#ifndef NYARKO_LIBRARY
+int main(int argc, char* argv[])
 {
+    // Non-interactive batch pipeline
+    if (argc > 1 && string(argv[1]) == "--batch")
+    {
+        return run_batch(argc, argv);
+    }
+
+    // Effect chain baked into a .cube color grade
+    if (argc > 1 && string(argv[1]) == "--bake-lut")
+    {
+        return run_bake_lut(argc, argv);
+    }
+
+    // BMP frames from standard input to standard output
+    if (argc > 1 && string(argv[1]) == "--stream")
+    {
+        return run_stream(argc, argv);
+    }
+
+    // Long-running job server on a Unix domain socket, and its client
+    if (argc > 1 && string(argv[1]) == "--daemon")
+    {
+        return run_daemon(argc, argv);
+    }
+    if (argc > 1 && string(argv[1]) == "--submit")
+    {
+        return run_client(argc, argv);
+    }
+
+    // Editing one image in memory with undo and redo
+    if (argc > 1 && string(argv[1]) == "--session")
+    {
+        return run_session(argc, argv);
+    }
+
+    // Interactive options: --cache dir [--cache-size n] [--preview n]
+    BatchOptions options;
+    int preview_size = 0; // longest side of previews, or 0 to process the full image straight away
+    for (int arg = 1; arg < argc; arg += 2)
+    {
+        stringstream value_stream(arg + 1 < argc ? argv[arg + 1] : "");
+        if (string(argv[arg]) == "--preview" && value_stream >> preview_size && preview_size > 0)
+        {
+            continue;
+        }
+        if (arg + 1 >= argc || !parse_pipeline_option(argv[arg], argv[arg + 1], options))
+        {
+            cerr << "Usage: " << argv[0] << " [--cache dir] [--cache-size n] [--preview n]" << endl;
+            return 1;
+        }
+    }
+    unique_ptr<ResultCache> cache = open_result_cache(options);
+
+
     bool done = false; // controls main while loop
     bool processed = false; // for if image processing was successful
+    ImageHandle input_image; // kept between iterations, so choosing the same file again does not re-read it
+    ImageSource input_source; // the file input_image was read from
+    ImageHandle preview_image; // sample of the input in preview mode; input_image is then read only when asked for
+    PreviewGeometry preview_geometry; // how preview_image relates to the full input
+
+    // Read in an image file, or in preview mode just a sample of it
+    auto load_input = [&](const string& filename)
+    {
+        return (preview_size > 0) ? load_preview(filename, preview_size, preview_image, preview_geometry)
+                                  : load_image_handle(filename, input_image, input_source);
+    };
 
     // Print welcome message
     cout << endl;
@@ -980,22 +11016,22 @@ int main()
         processed = false;
         string input_filename, output_filename; // to store input and output filenames
         
-        vector<vector<Pixel>> input_image, output_image; // to store input and out images
+        ImageView output_image; // to store output image (a view of input_image when only pixels move)
         
         // Get input filename from user. Potential error handled in get_filename function
         input_filename = get_filename("Enter input BMP filename (or 'q' to quit): \n");
         if (input_filename == "q") {return 0; }
         
-        // Read in BMP image file into a 2D vector
-        input_image = read_image(input_filename);
+        // Read in BMP image file, unless it is already in memory and unchanged
+        bool loaded = load_input(input_filename);
         
         // If file is empty or doesn't exist in directory, don't end program. Let user retry
-        while (input_image.empty()) 
+        while (!loaded) 
         {
             cout << "Error: Unable to open the file or the file doesn't exist. Please enter a valid filename.\n";
             input_filename = get_filename("Enter input BMP filename (or 'q' to quit): \n");
             if (input_filename == "q") {return 0;}
-            input_image = read_image(input_filename);
+            loaded = load_input(input_filename);
         }
         
         // Get output filename from user. Potential error handled in get_filename function
@@ -1015,7 +11051,7 @@ int main()
         // Display menu and prompt user for edit type selection
         choice = prompt_and_get_menu_choice(input_filename);
         
-        double scaling_factor; // to collect user-supplied scaling_factor
+        EffectStep step; // the chosen effect and its parameters
         
         switch (choice) 
         {
@@ -1031,146 +11067,55 @@ int main()
                 cout << endl;
                 break;
 
-            case 1: // Vignette effect
-            
-                cout << "Vignette selected\n";
-                cout << endl;
-                output_image = process1(input_image);
-                processed = true;
-                break;
-
-            case 2: // Clarendon type effect
-
-                cout << "Clarendon selected\n";
-                cout << endl;
-                cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
-                cout << endl;
-                cin >> scaling_factor;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
-
-                // Check if the input is valid and within range
-                while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
-                {
-                    cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: ";
-                    cin >> scaling_factor;
-                }
-                output_image = process2(input_image, scaling_factor);
-                processed = true;
-                break;
-
-            case 3: // Greyscale effect
-                
-                cout << "Greyscale selected\n";
-                cout << endl;
-                output_image = process3(input_image);
-                processed = true;
-                break;
-
-            case 4: // Rotates by 90 degrees
-                
-                cout << "Rotate by 90 selected\n";
-                cout << endl;
-                output_image = process4(input_image);
-                processed = true;
-                break;
-
-            case 5: // Rotates by 90 degrees n times
-
-                int n;
-                cout << "Rotate by 90 n number of times selected\n";
-                cout << endl;
-                cout << "Please enter number of times you would like to rotate by 90 degrees \n";
-                cout << endl;
-                cin >> n;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
-
-                // Check if the input is greater than zero)
-                while (handle_input_error() || n < 0)
-                {
-                    cout << "Error. Please enter a valid number of times you would like image to rotate: ";
-                    cin >> n;
-                }
-                output_image = process5(input_image, n);
-                processed = true;
-                break;
-
-            case 6: // Enlargens image
-                
-                int x_scale, y_scale;
-
-                cout << "Enlargen selected\n";
-                cout << endl;
-                cout << "Please enter non-negative integers for x-scale and y-scale separated by just a space: \n";
-                cout << endl;
-                cin >> x_scale >> y_scale;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+            default: // An effect: ask for its parameters
 
-                // Check if the inputs are valid (both should be integers and greater than zero)
-                while (handle_input_error() || x_scale < 0 || y_scale < 0) 
+                processed = prompt_effect_step(choice, step);
+                if (!processed)
                 {
-                    cout << "Invalid input. Both scales should be non-negative integers. Please enter x-scale and y-scale separated byjust a space: ";
-                    cout << endl;
-                    cin >> x_scale >> y_scale;
+                    cout << "Wrong choice. Please choose a valid option: \n";
                 }
-                output_image = process6(input_image, x_scale, y_scale);
-                processed = true;
-                break;
-
-            case 7:  // High contrast
-              
-                cout << "High-contrast selected\n";
-                cout << endl;
-                output_image = process7(input_image);
-                processed = true;
-                break;
+         }
 
-            case 8: // Lightens image
-                
-                cout << "Lighten selected\n";
-                cout << endl;
-                cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
-                cout << endl;
-                cin >> scaling_factor;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
+        // In preview mode the effect is shown on the sample first, and the full image is read only if asked for
+        if (processed && preview_size > 0)
+        {
+            processed = offer_preview(preview_image, preview_geometry, step, input_filename, output_filename);
+            if (processed && !load_image_handle(input_filename, input_image, input_source))
+            {
+                cout << "Error: Unable to open the file or the file doesn't exist. Going back to image selection...\n";
+                processed = false;
+            }
+        }
 
-                while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
+        // Apply the chosen effect, or reuse the result of an earlier identical request
+        if (processed)
+        {
+            unsigned long long key = cache ? result_cache_key(input_image.pixels(), input_image.alpha(), {step}) : 0;
+            vector<vector<Pixel>> cached_image;
+            AlphaPlane cached_alpha;
+            if (cache && cache->lookup(key, cached_image, cached_alpha))
+            {
+                output_image = ImageView(ImageHandle(move(cached_image), move(cached_alpha)));
+                cout << "Using cached result (" << cache->hit_count() << " hits, " << cache->miss_count() << " misses)\n";
+            }
+            else if (is_view_effect(step.choice) && !cache)
+            {
+                // Rotations, flips, transposes and crops are written straight from a view of the input
+                output_image = ImageView(input_image);
+                if (!apply_view_effect(output_image.transform, step))
                 {
-                    cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: \n";
-                    cin >> scaling_factor;
+                    cerr << "Crop region lies outside the image. Returning original image." << endl;
                 }
-                output_image = process8(input_image, scaling_factor);
-                processed = true;
-                break;
-
-            case 9: // Darkens image
-                
-                cout << "Darken selected\n";
-                cout << endl;
-                cout << "Please enter a scaling factor between 0.0 and 1.0 \n";
-                cout << endl;
-                cin >> scaling_factor;
-                cin.ignore(numeric_limits<streamsize>::max(), '\n'); // clear input buffer
-
-                while (handle_input_error() || scaling_factor < 0.0 || scaling_factor > 1.0) 
+            }
+            else
+            {
+                output_image = ImageView(apply_effect(input_image, step));
+                if (cache)
                 {
-                    cout << "Invalid input. Please enter a scaling factor between 0.0 and 1.0: \n";
-                    cin >> scaling_factor;
+                    cache->store(key, output_image.image.pixels(), output_image.image.alpha());
                 }
-                output_image = process9(input_image, scaling_factor);
-                processed = true;
-                break;
-
-            case 10: // Convert to only black, white, red, blue, and green
-                
-                cout << "Black, white, red, blue, and green selected\n";
-                cout << endl;
-                output_image = process10(input_image);
-                processed = true;
-                break;
-
-            default:
-                cout << "Wrong choice. Please choose a valid option: \n";
-         }
+            }
+        }
         
         // Check if any processing was successful, if so, 
         // write the image, display success, and take user back to start (image selection)
@@ -1178,7 +11123,7 @@ int main()
         if (processed)
         {
             //Write the resulting 2D vector to a new BMP image file (using write_image function)
-            bool success = write_image(output_filename, output_image);
+            bool success = write_image_view(output_filename, output_image);
 
             if (!success)
             {
@@ -1192,3 +11137,4 @@ int main()
     }
     return 0;       
 }
+#endif